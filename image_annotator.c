@@ -1,13 +1,25 @@
+#define _GNU_SOURCE  // memfd_create
 #include <gtk/gtk.h>
 #include <cairo.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <png.h>
+#include <turbojpeg.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <gio/gunixconnection.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixsocketaddress.h>
+#include <signal.h>
+#include <sys/mman.h>
 
 // Global variables
 GtkWidget *drawing_area;
-GdkPixbuf *original_pixbuf = NULL;
 GdkPixbuf *current_pixbuf = NULL;
-cairo_surface_t *surface = NULL;
 gboolean is_drawing = FALSE;
 gdouble last_x = 0;
 gdouble last_y = 0;
@@ -22,6 +34,8 @@ GtkWidget *color_button = NULL; // Add color button as global variable
 gboolean has_changes = FALSE;  // Track if any actual drawing has occurred
 gboolean has_moved = FALSE;  // Add this global variable to track if we've moved since pressing
 gboolean is_crop_mode = FALSE;
+gboolean is_redact_mode = FALSE;  // Blur/pixelate a dragged rectangle
+gboolean is_fill_mode = FALSE;    // Flood fill from the clicked pixel
 gboolean is_selecting = FALSE;
 gdouble crop_start_x = 0;
 gdouble crop_start_y = 0;
@@ -35,14 +49,54 @@ static gboolean popup_visible = FALSE;
 // Add these as global variables
 static GtkWidget *mode_menu = NULL;
 static int current_mode = 0;
+static gboolean save_optimized = FALSE;  // Write indexed PNGs where possible
+static GtkWidget *transform_menu = NULL;
+
+// Rows for the PNG writer: returns row y, either in place or converted into
+// scratch (which has room for one row)
+typedef png_bytep (*PngRowFunc)(gpointer data, int y, guint8 *scratch);
+
+typedef struct {
+    int width;
+    int height;
+    gboolean has_alpha;
+    PngRowFunc get_row;
+    gboolean converts;         // get_row fills scratch rather than returning rows in place
+    gpointer data;
+    const png_color *palette;  // Rows are palette indices when set
+    int n_palette;
+    const png_byte *trans;     // Alpha of the first n_trans palette entries
+    int n_trans;
+} PngRowSource;
+
+#define PNG_ROW_BLOCK 16  // Rows passed to libpng per call
+#define JPEG_SAVE_QUALITY "92"  // For JPEGs that cannot be saved losslessly
 
 // Add this enum definition before the mode_info array
 typedef enum {
     MODE_DRAW,
     MODE_TEXT,
-    MODE_CROP
+    MODE_CROP,
+    MODE_BLUR,
+    MODE_PIXELATE,
+    MODE_FILL
 } EditorMode;
 
+// How a redaction rectangle is obscured
+typedef enum {
+    REDACT_BLUR,
+    REDACT_PIXELATE
+} RedactStyle;
+
+RedactStyle redact_style = REDACT_BLUR;
+
+// Redaction strength, scaled with the selection so glyph shapes do not survive
+#define REDACT_BLUR_PASSES 3      // Three box passes approximate a Gaussian
+#define REDACT_MIN_RADIUS 6
+#define REDACT_MAX_RADIUS 48
+#define REDACT_MIN_BLOCK 8
+#define REDACT_MAX_BLOCK 64
+
 // Structure to hold mode information
 typedef struct {
     const char *icon_name;
@@ -53,65 +107,535 @@ typedef struct {
 static const ModeInfo mode_info[] = {
     {"x-office-drawing", "Draw freely on the image", MODE_DRAW},
     {"insert-text", "Add text annotations", MODE_TEXT},
-    {"edit-cut", "Crop the image", MODE_CROP}
+    {"edit-cut", "Crop the image", MODE_CROP},
+    {"security-high", "Blur a region (redact)", MODE_BLUR},
+    {"view-grid-symbolic", "Pixelate a region (redact)", MODE_PIXELATE},
+    {"applications-graphics", "Fill an area with the pen color", MODE_FILL}
+};
+
+// Lossless geometric operations on the whole image
+typedef enum {
+    TRANSFORM_ROTATE_90,       // Clockwise
+    TRANSFORM_ROTATE_180,
+    TRANSFORM_ROTATE_270,      // Counter-clockwise
+    TRANSFORM_FLIP_HORIZONTAL,
+    TRANSFORM_FLIP_VERTICAL
+} ImageTransform;
+
+// Layout of an image's pixels, read from the pixbuf's channel count.  Opaque
+// images are kept without alpha; see pool_pixbuf_import.
+typedef enum {
+    PIXEL_FORMAT_RGB24,   // 3 bytes per pixel, opaque
+    PIXEL_FORMAT_RGBA32   // 4 bytes per pixel, straight alpha
+} PixelFormat;
+
+// Row converters between a pixel format and its cairo surface format
+typedef void (*PixelRowToCairo)(const guint8 *in, guint32 *out, int width);
+typedef void (*PixelRowFromCairo)(const guint32 *in, guint8 *out, int width);
+
+typedef struct {
+    const char *icon_name;
+    const char *label;
+    ImageTransform transform;
+} TransformInfo;
+
+static const TransformInfo transform_info[] = {
+    {"object-rotate-right", "Rotate 90° clockwise", TRANSFORM_ROTATE_90},
+    {"object-rotate-left", "Rotate 90° counter-clockwise", TRANSFORM_ROTATE_270},
+    {"view-refresh", "Rotate 180°", TRANSFORM_ROTATE_180},
+    {"object-flip-horizontal", "Flip horizontally", TRANSFORM_FLIP_HORIZONTAL},
+    {"object-flip-vertical", "Flip vertically", TRANSFORM_FLIP_VERTICAL}
 };
 
+// What an undo entry records.  Snapshots keep the full image in states[];
+// transforms keep only the operation and are undone by applying the inverse.
+// Fills keep the spans they painted and are redone by painting them again.
+// Adjustments keep their parameters and are redone by applying them again.
+typedef enum {
+    UNDO_SNAPSHOT,
+    UNDO_TRANSFORM,
+    UNDO_FILL,
+    UNDO_ADJUST
+} UndoKind;
+
+// Tone adjustments, applied in this order
+typedef struct {
+    gint black;         // Input levels mapped to 0 and 255
+    gint white;
+    gdouble gamma;
+    gint brightness;    // -100 to 100
+    gint contrast;      // -100 to 100
+    gboolean grayscale;
+} Adjustments;
+
+#define ADJUSTMENTS_IDENTITY {0, 255, 1.0, 0, 0, FALSE}
+
+// A run of filled pixels on one row, x0 to x1 inclusive
+typedef struct {
+    gint y;
+    gint x0;
+    gint x1;
+} FillSpan;
+
+// How the image at an undo entry derives from the JPEG it was opened from,
+// when only crops and transforms have been applied: crop the source to
+// crop, then transpose if swap and mirror along each flipped axis
+typedef struct {
+    gboolean valid;
+    gboolean swap;
+    gboolean flip_x;
+    gboolean flip_y;
+    GdkRectangle crop;  // In source pixels
+} LosslessPlan;
+
+typedef struct {
+    UndoKind kind;
+    ImageTransform transform;
+    GArray *spans;  // FillSpan, for UNDO_FILL
+    GdkRGBA color;  // Fill color, for UNDO_FILL
+    Adjustments adjust;  // For UNDO_ADJUST
+    LosslessPlan lossless;  // Set by push_undo_op for transforms and by perform_crop
+} UndoOp;
+
+// An undo snapshot deflated under memory pressure, in independent bands of
+// rows so packing and unpacking run in parallel
+typedef struct {
+    GBytes **bands;
+    int n_bands;
+    int width;
+    int height;
+    gboolean has_alpha;
+} PackedSnapshot;
+
 typedef struct {
-    GdkPixbuf *states[MAX_UNDO_STACK];
+    GdkPixbuf *states[MAX_UNDO_STACK];  // NULL for entries that are not snapshots
+    PackedSnapshot *packed[MAX_UNDO_STACK];  // Set instead of states once compressed
+    UndoOp ops[MAX_UNDO_STACK];
     int current;  // Current position in the stack
     int top;      // Top of the stack
 } UndoStack;
 
 UndoStack undo_stack = {.current = -1, .top = -1};
+
+// The stroke in progress is drawn opaque into a scratch layer covering only
+// its bounding box, shown over the image with the pen alpha in on_draw and
+// merged into current_pixbuf once on release.  Drawing opaque and applying
+// alpha once keeps translucent strokes from darkening at segment joins.
+typedef struct {
+    cairo_surface_t *surface;  // ARGB32, NULL when no stroke is active
+    int x;                     // Image position of the layer's top-left corner
+    int y;
+    int width;
+    int height;
+    int line_width;            // Pen width in image pixels, fixed per stroke
+} StrokeLayer;
+
+StrokeLayer stroke_layer = {NULL, 0, 0, 0, 0, 0};
+
+// current_pixbuf converted for cairo at the widget's scale factor, so drawing
+// it is a straight blit.  The render thread converts into the back buffer of
+// a pair while on_draw paints the front one.
+typedef enum {
+    RENDER_IMAGE,   // Show a new image, converting all of it
+    RENDER_AREA,    // Pixels of the image changed in place
+    RENDER_STOP
+} RenderCommandType;
+
+typedef struct {
+    RenderCommandType type;
+    GdkPixbuf *pixbuf;   // RENDER_IMAGE: a reference for the render thread, or NULL
+    int scale;           // RENDER_IMAGE
+    GdkRectangle area;   // RENDER_AREA, in image pixels
+    guint seq;
+} RenderCommand;
+
+typedef struct {
+    cairo_surface_t *surfaces[2];
+    GdkRectangle damage[2];  // Render thread only: what each buffer is missing
+    int width;
+    int height;
+    int scale;
+    cairo_format_t format;
+} RenderTarget;
+
+#define RENDER_QUEUE_SIZE 256  // A power of two
+
+typedef struct {
+    // Lock-free ring with one producer (the UI thread, which advances head)
+    // and one consumer (the render thread, which advances tail)
+    RenderCommand commands[RENDER_QUEUE_SIZE];
+    gint head;
+    gint tail;
+    guint posted_seq;
+    
+    GThread *thread;
+    GMutex lock;           // Only for sleeping and waking the render thread
+    GCond cond;
+    gint sleeping;
+    gint frame_pending;    // A published frame has not been adopted yet
+    
+    // UI thread only
+    RenderTarget *target;  // Owner of the front buffer
+    int front;             // Buffer on_draw paints, or -1 before the first frame
+    guint shown_seq;       // Last command the front buffer reflects
+    cairo_surface_t *overlay;  // A committed stroke, drawn until its frame is shown
+    GdkRectangle overlay_area;
+    double overlay_alpha;
+    guint overlay_seq;
+} Renderer;
+
+Renderer render = {.front = -1};
+#define STROKE_LAYER_SLACK 64  // Extra pixels allocated when the layer grows
+
+// A second image shown against current_pixbuf
+typedef enum {
+    COMPARE_SWIPE,       // The other image right of a draggable split
+    COMPARE_BLEND,       // The other image over this one, partly transparent
+    COMPARE_DIFFERENCE   // Heatmap of changed pixels
+} CompareView;
+
+typedef struct {
+    GdkPixbuf *other;                 // NULL when not comparing
+    cairo_surface_t *other_surface;
+    cairo_surface_t *heatmap;         // RGB24, the size of current_pixbuf
+    GArray *regions;                  // GdkRectangle bounds of changed areas
+    CompareView view;
+    double position;                  // Swipe split or blend amount, 0..1
+    int selected;                     // Highlighted region, or -1
+    gboolean dragging;                // Dragging the swipe handle
+    gboolean valid;                   // heatmap and regions match current_pixbuf
+    guint rebuild_source;             // Idle rebuild pending after an edit
+} CompareState;
+
+CompareState compare = {NULL, NULL, NULL, NULL, COMPARE_SWIPE, 0.5, -1, FALSE, FALSE, 0};
+static GtkWidget *compare_bar = NULL;
+static GtkWidget *compare_title = NULL;
+static GtkWidget *compare_scale = NULL;
+static GtkWidget *compare_summary = NULL;
+static GtkWidget *compare_region_combo = NULL;
+static GtkWidget *compare_annotate_button = NULL;
+
+// Magnifier following the pointer
+typedef struct {
+    gboolean enabled;   // Toggled from the toolbar
+    gboolean visible;   // The pointer is over the image
+    int image_x;        // Pixel under the pointer
+    int image_y;
+    GdkRectangle area;  // Widget coordinates of the loupe
+} Loupe;
+
+Loupe loupe = {FALSE, FALSE, 0, 0, {0, 0, 0, 0}};
+
+// Preview of the adjustments dialog on a downscaled proxy of current_pixbuf
+typedef struct {
+    GdkPixbuf *proxy;           // current_pixbuf scaled down
+    GdkPixbuf *adjusted;        // proxy with the dialog's adjustments
+    cairo_surface_t *surface;   // adjusted, drawn over the image
+    Adjustments params;
+    guint idle_id;              // Pending preview update
+} AdjustPreview;
+
+AdjustPreview adjust_preview = {NULL, NULL, NULL, ADJUSTMENTS_IDENTITY, 0};
+
+// Bumped whenever current_pixbuf's pixels change, to tag derived data
+static guint image_generation = 1;
+
+// Where crop edges snap to, for one image generation
+typedef struct {
+    guint generation;   // 0 before the first computation
+    gboolean pending;   // A computation is running
+    gint *snap_x;       // Snap target of every column boundary 0..width
+    gint *snap_y;
+    gint width;
+    gint height;
+} EdgeSnap;
+
+EdgeSnap edge_snap = {0, FALSE, NULL, NULL, 0, 0};
+
+// Files queued from the command line for review
+typedef struct {
+    char *path;
+    GdkPixbuf *pixbuf;   // Decoded ahead of time, or NULL
+    gboolean decoding;
+    gboolean saving;     // Its annotated copy is being written
+    gboolean failed;
+} ReviewItem;
+
+typedef struct {
+    GPtrArray *items;    // ReviewItem, NULL without a queue
+    gint index;          // The item in view
+    gboolean waiting;    // The item in view is still being decoded
+    guint generation;    // Bumped when the queue is replaced or ended
+    gint saves_pending;
+    GThreadPool *decode_pool;
+    GThreadPool *save_pool;
+} ReviewQueue;
+
+ReviewQueue review = {NULL, -1, FALSE, 0, 0, NULL, NULL};
+static GtkWidget *review_bar = NULL;
+static GtkWidget *review_label = NULL;
+static GtkWidget *review_prev_button = NULL;
+static GtkWidget *review_next_button = NULL;
+static GtkWidget *review_save_button = NULL;
+
+// Bytes held per category, measured against a budget
+typedef enum {
+    MEMORY_IMAGE,    // current_pixbuf and its drawing surfaces
+    MEMORY_UNDO,     // Undo snapshots and fill spans
+    MEMORY_CACHES,   // Display surfaces, previews, prefetched images, pooled buffers
+    MEMORY_SAVES,    // Images handed to a writer thread
+    MEMORY_CATEGORIES
+} MemoryCategory;
+
+typedef struct {
+    gsize current[MEMORY_CATEGORIES];
+    gsize peak[MEMORY_CATEGORIES];
+    gsize peak_total;
+    gsize budget;
+    gsize pending_saves;  // Updated atomically by writer threads
+    gboolean pressure;    // Over budget at the last measurement
+    gboolean relieving;
+    gsize stuck_total;    // Still over budget after the last relief, or 0
+    gboolean print_stats; // --stats
+} MemoryBudget;
+
+#define MEMORY_DEFAULT_BUDGET_MB 1024
+#define MEMORY_SLACK_DIVISOR 8  // Relief aims budget / 8 below the budget
+
+MemoryBudget memory = {.budget = (gsize)MEMORY_DEFAULT_BUDGET_MB * 1024 * 1024};
+static GtkWidget *memory_label = NULL;
+
+// Record types of the operation journal
+typedef enum {
+    JOURNAL_BEGIN = 1,  // Base image mtime, size and path
+    JOURNAL_STROKE,     // Color, width, points
+    JOURNAL_TEXT,       // Position, color, font, text
+    JOURNAL_CROP,       // Rectangle
+    JOURNAL_RESIZE,     // New size
+    JOURNAL_REDACT,     // Style, rectangle
+    JOURNAL_TRANSFORM,  // ImageTransform
+    JOURNAL_UNDO,
+    JOURNAL_REDO,
+    JOURNAL_FILL,       // Seed point, color
+    JOURNAL_OUTLINE,    // Color, width, rectangles
+    JOURNAL_ADJUST      // Adjustments
+} JournalRecordType;
+
+// Points of the stroke in progress, kept for the operation journal
+typedef struct {
+    gfloat x;
+    gfloat y;
+} JournalPoint;
+
+static GArray *stroke_points = NULL;
 GtkWidget *undo_button;
 GtkWidget *redo_button;
 
+// Application instance state
+#define APPLICATION_ID "io.github.rickspencer3.ImageAnnotator"
+static GtkWidget *main_window = NULL;
+static gboolean resident_mode = FALSE;       // --background: keep the process warm
+static gboolean resident_warmed_up = FALSE;
+static gint64 launch_time = 0;               // Start of the launch being timed
+static gboolean first_paint_pending = FALSE;
+
+// Thumbnail previews for the open dialog and the recent-files strip
+#define THUMBNAIL_SIZE 128           // The spec's "normal" size
+#define THUMBNAIL_WORKERS 2
+#define THUMBNAIL_MEMORY_ITEMS 256   // Decoded thumbnails kept in memory
+#define RECENT_STRIP_ITEMS 12
+#define RECENT_STRIP_THUMB_SIZE 64
+static GtkWidget *recent_strip = NULL;
+
 // Add this global variable to track the current tooltip
 static char *current_tooltip = NULL;
 
 // Forward declare the functions we'll need
 static void on_menu_item_activate(GtkMenuItem *item, gpointer data);
 static gboolean on_combo_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data);
+static void on_transform_activate(GtkMenuItem *item, gpointer data);
+static gboolean on_transform_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data);
 
 // Function declarations
-static void load_image_from_file(const gchar *filename);
+static gboolean load_image_from_file(const gchar *filename);
+static void show_loaded_image(const gchar *filename, GdkPixbuf *pixbuf);
+static void reset_undo_history(void);
+static void set_undo_snapshot(int index, GdkPixbuf *pixbuf);
+static void journal_undo_shifted(void);
+static gboolean write_image_file(GdkPixbuf *pixbuf, const gchar *filename, gboolean optimized,
+                                 gboolean *lossy, GError **error);
+static gboolean review_start(GFile **files, gint n_files);
+static void review_end(void);
+static void review_shutdown(void);
+static GtkWidget *build_review_bar(void);
 static void load_image_from_clipboard();
+static void on_clipboard_image_received(GtkClipboard *clipboard, GdkPixbuf *pixbuf, gpointer data);
 static void save_image(const gchar *filename);
-static void draw_on_surface(cairo_t *cr, gdouble x, gdouble y);
+static void lossless_source_set(const gchar *filename);
+static void lossless_plan_transform(LosslessPlan *plan, const LosslessPlan *prev, ImageTransform transform);
+static void lossless_plan_crop(LosslessPlan *plan, const LosslessPlan *prev, int width, int height,
+                               int x, int y, int crop_width, int crop_height);
+static gboolean save_jpeg_lossless(const gchar *filename);
+static unsigned char *lossless_jpeg_output(unsigned long *output_size);
 static void update_drawing_area();
+static void update_drawing_area_region(int x, int y, int width, int height);
+static void queue_image_area(int x, int y, int width, int height);
+static gdouble widget_to_image(gdouble coordinate);
+static int display_scale(void);
+static cairo_surface_t *render_front_surface(void);
+static void parallel_for(gint n_items, gint min_chunk, void (*func)(gint start, gint end, gpointer data),
+                         gpointer data);
+static void render_shutdown(void);
+static void on_scale_factor_changed(GObject *object, GParamSpec *pspec, gpointer data);
 static void add_text_at_position(gdouble x, gdouble y);
+static void place_text(double x, double y, const char *text, const char *font, const GdkRGBA *color);
 static void push_undo_state(void);
+static void push_undo_op(const UndoOp *op);
+static void clear_undo_entry(int index);
 static void undo(void);
 static void redo(void);
 static void perform_crop(void);
+static void flood_fill_at(int x, int y, const GdkRGBA *color);
+static void fill_apply_spans(GdkPixbuf *pixbuf, GArray *spans, const GdkRGBA *color);
+static void stroke_layer_add_segment(gdouble x0, gdouble y0, gdouble x1, gdouble y1);
+static void stroke_layer_commit(void);
+static void stroke_layer_discard(void);
+static void finish_stroke(void);
+static void surface_to_pixbuf_area(cairo_surface_t *src, GdkPixbuf *dest, int dest_x, int dest_y);
+static void draw_text_on_pixbuf(GdkPixbuf *pixbuf, double x, double y, const char *text,
+                                const char *font, const GdkRGBA *color, GdkRectangle *area);
+static gboolean write_png(const gchar *filename, const PngRowSource *source, GError **error);
+static gboolean write_png_stream(FILE *file, const char *name, const PngRowSource *source, GError **error);
+static gboolean init_palette_png_source(PngRowSource *source, GdkPixbuf *pixbuf, gboolean *lossy);
+static void free_palette_png_source(PngRowSource *source);
+static guint8 *pixel_pool_alloc(gsize size, gboolean clear);
+static void pixel_pool_release(guint8 *buffer);
+static GdkPixbuf *pool_pixbuf_new(gboolean has_alpha, int width, int height);
+static GdkPixbuf *pool_pixbuf_copy(GdkPixbuf *src);
+static cairo_surface_t *pool_surface_new(cairo_format_t format, int width, int height);
+static GdkPixbuf *pool_pixbuf_from_surface(cairo_surface_t *surface);
+static GdkPixbuf *pool_pixbuf_import(GdkPixbuf *src);
+static PixelFormat pixbuf_pixel_format(GdkPixbuf *pixbuf);
+static cairo_format_t pixel_format_cairo(PixelFormat format);
+static PixelRowToCairo pixel_row_to_cairo(PixelFormat format);
+static PixelRowFromCairo pixel_row_from_cairo(PixelFormat format);
+static cairo_surface_t *pixbuf_area_to_surface(GdkPixbuf *pixbuf, int x, int y, int width, int height);
+static void pixel_pool_print_stats(void);
+static gsize pixel_pool_trim(void);
+static void memory_update(void);
+static void memory_charge_save(GdkPixbuf *pixbuf, gboolean pending);
+static void memory_print_stats(void);
+static PackedSnapshot *pack_snapshot(GdkPixbuf *pixbuf);
+static GdkPixbuf *unpack_snapshot(const PackedSnapshot *packed);
+static void packed_snapshot_free(PackedSnapshot *packed);
+static gsize packed_snapshot_bytes(const PackedSnapshot *packed);
+static gboolean undo_has_snapshot(int index);
+static gboolean undo_drop_oldest(void);
+static void request_thumbnail(GtkWidget *image, const char *path, int max_size);
+static void forget_thumbnail(const char *path);
+static void remember_recent_file(const char *filename);
+static void on_recent_changed(GtkRecentManager *manager, gpointer data);
+static gboolean refresh_recent_strip_idle(gpointer data);
+static gboolean journal_owns_path(const char *path);
+static void journal_begin_file(const char *filename);
+static void journal_begin_snapshot(void);
+static void journal_rebase(void);
+static void journal_stroke(void);
+static void journal_text(double x, double y, const char *text, const char *font, const GdkRGBA *color);
+static void journal_rect(JournalRecordType type, int x, int y, int width, int height);
+static void journal_resize(int width, int height);
+static void journal_transform(ImageTransform transform);
+static void journal_undo_redo(JournalRecordType type);
+static void journal_fill(int x, int y, const GdkRGBA *color);
+static void journal_rectangles(const GdkRectangle *rects, int n_rects, const GdkRGBA *color, int line_width);
+static void journal_adjust(const Adjustments *adjust);
+static gboolean journal_restore_session(void);
+static void journal_shutdown(void);
+static void apply_redaction(int x, int y, int width, int height);
+static GdkPixbuf *transform_pixbuf(GdkPixbuf *src, ImageTransform transform);
+static gboolean transform_current_image(ImageTransform transform);
+static gboolean propose_trim_selection(void);
+static void on_autotrim_clicked(GtkButton *button, gpointer data);
 static void on_mode_changed(GtkComboBox *combo, gpointer data);
 static gboolean on_mode_combo_tooltip(GtkWidget *widget, gint x, gint y,
                                     gboolean keyboard_mode, GtkTooltip *tooltip,
                                     gpointer data);
 static void on_popup_shown(GtkWidget *popup_window, gpointer data);
 static void on_popup_hidden(GtkWidget *popup_window, gpointer data);
+static gboolean on_main_window_delete(GtkWidget *widget, GdkEvent *event, gpointer data);
 static void on_resize_clicked(GtkButton *button, gpointer data);
+static void resize_current_image(int new_width, int new_height);
+static GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int width, int height);
+static int run_render_server(const char *socket_path);
+static void compare_invalidate(void);
+static void compare_draw(cairo_t *cr);
+static void compare_set_position(double position);
+static gboolean compare_on_handle(gdouble widget_x);
+static void on_compare_clicked(GtkButton *button, gpointer data);
+static void on_compare_region_changed(GtkComboBox *combo, gpointer data);
+static GtkWidget *build_compare_bar(void);
+static void annotate_rectangles(const GdkRectangle *rects, int n_rects, const GdkRGBA *color, int line_width);
+static void loupe_move(gdouble widget_x, gdouble widget_y);
+static void loupe_queue_draw(void);
+static void loupe_draw(cairo_t *cr);
+static void on_loupe_toggled(GtkToggleButton *button, gpointer data);
+static gboolean on_leave_notify(GtkWidget *widget, GdkEventCrossing *event, gpointer data);
+static void adjust_pixbuf(GdkPixbuf *src, GdkPixbuf *dest, const Adjustments *adjust);
+static void apply_adjustments(const Adjustments *adjust);
+static void adjust_preview_draw(cairo_t *cr);
+static void on_adjust_clicked(GtkButton *button, gpointer data);
+static void edge_snap_request(void);
+static int edge_snap_x(gdouble image_x, guint modifiers);
+static int edge_snap_y(gdouble image_y, guint modifiers);
 static void update_pixel_entry(GtkSpinButton *spin_button, gpointer percent_spin);
 static void update_percent_entry(GtkSpinButton *spin_button, gpointer pixel_spin);
 
 // Callback functions
 static gboolean on_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
     if (current_pixbuf) {
-        // Set the drawing area size to match the image
-        gtk_widget_set_size_request(drawing_area, 
-                                  gdk_pixbuf_get_width(current_pixbuf),
-                                  gdk_pixbuf_get_height(current_pixbuf));
+        cairo_surface_t *front = render_front_surface();
         
         // Draw white background
         cairo_set_source_rgb(cr, 1, 1, 1);
         cairo_paint(cr);
         
-        // Draw the image
-        gdk_cairo_set_source_pixbuf(cr, current_pixbuf, 0, 0);
-        cairo_paint(cr);
+        // Draw the latest frame: it matches the device scale, so this is a
+        // blit; until a new image's first frame arrives it is the previous one
+        if (front) {
+            cairo_set_source_surface(cr, front, 0, 0);
+            cairo_paint(cr);
+            
+            if (first_paint_pending) {
+                first_paint_pending = FALSE;
+                g_print("Time to first paint: %.1f ms\n", (g_get_monotonic_time() - launch_time) / 1000.0);
+            }
+        }
+        
+        // Overlays are positioned in image pixels
+        int scale = display_scale();
+        cairo_save(cr);
+        cairo_scale(cr, 1.0 / scale, 1.0 / scale);
+        
+        // The adjustments dialog previews over the whole image
+        if (adjust_preview.surface) {
+            adjust_preview_draw(cr);
+        }
+        
+        // A finished stroke the latest frame does not have yet
+        if (render.overlay) {
+            cairo_set_source_surface(cr, render.overlay, render.overlay_area.x, render.overlay_area.y);
+            cairo_paint_with_alpha(cr, render.overlay_alpha);
+        }
+        
+        // Draw the stroke in progress over the image
+        if (stroke_layer.surface) {
+            cairo_set_source_surface(cr, stroke_layer.surface, stroke_layer.x, stroke_layer.y);
+            cairo_paint_with_alpha(cr, current_color.alpha);
+        }
         
         // Draw crop selection rectangle if needed
-        if (is_crop_mode && (is_selecting || (crop_start_x != crop_end_x && crop_start_y != crop_end_y))) {
+        if ((is_crop_mode || is_redact_mode) &&
+            (is_selecting || (crop_start_x != crop_end_x && crop_start_y != crop_end_y))) {
             double x = MIN(crop_start_x, crop_end_x);
             double y = MIN(crop_start_y, crop_end_y);
             double width = abs(crop_end_x - crop_start_x);
@@ -134,46 +658,75 @@ static gboolean on_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
             cairo_rectangle(cr, x - 0.5, y - 0.5, width + 1, height + 1);
             cairo_stroke(cr);
         }
+        
+        if (compare.other) {
+            compare_draw(cr);
+        }
+        cairo_restore(cr);
+        
+        if (loupe.visible) {
+            loupe_draw(cr);
+        }
     }
     return FALSE;
 }
 
 static gboolean on_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+    gdouble image_x = widget_to_image(event->x);
+    gdouble image_y = widget_to_image(event->y);
+    
     if (event->button == GDK_BUTTON_PRIMARY) {
+        // The swipe handle takes precedence over the current mode
+        if (compare_on_handle(event->x)) {
+            compare.dragging = TRUE;
+            return TRUE;
+        }
+        
         if (is_text_mode) {
-            add_text_at_position(event->x, event->y);
+            add_text_at_position(image_x, image_y);
+            return TRUE;
+        }
+        
+        if (is_fill_mode) {
+            flood_fill_at((int)image_x, (int)image_y, &current_color);
             return TRUE;
         }
         
         if (is_crop_mode) {
+            edge_snap_request();
+            is_selecting = TRUE;
+            crop_start_x = crop_end_x = edge_snap_x(image_x, event->state);
+            crop_start_y = crop_end_y = edge_snap_y(image_y, event->state);
+            gtk_widget_queue_draw(drawing_area);
+            return TRUE;
+        }
+        
+        if (is_redact_mode) {
             is_selecting = TRUE;
-            crop_start_x = crop_end_x = event->x;
-            crop_start_y = crop_end_y = event->y;
+            crop_start_x = crop_end_x = image_x;
+            crop_start_y = crop_end_y = image_y;
             gtk_widget_queue_draw(drawing_area);
             return TRUE;
         }
         
         is_drawing = TRUE;
         has_moved = FALSE;
-        last_x = event->x;
-        last_y = event->y;
+        last_x = image_x;
+        last_y = image_y;
         
-        // Store the initial state before any drawing
-        if (current_pixbuf) {
-            // Initialize the undo stack if it's empty
-            if (undo_stack.current == -1) {
-                undo_stack.current = 0;
-                undo_stack.top = 0;
-            }
-            
-            // Store initial state
-            GdkPixbuf *initial_state = gdk_pixbuf_copy(current_pixbuf);
-            if (initial_state) {
-                if (undo_stack.states[undo_stack.current]) {
-                    g_object_unref(undo_stack.states[undo_stack.current]);
-                }
-                undo_stack.states[undo_stack.current] = initial_state;
-            }
+        // Pen width is in logical pixels; the stroke itself is in image pixels
+        stroke_layer.line_width = pen_width * display_scale();
+        
+        JournalPoint point = {image_x, image_y};
+        g_array_set_size(stroke_points, 0);
+        g_array_append_val(stroke_points, point);
+        
+        // Store the initial state before any drawing; an existing entry
+        // already rebuilds to the image as it is
+        if (current_pixbuf && undo_stack.current == -1) {
+            undo_stack.current = 0;
+            undo_stack.top = 0;
+            set_undo_snapshot(0, pool_pixbuf_copy(current_pixbuf));
         }
         
         return TRUE;
@@ -182,11 +735,19 @@ static gboolean on_button_press(GtkWidget *widget, GdkEventButton *event, gpoint
 }
 
 static gboolean on_button_release(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+    gdouble image_x = widget_to_image(event->x);
+    gdouble image_y = widget_to_image(event->y);
+    
     if (event->button == GDK_BUTTON_PRIMARY) {
+        if (compare.dragging) {
+            compare.dragging = FALSE;
+            return TRUE;
+        }
+        
         if (is_selecting && is_crop_mode) {
             is_selecting = FALSE;
-            crop_end_x = event->x;
-            crop_end_y = event->y;
+            crop_end_x = edge_snap_x(image_x, event->state);
+            crop_end_y = edge_snap_y(image_y, event->state);
             
             // Enable crop button if we have a valid selection
             int width = abs(crop_end_x - crop_start_x);
@@ -197,12 +758,31 @@ static gboolean on_button_release(GtkWidget *widget, GdkEventButton *event, gpoi
             return TRUE;
         }
         
+        if (is_selecting && is_redact_mode) {
+            is_selecting = FALSE;
+            crop_end_x = image_x;
+            crop_end_y = image_y;
+            
+            int x = MIN(crop_start_x, crop_end_x);
+            int y = MIN(crop_start_y, crop_end_y);
+            int width = abs(crop_end_x - crop_start_x);
+            int height = abs(crop_end_y - crop_start_y);
+            if (width > 1 && height > 1) {
+                apply_redaction(x, y, width, height);
+            }
+            
+            // The selection is consumed by the redaction
+            crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
+            gtk_widget_set_sensitive(crop_button, FALSE);
+            gtk_widget_queue_draw(drawing_area);
+            return TRUE;
+        }
+        
         if (is_drawing) {
             if (has_moved) {
-                push_undo_state();
-                gtk_widget_set_sensitive(undo_button, TRUE);
-                gtk_widget_set_sensitive(redo_button, FALSE);
+                finish_stroke();
             }
+            stroke_layer_discard();
             is_drawing = FALSE;
             has_moved = FALSE;
         }
@@ -211,9 +791,26 @@ static gboolean on_button_release(GtkWidget *widget, GdkEventButton *event, gpoi
 }
 
 static gboolean on_motion_notify(GtkWidget *widget, GdkEventMotion *event, gpointer data) {
+    gdouble image_x = widget_to_image(event->x);
+    gdouble image_y = widget_to_image(event->y);
+    
+    loupe_move(event->x, event->y);
+    
+    if (compare.dragging) {
+        compare_set_position(image_x / gdk_pixbuf_get_width(current_pixbuf));
+        return TRUE;
+    }
+    
     if (is_selecting && is_crop_mode) {
-        crop_end_x = event->x;
-        crop_end_y = event->y;
+        crop_end_x = edge_snap_x(image_x, event->state);
+        crop_end_y = edge_snap_y(image_y, event->state);
+        gtk_widget_queue_draw(drawing_area);
+        return TRUE;
+    }
+    
+    if (is_selecting && is_redact_mode) {
+        crop_end_x = image_x;
+        crop_end_y = image_y;
         gtk_widget_queue_draw(drawing_area);
         return TRUE;
     }
@@ -221,44 +818,14 @@ static gboolean on_motion_notify(GtkWidget *widget, GdkEventMotion *event, gpoin
     if (is_drawing && !is_text_mode && current_pixbuf) {
         has_moved = TRUE;  // Mark that we've moved while drawing
         
-        // Create a new surface for the current state
-        cairo_surface_t *temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                                 gdk_pixbuf_get_width(current_pixbuf),
-                                                                 gdk_pixbuf_get_height(current_pixbuf));
-        cairo_t *cr = cairo_create(temp_surface);
-        
-        // Draw current state - use current_pixbuf instead of undo stack state
-        gdk_cairo_set_source_pixbuf(cr, current_pixbuf, 0, 0);
-        cairo_paint(cr);
-        
-        // Add new line
-        cairo_set_source_rgba(cr, current_color.red, current_color.green, current_color.blue, current_color.alpha);
-        cairo_set_line_width(cr, pen_width);
-        cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
-        cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
-        cairo_move_to(cr, last_x, last_y);
-        cairo_line_to(cr, event->x, event->y);
-        cairo_stroke(cr);
-        
-        // Update the pixbuf
-        cairo_surface_flush(temp_surface);
-        GdkPixbuf *new_pixbuf = gdk_pixbuf_get_from_surface(temp_surface, 0, 0,
-                                                           gdk_pixbuf_get_width(current_pixbuf),
-                                                           gdk_pixbuf_get_height(current_pixbuf));
-        
-        if (new_pixbuf) {
-            if (current_pixbuf) {
-            g_object_unref(current_pixbuf);
-            }
-            current_pixbuf = new_pixbuf;
-            gtk_widget_queue_draw(drawing_area);
-        }
+        // Only the new segment is drawn; the image itself is untouched until release
+        stroke_layer_add_segment(last_x, last_y, image_x, image_y);
         
-        cairo_destroy(cr);
-        cairo_surface_destroy(temp_surface);
+        JournalPoint point = {image_x, image_y};
+        g_array_append_val(stroke_points, point);
         
-        last_x = event->x;
-        last_y = event->y;
+        last_x = image_x;
+        last_y = image_y;
     }
     return TRUE;
 }
@@ -300,12 +867,26 @@ static void on_save_clicked(GtkButton *button, gpointer data) {
 
     chooser = GTK_FILE_CHOOSER(dialog);
     gtk_file_chooser_set_do_overwrite_confirmation(chooser, TRUE);
-    gtk_file_chooser_set_current_name(chooser, "annotated.png");
+    // Offer JPEG when the image can still be written without re-encoding.
+    // Only the transform itself can tell, and it takes milliseconds.
+    unsigned long lossless_size = 0;
+    unsigned char *lossless = lossless_jpeg_output(&lossless_size);
+    gtk_file_chooser_set_current_name(chooser, lossless ? "annotated.jpg" : "annotated.png");
+    if (lossless) {
+        tjFree(lossless);
+    }
+    
+    GtkWidget *optimize = gtk_check_button_new_with_label("Optimize size (indexed colors)");
+    gtk_widget_set_tooltip_text(optimize,
+        "Write an 8-bit palette PNG. Images with more than 256 colors are reduced to 256 unless they are translucent.");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(optimize), save_optimized);
+    gtk_file_chooser_set_extra_widget(chooser, optimize);
 
     res = gtk_dialog_run(GTK_DIALOG(dialog));
     if (res == GTK_RESPONSE_ACCEPT) {
         char *filename;
         filename = gtk_file_chooser_get_filename(chooser);
+        save_optimized = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(optimize));
         save_image(filename);
         g_free(filename);
     }
@@ -313,6 +894,18 @@ static void on_save_clicked(GtkButton *button, gpointer data) {
     gtk_widget_destroy(dialog);
 }
 
+static void on_update_preview(GtkFileChooser *chooser, gpointer data) {
+    GtkWidget *preview = data;
+    char *filename = gtk_file_chooser_get_preview_filename(chooser);
+    gboolean active = filename && g_file_test(filename, G_FILE_TEST_IS_REGULAR);
+    
+    if (active) {
+        request_thumbnail(preview, filename, 0);
+    }
+    gtk_file_chooser_set_preview_widget_active(chooser, active);
+    g_free(filename);
+}
+
 static void on_open_clicked(GtkButton *button, gpointer data) {
     GtkWidget *dialog;
     GtkFileChooser *chooser;
@@ -327,6 +920,12 @@ static void on_open_clicked(GtkButton *button, gpointer data) {
 
     chooser = GTK_FILE_CHOOSER(dialog);
 
+    // Thumbnail of the highlighted file, generated in the background
+    GtkWidget *preview = gtk_image_new();
+    gtk_widget_set_size_request(preview, THUMBNAIL_SIZE + 16, -1);
+    gtk_file_chooser_set_preview_widget(chooser, preview);
+    g_signal_connect(chooser, "update-preview", G_CALLBACK(on_update_preview), preview);
+
     res = gtk_dialog_run(GTK_DIALOG(dialog));
     if (res == GTK_RESPONSE_ACCEPT) {
         char *filename;
@@ -351,6 +950,7 @@ static void on_copy_clicked(GtkButton *button, gpointer data) {
     GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     if (current_pixbuf) {
         gtk_clipboard_set_image(clipboard, current_pixbuf);
+        journal_rebase();
     }
 }
 
@@ -366,8 +966,8 @@ static void on_entry_activate(GtkEntry *entry, GtkDialog *dialog) {
     gtk_dialog_response(dialog, GTK_RESPONSE_ACCEPT);
 }
 
-// Main function
-int main(int argc, char *argv[]) {
+// Build the main window once per process; it is reused by every launch
+static void build_main_window(GtkApplication *app) {
     GtkWidget *window;
     GtkWidget *vbox;
     GtkWidget *hbox;
@@ -378,13 +978,12 @@ int main(int argc, char *argv[]) {
     GtkWidget *open_button;
     GtkWidget *mode_label;
 
-    gtk_init(&argc, &argv);
-
     // Create main window
-    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    window = gtk_application_window_new(app);
+    main_window = window;
     gtk_window_set_title(GTK_WINDOW(window), "Image Annotator");
     gtk_window_set_default_size(GTK_WINDOW(window), 1000, 600);  // Increased from 800 to 1000
-    g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
+    g_signal_connect(window, "delete-event", G_CALLBACK(on_main_window_delete), NULL);
 
     // Create main container with more padding
     vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
@@ -395,6 +994,20 @@ int main(int argc, char *argv[]) {
     gtk_container_set_border_width(GTK_CONTAINER(hbox), 5);  // Add padding around the toolbar
     gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 5);
 
+    // Recently used images as thumbnails; hidden while there are none
+    recent_strip = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+    gtk_container_set_border_width(GTK_CONTAINER(recent_strip), 2);
+    gtk_box_pack_start(GTK_BOX(vbox), recent_strip, FALSE, FALSE, 0);
+    g_signal_connect(gtk_recent_manager_get_default(), "changed", G_CALLBACK(on_recent_changed), NULL);
+
+    // Compare controls, shown while a second image is loaded
+    compare_bar = build_compare_bar();
+    gtk_box_pack_start(GTK_BOX(vbox), compare_bar, FALSE, FALSE, 0);
+
+    // Review queue navigation, shown while working through several files
+    review_bar = build_review_bar();
+    gtk_box_pack_start(GTK_BOX(vbox), review_bar, FALSE, FALSE, 0);
+
     // File operations group
     GtkWidget *file_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
     gtk_box_pack_start(GTK_BOX(hbox), file_box, FALSE, FALSE, 0);
@@ -528,12 +1141,67 @@ int main(int argc, char *argv[]) {
     g_signal_connect(crop_button, "clicked", G_CALLBACK(perform_crop), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), crop_button, FALSE, FALSE, 0);
 
+    // Auto-trim button: crop away uniform borders in one click
+    GtkWidget *autotrim_button = gtk_button_new_from_icon_name("zoom-fit-best", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(autotrim_button, "Trim Uniform Borders");
+    g_signal_connect(autotrim_button, "clicked", G_CALLBACK(on_autotrim_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), autotrim_button, FALSE, FALSE, 0);
+
     // Add resize button after the other buttons
     GtkWidget *resize_button = gtk_button_new_from_icon_name("view-fullscreen", GTK_ICON_SIZE_SMALL_TOOLBAR);
     gtk_widget_set_tooltip_text(resize_button, "Resize Image");
     g_signal_connect(resize_button, "clicked", G_CALLBACK(on_resize_clicked), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), resize_button, FALSE, FALSE, 0);
 
+    // Rotate/flip button with a popup menu, like the mode selector
+    GtkWidget *transform_button = gtk_button_new_from_icon_name("object-rotate-right", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(transform_button, "Rotate or Flip");
+    transform_menu = gtk_menu_new();
+    for (guint i = 0; i < G_N_ELEMENTS(transform_info); i++) {
+        GtkWidget *item = gtk_menu_item_new();
+        GtkWidget *item_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+        GtkWidget *icon = gtk_image_new_from_icon_name(
+            transform_info[i].icon_name, GTK_ICON_SIZE_MENU);
+        GtkWidget *label = gtk_label_new(transform_info[i].label);
+        
+        gtk_container_add(GTK_CONTAINER(item_box), icon);
+        gtk_container_add(GTK_CONTAINER(item_box), label);
+        gtk_container_add(GTK_CONTAINER(item), item_box);
+        gtk_widget_show_all(item);
+        
+        gtk_menu_shell_append(GTK_MENU_SHELL(transform_menu), item);
+        g_signal_connect(item, "activate",
+                        G_CALLBACK(on_transform_activate),
+                        GINT_TO_POINTER(transform_info[i].transform));
+    }
+    g_signal_connect(transform_button, "button-press-event",
+                    G_CALLBACK(on_transform_button_press), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), transform_button, FALSE, FALSE, 0);
+
+    // Compare against a second image
+    GtkWidget *compare_button = gtk_button_new_from_icon_name("view-dual-symbolic", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(compare_button, "Compare With Another Image");
+    g_signal_connect(compare_button, "clicked", G_CALLBACK(on_compare_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), compare_button, FALSE, FALSE, 0);
+
+    // Levels, brightness/contrast, gamma and grayscale
+    GtkWidget *adjust_button = gtk_button_new_from_icon_name("display-brightness-symbolic", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(adjust_button, "Adjust Levels and Colors");
+    g_signal_connect(adjust_button, "clicked", G_CALLBACK(on_adjust_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), adjust_button, FALSE, FALSE, 0);
+
+    // Magnifier for placing crops and text at pixel precision
+    GtkWidget *loupe_button = gtk_toggle_button_new();
+    gtk_button_set_image(GTK_BUTTON(loupe_button),
+                         gtk_image_new_from_icon_name("zoom-in", GTK_ICON_SIZE_SMALL_TOOLBAR));
+    gtk_widget_set_tooltip_text(loupe_button, "Magnifier");
+    g_signal_connect(loupe_button, "toggled", G_CALLBACK(on_loupe_toggled), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), loupe_button, FALSE, FALSE, 0);
+
+    // Memory in use; the tooltip breaks it down with peaks
+    memory_label = gtk_label_new(NULL);
+    gtk_box_pack_end(GTK_BOX(hbox), memory_label, FALSE, FALSE, 0);
+
     // Create a scrolled window
     GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
@@ -566,366 +1234,6535 @@ int main(int argc, char *argv[]) {
     g_signal_connect(drawing_area, "button-press-event", G_CALLBACK(on_button_press), NULL);
     g_signal_connect(drawing_area, "button-release-event", G_CALLBACK(on_button_release), NULL);
     g_signal_connect(drawing_area, "motion-notify-event", G_CALLBACK(on_motion_notify), NULL);
+    g_signal_connect(drawing_area, "leave-notify-event", G_CALLBACK(on_leave_notify), NULL);
     g_signal_connect(drawing_area, "realize", G_CALLBACK(on_drawing_area_realize), NULL);
+    g_signal_connect(drawing_area, "notify::scale-factor", G_CALLBACK(on_scale_factor_changed), NULL);
     gtk_widget_set_events(drawing_area, gtk_widget_get_events(drawing_area) |
                          GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK |
-                         GDK_POINTER_MOTION_MASK);
+                         GDK_POINTER_MOTION_MASK | GDK_LEAVE_NOTIFY_MASK);
 
     // Pack everything together
     gtk_container_add(GTK_CONTAINER(padding_box), drawing_area);
     gtk_container_add(GTK_CONTAINER(scrolled_window), padding_box);
     gtk_box_pack_start(GTK_BOX(vbox), scrolled_window, TRUE, TRUE, 0);
 
-    // Show all widgets
-    gtk_widget_show_all(window);
+    stroke_points = g_array_new(FALSE, FALSE, sizeof(JournalPoint));
 
-    // Check for clipboard image or command line argument
-    if (argc > 1) {
-        load_image_from_file(argv[1]);
-    } else {
-        load_image_from_clipboard();
-    }
-
-    gtk_main();
-
-    return 0;
+    // Show all widgets; the window itself is presented per launch
+    gtk_widget_show_all(vbox);
+    
+    // Filled in after the first paint so it does not delay startup
+    gtk_widget_hide(recent_strip);
+    gtk_widget_hide(compare_bar);
+    gtk_widget_hide(review_bar);
+    g_idle_add_full(G_PRIORITY_LOW, refresh_recent_strip_idle, NULL, NULL);
 }
 
-// Helper functions
-static void load_image_from_file(const gchar *filename) {
-    GError *error = NULL;
-    original_pixbuf = gdk_pixbuf_new_from_file(filename, &error);
-    if (error) {
-        g_error_free(error);
-        return;
+// Closing the window in resident mode only hides it, keeping the process warm
+static gboolean on_main_window_delete(GtkWidget *widget, GdkEvent *event, gpointer data) {
+    if (resident_mode) {
+        gtk_widget_hide(widget);
+        return TRUE;
     }
-    current_pixbuf = gdk_pixbuf_copy(original_pixbuf);
-    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                       gdk_pixbuf_get_width(current_pixbuf),
-                                       gdk_pixbuf_get_height(current_pixbuf));
-    gtk_widget_set_size_request(drawing_area,
-                              gdk_pixbuf_get_width(current_pixbuf),
-                              gdk_pixbuf_get_height(current_pixbuf));
-    update_drawing_area();
+    return FALSE;
+}
 
-    // Initialize undo stack with initial state
-    for (int i = 0; i <= undo_stack.top; i++) {
-        if (undo_stack.states[i]) {
-            g_object_unref(undo_stack.states[i]);
-            undo_stack.states[i] = NULL;
-        }
-    }
-    
-    // Reset undo stack
-    undo_stack.current = -1;
-    undo_stack.top = -1;
+static gint on_handle_local_options(GApplication *application, GVariantDict *options, gpointer data) {
+    const char *socket_path;
+    gint budget_mb;
     
-    // Push initial state
-    push_undo_state();
+    if (g_variant_dict_lookup(options, "memory-budget", "i", &budget_mb) && budget_mb > 0) {
+        memory.budget = (gsize)budget_mb * 1024 * 1024;
+    }
+    memory.print_stats = g_variant_dict_contains(options, "stats");
     
-    // Disable undo since this is the initial state
-    gtk_widget_set_sensitive(undo_button, FALSE);
-    gtk_widget_set_sensitive(redo_button, FALSE);
+    // Headless: serve render jobs instead of starting the GUI
+    if (g_variant_dict_lookup(options, "serve", "^&ay", &socket_path)) {
+        return run_render_server(socket_path);
+    }
+    if (g_variant_dict_contains(options, "background")) {
+        resident_mode = TRUE;
+    }
+    return -1;  // Continue with normal startup (or forwarding to the running instance)
 }
 
-static void load_image_from_clipboard() {
-    GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
-    GdkPixbuf *pixbuf = gtk_clipboard_wait_for_image(clipboard);
+// Runs once, in the primary instance only
+static void on_startup(GApplication *application, gpointer data) {
+    build_main_window(GTK_APPLICATION(application));
     
-    if (pixbuf) {
-        if (current_pixbuf) {
-            g_object_unref(current_pixbuf);
-        }
-        current_pixbuf = pixbuf;
-        
-        // Reset crop state
-        crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
-        is_selecting = FALSE;
-        if (crop_button) {
-            gtk_widget_set_sensitive(crop_button, FALSE);
-        }
-        
-        // Initialize undo stack with initial state
-        for (int i = 0; i <= undo_stack.top; i++) {
-            if (undo_stack.states[i]) {
-                g_object_unref(undo_stack.states[i]);
-                undo_stack.states[i] = NULL;
-            }
-        }
-        
-        // Reset undo stack
-        undo_stack.current = -1;
-        undo_stack.top = -1;
-        
-        // Push initial state
-        push_undo_state();
-        
-        // Disable undo since this is the initial state
-        gtk_widget_set_sensitive(undo_button, FALSE);
-        gtk_widget_set_sensitive(redo_button, FALSE);
-        
-        gtk_widget_queue_draw(drawing_area);
+    if (resident_mode) {
+        // Stay alive with no window until the next launch is forwarded here
+        g_application_hold(application);
+        g_print("Running resident in the background\n");
     }
 }
 
-static void save_image(const gchar *filename) {
-    if (current_pixbuf) {
-        GError *error = NULL;
-        gdk_pixbuf_save(current_pixbuf, filename, "png", &error, NULL);
-        if (error) {
-            g_error_free(error);
-        }
+// Start timing a launch; cold starts are timed from process start instead
+static void begin_launch_timing(void) {
+    if (!first_paint_pending) {
+        launch_time = g_get_monotonic_time();
+        first_paint_pending = TRUE;
     }
 }
 
-static void draw_on_surface(cairo_t *cr, gdouble x, gdouble y) {
-    if (is_text_mode) {
-        return; // Don't draw in text mode
-    }
-    
-    // First draw the current image
-    if (current_pixbuf) {
-        gdk_cairo_set_source_pixbuf(cr, current_pixbuf, 0, 0);
-        cairo_paint(cr);
+// Launched without files: open the clipboard image
+static void on_activate(GApplication *application, gpointer data) {
+    // The initial activation of a resident process just warms up
+    if (resident_mode && !resident_warmed_up) {
+        resident_warmed_up = TRUE;
+        first_paint_pending = FALSE;
+        g_print("Warm start ready after %.1f ms\n", (g_get_monotonic_time() - launch_time) / 1000.0);
+        return;
     }
     
-    // Then draw the new line
-    cairo_set_source_rgba(cr, current_color.red, current_color.green, current_color.blue, current_color.alpha);
-    cairo_set_line_width(cr, pen_width);
-    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
-    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+    begin_launch_timing();
+    gtk_window_present(GTK_WINDOW(main_window));
     
-    if (is_drawing) {
-        cairo_move_to(cr, last_x, last_y);
-        cairo_line_to(cr, x, y);
-        cairo_stroke(cr);
-        
-        // Update the current pixbuf with the drawing
-        cairo_surface_flush(surface);
-        GdkPixbuf *new_pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0,
-                                                           gdk_pixbuf_get_width(current_pixbuf),
-                                                           gdk_pixbuf_get_height(current_pixbuf));
-        if (new_pixbuf) {
-            g_object_unref(current_pixbuf);
-            current_pixbuf = new_pixbuf;
-            push_undo_state();
-        }
+    // Unsaved edits from the last session take precedence over the clipboard
+    if (!journal_restore_session()) {
+        load_image_from_clipboard();
     }
 }
 
-static void update_drawing_area() {
-    gtk_widget_queue_draw(drawing_area);
+// Launched with files (locally or forwarded over D-Bus): open a single file,
+// or queue several files or a directory for review
+static void on_open(GApplication *application, GFile **files, gint n_files,
+                    const gchar *hint, gpointer data) {
+    resident_warmed_up = TRUE;
+    begin_launch_timing();
+    gtk_window_present(GTK_WINDOW(main_window));
+    
+    char *filename = g_file_get_path(files[0]);
+    if (n_files > 1 || (filename && g_file_test(filename, G_FILE_TEST_IS_DIR))) {
+        g_free(filename);
+        review_start(files, n_files);
+        return;
+    }
+    if (filename) {
+        load_image_from_file(filename);
+        g_free(filename);
+    }
 }
 
-static void add_text_at_position(gdouble x, gdouble y) {
-    GtkWidget *dialog;
-    GtkWidget *content_area;
-    GtkWidget *entry;
-    gint response;
+// Main function
+int main(int argc, char *argv[]) {
+    launch_time = g_get_monotonic_time();
+    first_paint_pending = TRUE;
+    
+    // Single instance: later launches are forwarded to the running process
+    GtkApplication *app = gtk_application_new(APPLICATION_ID, G_APPLICATION_HANDLES_OPEN);
+    g_application_add_main_option(G_APPLICATION(app), "background", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_NONE,
+                                  "Stay resident so later launches open instantly", NULL);
+    g_application_add_main_option(G_APPLICATION(app), "serve", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_FILENAME,
+                                  "Serve render jobs on a Unix domain socket", "SOCKET");
+    g_application_add_main_option(G_APPLICATION(app), "memory-budget", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_INT,
+                                  "Memory to use before caches and undo history are trimmed (default 1024)", "MB");
+    g_application_add_main_option(G_APPLICATION(app), "stats", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_NONE,
+                                  "Print current and peak memory use per category on exit", NULL);
+    g_signal_connect(app, "handle-local-options", G_CALLBACK(on_handle_local_options), NULL);
+    g_signal_connect(app, "startup", G_CALLBACK(on_startup), NULL);
+    g_signal_connect(app, "activate", G_CALLBACK(on_activate), NULL);
+    g_signal_connect(app, "open", G_CALLBACK(on_open), NULL);
+    
+    int status = g_application_run(G_APPLICATION(app), argc, argv);
+    g_object_unref(app);
 
-    // Store the current state before adding text
-    if (current_pixbuf) {
-        if (undo_stack.current == -1) {
-            undo_stack.current = 0;
-            undo_stack.top = 0;
-            undo_stack.states[0] = gdk_pixbuf_copy(current_pixbuf);
+    review_shutdown();
+    render_shutdown();
+    journal_shutdown();
+    if (memory.print_stats) {
+        pixel_pool_print_stats();
+        memory_print_stats();
+    }
+
+    return status;
+}
+
+// Helper functions
+// Pixel buffer pool
+//
+// Full-frame buffers are recycled instead of going back to malloc, which for
+// frames this size means munmap and a fresh round of page faults on the next
+// allocation.  Sizes are rounded up to quarter-power-of-two classes, new
+// buffers are touched once up front, and released ones are kept per class
+// until POOL_MAX_CACHED_BYTES is reached.
+#define POOL_HEADER_SIZE 64       // Room for the PoolHeader in front of each buffer
+#define POOL_MIN_SHIFT 12          // Smallest class is one page
+#define POOL_MAX_SHIFT 40
+#define POOL_CLASSES ((POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1) * 4)
+#define POOL_MAX_FREE_PER_CLASS 8
+#define POOL_MAX_CACHED_BYTES ((gsize)512 * 1024 * 1024)
+
+typedef struct {
+    gsize capacity;
+    gint size_class;
+} PoolHeader;
+
+G_STATIC_ASSERT(sizeof(PoolHeader) <= POOL_HEADER_SIZE);
+
+typedef struct {
+    guint8 *free[POOL_CLASSES][POOL_MAX_FREE_PER_CLASS];
+    gint n_free[POOL_CLASSES];
+    gsize cached_bytes;
+    gsize in_use_bytes;
+    gsize peak_bytes;      // Peak of in-use plus cached
+    guint64 hits;
+    guint64 misses;
+    GMutex lock;
+} PixelPool;
+
+static PixelPool pixel_pool;
+static cairo_user_data_key_t pool_surface_key;
+
+static gint pool_size_class(gsize size, gsize *class_size) {
+    if (size <= ((gsize)1 << POOL_MIN_SHIFT)) {
+        *class_size = (gsize)1 << POOL_MIN_SHIFT;
+        return 0;
+    }
+    
+    gint shift = g_bit_storage(size - 1) - 1;
+    gsize base = (gsize)1 << shift;
+    gsize step = base / 4;
+    gsize steps = (size - base + step - 1) / step;  // 1..4
+    
+    *class_size = base + steps * step;
+    return (shift - POOL_MIN_SHIFT) * 4 + (gint)steps;
+}
+
+// A buffer of at least size bytes; when clear is set it is zeroed, which
+// costs nothing for new blocks since they are already faulted in as zeros.
+// Returns NULL when memory runs out.
+static guint8 *pixel_pool_alloc(gsize size, gboolean clear) {
+    gsize capacity;
+    gint size_class = pool_size_class(size, &capacity);
+    guint8 *block = NULL;
+    
+    g_mutex_lock(&pixel_pool.lock);
+    if (size_class < POOL_CLASSES && pixel_pool.n_free[size_class] > 0) {
+        block = pixel_pool.free[size_class][--pixel_pool.n_free[size_class]];
+        pixel_pool.cached_bytes -= capacity;
+        pixel_pool.hits++;
+    } else {
+        pixel_pool.misses++;
+    }
+    pixel_pool.in_use_bytes += capacity;
+    pixel_pool.peak_bytes = MAX(pixel_pool.peak_bytes,
+                                pixel_pool.in_use_bytes + pixel_pool.cached_bytes);
+    g_mutex_unlock(&pixel_pool.lock);
+    
+    if (!block) {
+        block = g_try_malloc(capacity + POOL_HEADER_SIZE);
+        if (!block) {
+            g_mutex_lock(&pixel_pool.lock);
+            pixel_pool.in_use_bytes -= capacity;
+            g_mutex_unlock(&pixel_pool.lock);
+            return NULL;
         }
+        // Fault every page in now rather than in the middle of a pixel loop
+        memset(block + POOL_HEADER_SIZE, 0, capacity);
+        
+        PoolHeader *header = (PoolHeader *)block;
+        header->capacity = capacity;
+        header->size_class = size_class;
+    } else if (clear) {
+        memset(block + POOL_HEADER_SIZE, 0, size);
     }
+    
+    return block + POOL_HEADER_SIZE;
+}
 
-    dialog = gtk_dialog_new_with_buttons("Enter Text",
-                                       GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
-                                       GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
-                                       "_OK", GTK_RESPONSE_ACCEPT,
-                                       "_Cancel", GTK_RESPONSE_CANCEL,
-                                       NULL);
+static void pixel_pool_release(guint8 *buffer) {
+    if (!buffer) return;
+    
+    guint8 *block = buffer - POOL_HEADER_SIZE;
+    PoolHeader *header = (PoolHeader *)block;
+    gboolean keep = FALSE;
+    
+    g_mutex_lock(&pixel_pool.lock);
+    pixel_pool.in_use_bytes -= header->capacity;
+    if (header->size_class < POOL_CLASSES &&
+        pixel_pool.n_free[header->size_class] < POOL_MAX_FREE_PER_CLASS &&
+        pixel_pool.cached_bytes + header->capacity <= POOL_MAX_CACHED_BYTES) {
+        pixel_pool.free[header->size_class][pixel_pool.n_free[header->size_class]++] = block;
+        pixel_pool.cached_bytes += header->capacity;
+        keep = TRUE;
+    }
+    g_mutex_unlock(&pixel_pool.lock);
+    
+    if (!keep) {
+        g_free(block);
+    }
+}
 
-    content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-    entry = gtk_entry_new();
-    g_signal_connect(entry, "activate", G_CALLBACK(on_entry_activate), dialog);
-    gtk_container_add(GTK_CONTAINER(content_area), entry);
-    gtk_widget_show_all(dialog);
-    gtk_widget_grab_focus(entry);
+static void pool_pixbuf_destroy(guchar *pixels, gpointer data) {
+    pixel_pool_release(pixels);
+}
 
-    response = gtk_dialog_run(GTK_DIALOG(dialog));
-    if (response == GTK_RESPONSE_ACCEPT) {
-        const gchar *text = gtk_entry_get_text(GTK_ENTRY(entry));
-        if (text && *text && current_pixbuf) {
-            cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                                     gdk_pixbuf_get_width(current_pixbuf),
-                                                                     gdk_pixbuf_get_height(current_pixbuf));
-            cairo_t *cr = cairo_create(surface);
-            
-            gdk_cairo_set_source_pixbuf(cr, current_pixbuf, 0, 0);
-            cairo_paint(cr);
-            
-            cairo_set_source_rgba(cr, text_color.red, text_color.green, text_color.blue, text_color.alpha);
-            
-            // Parse the font string to get size and family
-            PangoFontDescription *font_desc = pango_font_description_from_string(current_font);
-            double font_size = pango_font_description_get_size(font_desc) / PANGO_SCALE;
-            const char *font_family = pango_font_description_get_family(font_desc);
-            
-            // Set the font
-            cairo_select_font_face(cr, 
-                                 font_family ? font_family : "Sans",
-                                 CAIRO_FONT_SLANT_NORMAL,
-                                 CAIRO_FONT_WEIGHT_NORMAL);
-            cairo_set_font_size(cr, font_size > 0 ? font_size : 12);
-            
-            pango_font_description_free(font_desc);
+static void pool_surface_destroy(void *data) {
+    pixel_pool_release(data);
+}
 
-            cairo_move_to(cr, x, y);
-            cairo_show_text(cr, text);
-            
-            cairo_surface_flush(surface);
-            GdkPixbuf *new_pixbuf = gdk_pixbuf_get_from_surface(surface, 0, 0,
-                                                               gdk_pixbuf_get_width(current_pixbuf),
-                                                               gdk_pixbuf_get_height(current_pixbuf));
-            
-            if (new_pixbuf) {
-                g_object_unref(current_pixbuf);
-                current_pixbuf = new_pixbuf;
-                push_undo_state();
-                gtk_widget_queue_draw(drawing_area);
-            }
-            
-            cairo_destroy(cr);
-            cairo_surface_destroy(surface);
+// Pooled replacement for gdk_pixbuf_new; contents are undefined.  Like
+// gdk_pixbuf_new it returns NULL when the pixels cannot be allocated.
+static GdkPixbuf *pool_pixbuf_new(gboolean has_alpha, int width, int height) {
+    int rowstride = (width * (has_alpha ? 4 : 3) + 3) & ~3;
+    guint8 *pixels = pixel_pool_alloc((gsize)rowstride * height, FALSE);
+    if (!pixels) return NULL;
+    
+    return gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, has_alpha, 8,
+                                    width, height, rowstride, pool_pixbuf_destroy, NULL);
+}
+
+// Pooled replacement for gdk_pixbuf_copy
+static GdkPixbuf *pool_pixbuf_copy(GdkPixbuf *src) {
+    int width = gdk_pixbuf_get_width(src);
+    int height = gdk_pixbuf_get_height(src);
+    GdkPixbuf *copy = pool_pixbuf_new(gdk_pixbuf_get_has_alpha(src), width, height);
+    if (!copy) return NULL;
+    const guint8 *in = gdk_pixbuf_read_pixels(src);
+    guint8 *out = gdk_pixbuf_get_pixels(copy);
+    int in_stride = gdk_pixbuf_get_rowstride(src);
+    int out_stride = gdk_pixbuf_get_rowstride(copy);
+    gsize row_bytes = (gsize)width * gdk_pixbuf_get_n_channels(src);
+    
+    if (in_stride == out_stride) {
+        memcpy(out, in, (gsize)in_stride * (height - 1) + row_bytes);
+    } else {
+        for (int y = 0; y < height; y++) {
+            memcpy(out + (gsize)y * out_stride, in + (gsize)y * in_stride, row_bytes);
         }
     }
+    return copy;
+}
 
-    gtk_widget_destroy(dialog);
+typedef struct {
+    GdkPixbuf *src;
+    GdkPixbuf *dst;
+    gint translucent;  // Set once any pixel is found with alpha below 255
+} ImportPass;
+
+static void import_check_rows(int start, int end, gpointer data) {
+    ImportPass *pass = data;
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pass->src);
+    int stride = gdk_pixbuf_get_rowstride(pass->src);
+    int width = gdk_pixbuf_get_width(pass->src);
+    
+    for (int y = start; y < end && !g_atomic_int_get(&pass->translucent); y++) {
+        const guint8 *in = pixels + (gsize)y * stride + 3;
+        guint8 alpha = 0xff;
+        for (int x = 0; x < width; x++) {
+            alpha &= in[x * 4];
+        }
+        if (alpha != 0xff) {
+            g_atomic_int_set(&pass->translucent, 1);
+        }
+    }
 }
 
-static void push_undo_state(void) {
-    g_print("Push: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+static void import_pack_rows(int start, int end, gpointer data) {
+    ImportPass *pass = data;
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pass->src);
+    int in_stride = gdk_pixbuf_get_rowstride(pass->src);
+    guint8 *out_pixels = gdk_pixbuf_get_pixels(pass->dst);
+    int out_stride = gdk_pixbuf_get_rowstride(pass->dst);
+    int width = gdk_pixbuf_get_width(pass->src);
     
-    // Clear redo states
-    for (int i = undo_stack.current + 1; i <= undo_stack.top; i++) {
-        if (undo_stack.states[i]) {
-            g_object_unref(undo_stack.states[i]);
-            undo_stack.states[i] = NULL;
+    for (int y = start; y < end; y++) {
+        const guint8 *in = pixels + (gsize)y * in_stride;
+        guint8 *out = out_pixels + (gsize)y * out_stride;
+        for (int x = 0; x < width; x++, in += 4, out += 3) {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
         }
     }
+}
 
-    // Add new state
-    undo_stack.current++;
-    undo_stack.top = undo_stack.current;
-    if (current_pixbuf) {
-        if (undo_stack.states[undo_stack.current]) {
-            g_object_unref(undo_stack.states[undo_stack.current]);
+// Pooled copy of a decoded image in its working format.  Decoders and the
+// clipboard hand out RGBA for many images that are fully opaque, such as most
+// screenshot PNGs; those drop the alpha channel, so the image, its undo
+// snapshots and the display take three bytes a pixel and skip premultiplying.
+static GdkPixbuf *pool_pixbuf_import(GdkPixbuf *src) {
+    if (!gdk_pixbuf_get_has_alpha(src) || gdk_pixbuf_get_n_channels(src) != 4 ||
+        gdk_pixbuf_get_bits_per_sample(src) != 8) {
+        return pool_pixbuf_copy(src);
+    }
+    
+    int width = gdk_pixbuf_get_width(src);
+    int height = gdk_pixbuf_get_height(src);
+    ImportPass pass = {src, NULL, 0};
+    parallel_for(height, 64, import_check_rows, &pass);
+    if (pass.translucent) {
+        return pool_pixbuf_copy(src);
+    }
+    
+    pass.dst = pool_pixbuf_new(FALSE, width, height);
+    if (!pass.dst) return NULL;
+    parallel_for(height, 64, import_pack_rows, &pass);
+    return pass.dst;
+}
+
+// Pooled replacement for cairo_image_surface_create; cleared like the
+// original.  Returns NULL for sizes cairo cannot handle.
+static cairo_surface_t *pool_surface_new(cairo_format_t format, int width, int height) {
+    int stride = cairo_format_stride_for_width(format, width);
+    if (stride < 0 || width <= 0 || height <= 0) return NULL;
+    
+    guint8 *data = pixel_pool_alloc((gsize)stride * height, TRUE);
+    if (!data) return NULL;
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(data, format, width, height, stride);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_set_user_data(surface, &pool_surface_key, data, pool_surface_destroy) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        pixel_pool_release(data);
+        return NULL;
+    }
+    return surface;
+}
+
+// Pooled replacement for gdk_pixbuf_get_from_surface on a whole ARGB32 surface
+static GdkPixbuf *pool_pixbuf_from_surface(cairo_surface_t *surface) {
+    GdkPixbuf *pixbuf = pool_pixbuf_new(TRUE, cairo_image_surface_get_width(surface),
+                                        cairo_image_surface_get_height(surface));
+    if (!pixbuf) return NULL;
+    surface_to_pixbuf_area(surface, pixbuf, 0, 0);
+    return pixbuf;
+}
+
+static void pixel_pool_print_stats(void) {
+    g_mutex_lock(&pixel_pool.lock);
+    guint64 total = pixel_pool.hits + pixel_pool.misses;
+    g_print("Pixel pool: %" G_GUINT64_FORMAT " allocations, %.1f%% hit rate, "
+            "peak %.1f MB, %.1f MB cached\n",
+            total, total ? 100.0 * pixel_pool.hits / total : 0.0,
+            pixel_pool.peak_bytes / (1024.0 * 1024.0),
+            pixel_pool.cached_bytes / (1024.0 * 1024.0));
+    g_mutex_unlock(&pixel_pool.lock);
+}
+
+// Release every cached buffer; returns the bytes given back
+static gsize pixel_pool_trim(void) {
+    guint8 *blocks[POOL_CLASSES * POOL_MAX_FREE_PER_CLASS];
+    int n_blocks = 0;
+    gsize freed;
+    
+    g_mutex_lock(&pixel_pool.lock);
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        while (pixel_pool.n_free[c] > 0) {
+            blocks[n_blocks++] = pixel_pool.free[c][--pixel_pool.n_free[c]];
         }
-        undo_stack.states[undo_stack.current] = gdk_pixbuf_copy(current_pixbuf);
-        g_print("Stored pixbuf at %d: %dx%d\n", undo_stack.current, 
-                gdk_pixbuf_get_width(undo_stack.states[undo_stack.current]),
-                gdk_pixbuf_get_height(undo_stack.states[undo_stack.current]));
     }
+    freed = pixel_pool.cached_bytes;
+    pixel_pool.cached_bytes = 0;
+    g_mutex_unlock(&pixel_pool.lock);
+    
+    for (int i = 0; i < n_blocks; i++) {
+        g_free(blocks[i]);
+    }
+    return freed;
+}
 
-    g_print("After Push: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+// Memory budget
+//
+// memory_update() measures what each category holds by walking the holders
+// themselves, so nothing can drift out of step with the real ownership, and
+// keeps per-category peaks.  Above the budget (--memory-budget, in MB) it
+// relieves pressure in order of least harm: pooled free buffers first, then
+// prefetched review images, then undo snapshots are deflated, and only then
+// are the oldest undo steps forgotten.  The working image and images being
+// saved are never touched, and history is only forgotten when that gets
+// under the budget.  Relief aims an eighth below the budget so the next
+// edits do not each pay for another pass; when it cannot get under the
+// budget at all, the next pass waits until the total grows by that much.
+static const char *const memory_category_names[MEMORY_CATEGORIES] = {
+    "Working image", "Undo history", "Caches", "Pending saves"
+};
+
+static gsize pixbuf_bytes(GdkPixbuf *pixbuf) {
+    return pixbuf ? gdk_pixbuf_get_byte_length(pixbuf) : 0;
+}
+
+static gsize surface_bytes(cairo_surface_t *surface) {
+    if (!surface) return 0;
+    return (gsize)cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface);
+}
+
+static gsize undo_entry_bytes(int index) {
+    gsize bytes = pixbuf_bytes(undo_stack.states[index]) + packed_snapshot_bytes(undo_stack.packed[index]);
+    if (undo_stack.ops[index].spans) {
+        bytes += undo_stack.ops[index].spans->len * sizeof(FillSpan);
+    }
+    return bytes;
+}
+
+static void memory_measure(gsize *bytes) {
+    memset(bytes, 0, MEMORY_CATEGORIES * sizeof(gsize));
     
-    // Update button sensitivity - enable undo if we have more than one state
-    gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
-    gtk_widget_set_sensitive(redo_button, undo_stack.current < undo_stack.top);
+    bytes[MEMORY_IMAGE] = pixbuf_bytes(current_pixbuf) + surface_bytes(stroke_layer.surface);
+    
+    for (int i = 0; i <= undo_stack.top; i++) {
+        bytes[MEMORY_UNDO] += undo_entry_bytes(i);
+    }
+    
+    if (render.target) {
+        bytes[MEMORY_CACHES] += surface_bytes(render.target->surfaces[0]) +
+                                surface_bytes(render.target->surfaces[1]);
+    }
+    bytes[MEMORY_CACHES] += surface_bytes(render.overlay) +
+                           pixbuf_bytes(compare.other) + surface_bytes(compare.other_surface) +
+                           surface_bytes(compare.heatmap) +
+                           pixbuf_bytes(adjust_preview.proxy) + pixbuf_bytes(adjust_preview.adjusted) +
+                           surface_bytes(adjust_preview.surface);
+    if (edge_snap.snap_x) {
+        bytes[MEMORY_CACHES] += (gsize)(edge_snap.width + edge_snap.height + 2) * sizeof(gint);
+    }
+    for (guint i = 0; review.items && i < review.items->len; i++) {
+        ReviewItem *item = g_ptr_array_index(review.items, i);
+        bytes[MEMORY_CACHES] += pixbuf_bytes(item->pixbuf);
+    }
+    g_mutex_lock(&pixel_pool.lock);
+    bytes[MEMORY_CACHES] += pixel_pool.cached_bytes;
+    g_mutex_unlock(&pixel_pool.lock);
+    
+    bytes[MEMORY_SAVES] = (gsize)g_atomic_pointer_get(&memory.pending_saves);
 }
 
-static void undo(void) {
-    g_print("Undo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+static gsize memory_total(const gsize *bytes) {
+    gsize total = 0;
+    for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+        total += bytes[c];
+    }
+    return total;
+}
+
+// Count an image handed to a writer thread, or its release once written;
+// callable from any thread
+static void memory_charge_save(GdkPixbuf *pixbuf, gboolean pending) {
+    gssize bytes = pixbuf_bytes(pixbuf);
+    g_atomic_pointer_add(&memory.pending_saves, pending ? bytes : -bytes);
+}
+
+// Free lower-priority holdings until total fits below the budget
+static void memory_relieve(gsize total) {
+    gint64 start_time = g_get_monotonic_time();
+    gsize start_total = total;
+    gsize target = memory.budget - memory.budget / MEMORY_SLACK_DIVISOR;
+    int packed = 0;
+    int dropped = 0;
     
-    if (undo_stack.current > 0 && undo_stack.states[undo_stack.current - 1]) {
-        undo_stack.current--;
-        if (current_pixbuf) {
-            g_object_unref(current_pixbuf);
+    total -= MIN(total, pixel_pool_trim());
+    
+    // Prefetched images furthest from the one in view go first
+    for (gint i = review.items ? (gint)review.items->len - 1 : -1; i >= 0 && total > target; i--) {
+        ReviewItem *item = g_ptr_array_index(review.items, i);
+        if (item->pixbuf) {
+            total -= MIN(total, pixbuf_bytes(item->pixbuf));
+            g_clear_object(&item->pixbuf);
         }
-        current_pixbuf = gdk_pixbuf_copy(undo_stack.states[undo_stack.current]);
-        
-        g_print("Undoing to size: %dx%d\n", 
-                gdk_pixbuf_get_width(current_pixbuf),
-                gdk_pixbuf_get_height(current_pixbuf));
-        
-        // Update drawing area size
-        gtk_widget_set_size_request(drawing_area, 
-                                  gdk_pixbuf_get_width(current_pixbuf),
-                                  gdk_pixbuf_get_height(current_pixbuf));
-        
-        gtk_widget_queue_draw(drawing_area);
-        
-        g_print("After Undo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+    }
+    
+    for (int i = 0; i <= undo_stack.top && total > target; i++) {
+        if (!undo_stack.states[i]) continue;
         
-        // Update button sensitivity
+        PackedSnapshot *snapshot = pack_snapshot(undo_stack.states[i]);
+        gsize before = pixbuf_bytes(undo_stack.states[i]);
+        gsize after = packed_snapshot_bytes(snapshot);
+        if (!snapshot || after >= before) {
+            packed_snapshot_free(snapshot);
+            continue;
+        }
+        g_object_unref(undo_stack.states[i]);
+        undo_stack.states[i] = NULL;
+        undo_stack.packed[i] = snapshot;
+        total -= MIN(total, before - after);
+        packed++;
+    }
+    
+    // The current step stays; only the history before it can be given up,
+    // and only if that gets under the budget.  When the image and the
+    // current step alone exceed it, the history would go for nothing.
+    gsize history = 0;
+    for (int i = 0; i < undo_stack.current; i++) {
+        history += undo_entry_bytes(i);
+    }
+    if (total - MIN(total, history) <= memory.budget) {
+        while (undo_stack.current > 0 && total > target) {
+            gsize before = undo_entry_bytes(0);
+            if (!undo_drop_oldest()) break;
+            total -= MIN(total, before);
+            dropped++;
+        }
+    }
+    
+    if (dropped > 0) {
         gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
-        gtk_widget_set_sensitive(redo_button, undo_stack.current < undo_stack.top);
     }
+    g_debug("Memory over budget: freed %.1f MB (%d snapshots packed, %d undo steps dropped) in %.1f ms",
+            (start_total - total) / (1024.0 * 1024.0), packed, dropped,
+            (g_get_monotonic_time() - start_time) / 1000.0);
 }
 
-static void redo(void) {
-    g_print("Redo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+static void memory_update_label(const gsize *bytes) {
+    if (!memory_label) return;
     
-    if (undo_stack.current < undo_stack.top && undo_stack.states[undo_stack.current + 1]) {
-        undo_stack.current++;
-        if (current_pixbuf) {
-            g_object_unref(current_pixbuf);
+    GString *tooltip = g_string_new(NULL);
+    for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+        g_string_append_printf(tooltip, "%s: %.1f MB (peak %.1f MB)\n", memory_category_names[c],
+                               bytes[c] / (1024.0 * 1024.0), memory.peak[c] / (1024.0 * 1024.0));
+    }
+    g_string_append_printf(tooltip, "Budget: %.0f MB", memory.budget / (1024.0 * 1024.0));
+    
+    char *text = g_strdup_printf("%.0f MB", memory_total(bytes) / (1024.0 * 1024.0));
+    gtk_label_set_text(GTK_LABEL(memory_label), text);
+    gtk_widget_set_tooltip_text(memory_label, tooltip->str);
+    g_free(text);
+    g_string_free(tooltip, TRUE);
+}
+
+// Measure, record peaks and relieve pressure; main thread only
+static void memory_update(void) {
+    gsize bytes[MEMORY_CATEGORIES];
+    
+    if (memory.relieving) return;
+    
+    memory_measure(bytes);
+    for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+        memory.peak[c] = MAX(memory.peak[c], bytes[c]);
+    }
+    memory.peak_total = MAX(memory.peak_total, memory_total(bytes));
+    
+    memory.pressure = memory_total(bytes) > memory.budget;
+    if (!memory.pressure) {
+        memory.stuck_total = 0;
+    } else if (memory_total(bytes) > memory.stuck_total + memory.budget / MEMORY_SLACK_DIVISOR) {
+        memory.relieving = TRUE;
+        memory_relieve(memory_total(bytes));
+        memory.relieving = FALSE;
+        memory_measure(bytes);
+        memory.pressure = memory_total(bytes) > memory.budget;
+        memory.stuck_total = memory.pressure ? memory_total(bytes) : 0;
+    }
+    memcpy(memory.current, bytes, sizeof(bytes));
+    memory_update_label(bytes);
+}
+
+static void memory_print_stats(void) {
+    g_print("Memory (budget %.0f MB):\n", memory.budget / (1024.0 * 1024.0));
+    for (int c = 0; c < MEMORY_CATEGORIES; c++) {
+        g_print("  %-14s %8.1f MB now, %8.1f MB peak\n", memory_category_names[c],
+                memory.current[c] / (1024.0 * 1024.0), memory.peak[c] / (1024.0 * 1024.0));
+    }
+    g_print("  %-14s %8.1f MB now, %8.1f MB peak\n", "Total",
+            memory_total(memory.current) / (1024.0 * 1024.0), memory.peak_total / (1024.0 * 1024.0));
+}
+
+// Thumbnails
+//
+// Previews for the open dialog and the recent-files strip come from the
+// freedesktop thumbnail cache ($XDG_CACHE_HOME/thumbnails/normal, files named
+// by the MD5 of the URI and validated against Thumb::MTime), so thumbnails
+// are shared with the file manager.  Missing or stale ones are decoded at
+// reduced size on a worker pool and written back.  Queued requests are served
+// newest first: the latest request is the one on screen.
+typedef struct {
+    char *path;
+    guint sequence;        // Order of the request; higher is served first
+    GtkWidget *target;     // GtkImage waiting for the result
+    GdkPixbuf *thumbnail;  // Filled in by the worker, NULL if undecodable
+} ThumbnailJob;
+
+static GThreadPool *thumbnail_pool = NULL;
+static GHashTable *thumbnail_memory = NULL;  // path -> GdkPixbuf, main thread only
+static guint thumbnail_sequence = 0;
+
+static gint thumbnail_job_compare(gconstpointer a, gconstpointer b, gpointer data) {
+    const ThumbnailJob *job_a = a;
+    const ThumbnailJob *job_b = b;
+    
+    if (job_a->sequence == job_b->sequence) return 0;
+    return job_a->sequence > job_b->sequence ? -1 : 1;
+}
+
+static char *thumbnail_cache_path(const char *uri) {
+    char *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+    char *name = g_strconcat(md5, ".png", NULL);
+    char *path = g_build_filename(g_get_user_cache_dir(), "thumbnails", "normal", name, NULL);
+    
+    g_free(name);
+    g_free(md5);
+    return path;
+}
+
+// Write a new thumbnail under a temporary name and rename it into place, so
+// other readers of the cache never see a partial file
+static void store_thumbnail(GdkPixbuf *thumbnail, const char *cache_path,
+                            const char *uri, const char *mtime) {
+    char *dir = g_path_get_dirname(cache_path);
+    char *tmp_path = g_strdup_printf("%s.%p.tmp", cache_path, (void *)g_thread_self());
+    
+    if (g_mkdir_with_parents(dir, 0700) == 0 &&
+        gdk_pixbuf_save(thumbnail, tmp_path, "png", NULL,
+                        "tEXt::Thumb::URI", uri,
+                        "tEXt::Thumb::MTime", mtime,
+                        NULL)) {
+        g_chmod(tmp_path, 0600);
+        if (g_rename(tmp_path, cache_path) != 0) {
+            g_unlink(tmp_path);
         }
-        current_pixbuf = gdk_pixbuf_copy(undo_stack.states[undo_stack.current]);
-        
-        g_print("Redoing to size: %dx%d\n", 
-                gdk_pixbuf_get_width(current_pixbuf),
-                gdk_pixbuf_get_height(current_pixbuf));
-        
-        // Update drawing area size
-        gtk_widget_set_size_request(drawing_area, 
-                                  gdk_pixbuf_get_width(current_pixbuf),
-                                  gdk_pixbuf_get_height(current_pixbuf));
-        
-        gtk_widget_queue_draw(drawing_area);
-        
-        g_print("After Redo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
-        
-        // Update button sensitivity
-        gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
-        gtk_widget_set_sensitive(redo_button, undo_stack.current < undo_stack.top);
+    } else {
+        g_unlink(tmp_path);
+    }
+    
+    g_free(tmp_path);
+    g_free(dir);
+}
+
+// Runs on a worker thread
+static GdkPixbuf *load_or_create_thumbnail(const char *path) {
+    GStatBuf st;
+    if (g_stat(path, &st) != 0) {
+        return NULL;
+    }
+    
+    char *uri = g_filename_to_uri(path, NULL, NULL);
+    if (!uri) {
+        return NULL;
+    }
+    char *cache_path = thumbnail_cache_path(uri);
+    char *mtime = g_strdup_printf("%" G_GINT64_FORMAT, (gint64)st.st_mtime);
+    
+    GdkPixbuf *thumbnail = gdk_pixbuf_new_from_file(cache_path, NULL);
+    if (thumbnail && g_strcmp0(gdk_pixbuf_get_option(thumbnail, "tEXt::Thumb::MTime"), mtime) != 0) {
+        g_clear_object(&thumbnail);  // The file changed since it was thumbnailed
+    }
+    
+    if (!thumbnail) {
+        int width, height;
+        if (gdk_pixbuf_get_file_info(path, &width, &height)) {
+            // Let the loader decode at reduced size; never scale small images up
+            if (width > THUMBNAIL_SIZE || height > THUMBNAIL_SIZE) {
+                thumbnail = gdk_pixbuf_new_from_file_at_scale(path, THUMBNAIL_SIZE, THUMBNAIL_SIZE,
+                                                              TRUE, NULL);
+            } else {
+                thumbnail = gdk_pixbuf_new_from_file(path, NULL);
+            }
+        }
+        if (thumbnail) {
+            store_thumbnail(thumbnail, cache_path, uri, mtime);
+        }
+    }
+    
+    g_free(mtime);
+    g_free(cache_path);
+    g_free(uri);
+    return thumbnail;
+}
+
+static void set_thumbnail_image(GtkWidget *image, GdkPixbuf *thumbnail) {
+    int max_size = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(image), "thumbnail-size"));
+    int width = gdk_pixbuf_get_width(thumbnail);
+    int height = gdk_pixbuf_get_height(thumbnail);
+    
+    if (max_size > 0 && (width > max_size || height > max_size)) {
+        double scale = (double)max_size / MAX(width, height);
+        GdkPixbuf *scaled = gdk_pixbuf_scale_simple(thumbnail,
+                                                    MAX(1, (int)(width * scale + 0.5)),
+                                                    MAX(1, (int)(height * scale + 0.5)),
+                                                    GDK_INTERP_BILINEAR);
+        gtk_image_set_from_pixbuf(GTK_IMAGE(image), scaled);
+        g_object_unref(scaled);
+    } else {
+        gtk_image_set_from_pixbuf(GTK_IMAGE(image), thumbnail);
+    }
+}
+
+// Back on the main thread
+static gboolean deliver_thumbnail(gpointer data) {
+    ThumbnailJob *job = data;
+    
+    if (job->thumbnail) {
+        if (g_hash_table_size(thumbnail_memory) >= THUMBNAIL_MEMORY_ITEMS) {
+            g_hash_table_remove_all(thumbnail_memory);
+        }
+        g_hash_table_replace(thumbnail_memory, g_strdup(job->path), g_object_ref(job->thumbnail));
+    }
+    
+    // The image may have been pointed at another file in the meantime
+    const char *wanted = g_object_get_data(G_OBJECT(job->target), "thumbnail-path");
+    if (g_strcmp0(wanted, job->path) == 0) {
+        if (job->thumbnail) {
+            set_thumbnail_image(job->target, job->thumbnail);
+        } else {
+            gtk_image_set_from_icon_name(GTK_IMAGE(job->target), "image-missing", GTK_ICON_SIZE_DIALOG);
+        }
+    }
+    
+    g_clear_object(&job->thumbnail);
+    g_object_unref(job->target);
+    g_free(job->path);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void thumbnail_worker(gpointer data, gpointer user_data) {
+    ThumbnailJob *job = data;
+    
+    job->thumbnail = load_or_create_thumbnail(job->path);
+    g_idle_add(deliver_thumbnail, job);
+}
+
+// Show the thumbnail of path in image, scaled to fit max_size (0 for the
+// full thumbnail size).  A placeholder is shown until it is ready.
+static void request_thumbnail(GtkWidget *image, const char *path, int max_size) {
+    g_object_set_data_full(G_OBJECT(image), "thumbnail-path", g_strdup(path), g_free);
+    g_object_set_data(G_OBJECT(image), "thumbnail-size", GINT_TO_POINTER(max_size));
+    
+    if (!thumbnail_memory) {
+        thumbnail_memory = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+    }
+    GdkPixbuf *cached = g_hash_table_lookup(thumbnail_memory, path);
+    if (cached) {
+        set_thumbnail_image(image, cached);
+        return;
+    }
+    
+    gtk_image_set_from_icon_name(GTK_IMAGE(image), "image-x-generic", GTK_ICON_SIZE_DIALOG);
+    
+    if (!thumbnail_pool) {
+        thumbnail_pool = g_thread_pool_new(thumbnail_worker, NULL, THUMBNAIL_WORKERS, FALSE, NULL);
+        g_thread_pool_set_sort_function(thumbnail_pool, thumbnail_job_compare, NULL);
+    }
+    
+    ThumbnailJob *job = g_new0(ThumbnailJob, 1);
+    job->path = g_strdup(path);
+    job->sequence = ++thumbnail_sequence;
+    job->target = g_object_ref(image);
+    g_thread_pool_push(thumbnail_pool, job, NULL);
+}
+
+// Drop the in-memory thumbnail of a file that has just been rewritten
+static void forget_thumbnail(const char *path) {
+    if (thumbnail_memory) {
+        g_hash_table_remove(thumbnail_memory, path);
+    }
+}
+
+static void remember_recent_file(const char *filename) {
+    char *uri = g_filename_to_uri(filename, NULL, NULL);
+    if (uri) {
+        gtk_recent_manager_add_item(gtk_recent_manager_get_default(), uri);
+        g_free(uri);
+    }
+}
+
+static gint compare_recent_modified(gconstpointer a, gconstpointer b) {
+    time_t modified_a = gtk_recent_info_get_modified((GtkRecentInfo *)a);
+    time_t modified_b = gtk_recent_info_get_modified((GtkRecentInfo *)b);
+    
+    if (modified_a == modified_b) return 0;
+    return modified_a > modified_b ? -1 : 1;
+}
+
+static void on_recent_item_clicked(GtkButton *button, gpointer data) {
+    char *path = g_strdup(g_object_get_data(G_OBJECT(button), "recent-path"));
+    load_image_from_file(path);
+    g_free(path);
+}
+
+// Rebuild the strip from the most recently used local images
+static void refresh_recent_strip(void) {
+    if (!recent_strip) return;
+    
+    GList *children = gtk_container_get_children(GTK_CONTAINER(recent_strip));
+    for (GList *l = children; l; l = l->next) {
+        gtk_widget_destroy(l->data);
+    }
+    g_list_free(children);
+    
+    GList *items = gtk_recent_manager_get_items(gtk_recent_manager_get_default());
+    items = g_list_sort(items, compare_recent_modified);
+    
+    GtkWidget *images[RECENT_STRIP_ITEMS];
+    char *paths[RECENT_STRIP_ITEMS];
+    int shown = 0;
+    
+    for (GList *l = items; l && shown < RECENT_STRIP_ITEMS; l = l->next) {
+        GtkRecentInfo *info = l->data;
+        const char *mime_type = gtk_recent_info_get_mime_type(info);
+        
+        if (!gtk_recent_info_is_local(info) || !mime_type ||
+            !g_str_has_prefix(mime_type, "image/") || !gtk_recent_info_exists(info)) {
+            continue;
+        }
+        char *path = g_filename_from_uri(gtk_recent_info_get_uri(info), NULL, NULL);
+        if (!path) continue;
+        
+        GtkWidget *button = gtk_button_new();
+        GtkWidget *image = gtk_image_new();
+        gtk_button_set_relief(GTK_BUTTON(button), GTK_RELIEF_NONE);
+        gtk_container_add(GTK_CONTAINER(button), image);
+        gtk_widget_set_tooltip_text(button, path);
+        g_object_set_data_full(G_OBJECT(button), "recent-path", path, g_free);
+        g_signal_connect(button, "clicked", G_CALLBACK(on_recent_item_clicked), NULL);
+        gtk_box_pack_start(GTK_BOX(recent_strip), button, FALSE, FALSE, 0);
+        
+        images[shown] = image;
+        paths[shown] = path;
+        shown++;
+    }
+    g_list_free_full(items, (GDestroyNotify)gtk_recent_info_unref);
+    
+    // Request right to left so the leftmost (newest) thumbnail is served first
+    for (int i = shown - 1; i >= 0; i--) {
+        request_thumbnail(images[i], paths[i], RECENT_STRIP_THUMB_SIZE);
+    }
+    
+    gtk_widget_show_all(recent_strip);
+    gtk_widget_set_visible(recent_strip, shown > 0);
+}
+
+static void on_recent_changed(GtkRecentManager *manager, gpointer data) {
+    refresh_recent_strip();
+}
+
+static gboolean refresh_recent_strip_idle(gpointer data) {
+    refresh_recent_strip();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean load_image_from_file(const gchar *filename) {
+    GError *error = NULL;
+    GdkPixbuf *decoded = gdk_pixbuf_new_from_file(filename, &error);
+    if (error) {
+        g_error_free(error);
+        return FALSE;
+    }
+    GdkPixbuf *pixbuf = pool_pixbuf_import(decoded);
+    g_object_unref(decoded);
+    if (!pixbuf) {
+        g_printerr("Not enough memory to open %s\n", filename);
+        return FALSE;
+    }
+    review_end();
+    show_loaded_image(filename, pixbuf);
+    return TRUE;
+}
+
+// Make a decoded pool pixbuf the image being edited, with a fresh history
+static void show_loaded_image(const gchar *filename, GdkPixbuf *pixbuf) {
+    if (!journal_owns_path(filename)) {
+        remember_recent_file(filename);
+    }
+    if (current_pixbuf) {
+        g_object_unref(current_pixbuf);
+    }
+    current_pixbuf = pixbuf;
+    
+    // A selection on the previous image means nothing here
+    crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
+    is_selecting = FALSE;
+    gtk_widget_set_sensitive(crop_button, FALSE);
+    
+    update_drawing_area();
+    reset_undo_history();
+    lossless_source_set(filename);
+    journal_begin_file(filename);
+}
+
+// Start the undo history over with current_pixbuf as its initial state
+static void reset_undo_history(void) {
+    for (int i = 0; i <= undo_stack.top; i++) {
+        clear_undo_entry(i);
+    }
+    undo_stack.current = -1;
+    undo_stack.top = -1;
+    
+    // Push initial state
+    push_undo_state();
+    
+    // Disable undo since this is the initial state
+    gtk_widget_set_sensitive(undo_button, FALSE);
+    gtk_widget_set_sensitive(redo_button, FALSE);
+}
+
+// The clipboard is read asynchronously so the window can paint meanwhile
+static void load_image_from_clipboard() {
+    GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+    gtk_clipboard_request_image(clipboard, on_clipboard_image_received, NULL);
+}
+
+static void on_clipboard_image_received(GtkClipboard *clipboard, GdkPixbuf *pixbuf, gpointer data) {
+    GdkPixbuf *imported = pixbuf ? pool_pixbuf_import(pixbuf) : NULL;
+    
+    if (imported) {
+        review_end();
+        if (current_pixbuf) {
+            g_object_unref(current_pixbuf);
+        }
+        current_pixbuf = imported;
+        
+        // Reset crop state
+        crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
+        is_selecting = FALSE;
+        if (crop_button) {
+            gtk_widget_set_sensitive(crop_button, FALSE);
+        }
+        
+        reset_undo_history();
+        journal_begin_snapshot();
+        update_drawing_area();
+    }
+}
+
+// PNG writing
+//
+// Rows are handed to libpng one small block at a time from a PngRowSource,
+// so saving never needs a second full-size copy of the image.  Sources whose
+// rows are already 8-bit RGB(A) return them in place; others (such as
+// palette indices) convert each block into a scratch buffer.  Files are
+// written under a temporary name and renamed over the target once complete,
+// so a failed save never replaces a good file.
+static png_bytep pixbuf_png_row(gpointer data, int y, guint8 *scratch) {
+    GdkPixbuf *pixbuf = data;
+    return (png_bytep)gdk_pixbuf_read_pixels(pixbuf) + (gsize)y * gdk_pixbuf_get_rowstride(pixbuf);
+}
+
+static void init_pixbuf_png_source(PngRowSource *source, GdkPixbuf *pixbuf) {
+    source->width = gdk_pixbuf_get_width(pixbuf);
+    source->height = gdk_pixbuf_get_height(pixbuf);
+    source->has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    source->get_row = pixbuf_png_row;
+    source->converts = FALSE;
+    source->data = pixbuf;
+    source->palette = NULL;
+    source->n_palette = 0;
+    source->trans = NULL;
+    source->n_trans = 0;
+}
+
+// Encode into an open stream; name is only used in error messages
+static gboolean write_png_stream(FILE *file, const char *name, const PngRowSource *source, GError **error) {
+    gint n_channels = source->palette ? 1 : source->has_alpha ? 4 : 3;
+    gsize row_bytes = (gsize)source->width * n_channels;
+    guint8 *scratch = source->converts ? g_malloc(row_bytes * PNG_ROW_BLOCK) : NULL;
+    png_bytep rows[PNG_ROW_BLOCK];
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        g_free(scratch);
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Could not encode %s", name);
+        return FALSE;
+    }
+    
+    png_init_io(png, file);
+    if (source->palette) {
+        // Small palettes pack several pixels per byte
+        int depth = source->n_palette <= 2 ? 1 : source->n_palette <= 4 ? 2 : source->n_palette <= 16 ? 4 : 8;
+        png_set_IHDR(png, info, source->width, source->height, depth, PNG_COLOR_TYPE_PALETTE,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_PLTE(png, info, source->palette, source->n_palette);
+        if (source->n_trans > 0) {
+            png_set_tRNS(png, info, source->trans, source->n_trans, NULL);
+        }
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    } else {
+        png_set_IHDR(png, info, source->width, source->height, 8,
+                     source->has_alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    }
+    png_write_info(png, info);
+    if (source->palette) {
+        png_set_packing(png);
+    }
+    
+    for (int y = 0; y < source->height; y += PNG_ROW_BLOCK) {
+        int count = MIN(PNG_ROW_BLOCK, source->height - y);
+        for (int i = 0; i < count; i++) {
+            rows[i] = source->get_row(source->data, y + i, scratch ? scratch + i * row_bytes : NULL);
+        }
+        png_write_rows(png, rows, count);
+    }
+    
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    g_free(scratch);
+    
+    if (fflush(file) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Could not write %s: %s", name, g_strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean write_png(const gchar *filename, const PngRowSource *source, GError **error) {
+    gchar *temp_name = g_strdup_printf("%s.XXXXXX", filename);
+    int fd = g_mkstemp_full(temp_name, O_WRONLY, 0666);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Could not open %s for writing: %s", filename, g_strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            g_unlink(temp_name);
+        }
+        g_free(temp_name);
+        return FALSE;
+    }
+    
+    gboolean written = write_png_stream(file, filename, source, error);
+    if (fclose(file) != 0 && written) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Could not write %s: %s", filename, g_strerror(errno));
+        written = FALSE;
+    }
+    if (written && g_rename(temp_name, filename) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Could not replace %s: %s", filename, g_strerror(errno));
+        written = FALSE;
+    }
+    if (!written) {
+        g_unlink(temp_name);
+    }
+    g_free(temp_name);
+    return written;
+}
+
+static gboolean filename_is_jpeg(const gchar *filename) {
+    gchar *lower = g_ascii_strdown(filename, -1);
+    gboolean jpeg = g_str_has_suffix(lower, ".jpg") || g_str_has_suffix(lower, ".jpeg");
+    g_free(lower);
+    return jpeg;
+}
+
+// Encode a pixbuf as JPEG into memory, then write it in one step so a
+// failure leaves any existing file intact
+static gboolean write_jpeg(GdkPixbuf *pixbuf, const gchar *filename, GError **error) {
+    gchar *buffer = NULL;
+    gsize size = 0;
+    
+    if (!gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &size, "jpeg", error,
+                                   "quality", JPEG_SAVE_QUALITY, NULL)) {
+        return FALSE;
+    }
+    gboolean written = g_file_set_contents(filename, buffer, size, error);
+    g_free(buffer);
+    return written;
+}
+
+// Encode a pixbuf as PNG, as a palette image when optimized allows, or as
+// JPEG for a .jpg name; safe to call off the main thread
+static gboolean write_image_file(GdkPixbuf *pixbuf, const gchar *filename, gboolean optimized,
+                                 gboolean *lossy, GError **error) {
+    PngRowSource source;
+    gboolean indexed = FALSE;
+    gint64 start_time = g_get_monotonic_time();
+    
+    *lossy = FALSE;
+    if (filename_is_jpeg(filename)) {
+        *lossy = TRUE;
+        return write_jpeg(pixbuf, filename, error);
+    }
+    if (optimized) {
+        indexed = init_palette_png_source(&source, pixbuf, lossy);
+    }
+    if (!indexed) {
+        init_pixbuf_png_source(&source, pixbuf);
+    }
+    
+    gboolean written = write_png(filename, &source, error);
+    if (indexed) {
+        g_debug("Saved %d-color %s palette in %.1f ms", source.n_palette,
+                *lossy ? "quantized" : "exact", (g_get_monotonic_time() - start_time) / 1000.0);
+        free_palette_png_source(&source);
+    }
+    return written;
+}
+
+static void save_image(const gchar *filename) {
+    if (current_pixbuf) {
+        GError *error = NULL;
+        gboolean lossy = FALSE;
+        
+        if (save_jpeg_lossless(filename)) {
+            forget_thumbnail(filename);
+            remember_recent_file(filename);
+            journal_begin_file(filename);
+            return;
+        }
+        if (!write_image_file(current_pixbuf, filename, save_optimized, &lossy, &error)) {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+            return;
+        }
+        if (filename_is_jpeg(filename)) {
+            g_print("Saved %s re-encoded at quality %s; it could not be written losslessly\n",
+                    filename, JPEG_SAVE_QUALITY);
+        }
+        forget_thumbnail(filename);
+        remember_recent_file(filename);
+        
+        // The saved file is the new base for crash recovery, unless it lost
+        // colors the session still has
+        if (lossy) {
+            journal_begin_snapshot();
+        } else {
+            journal_begin_file(filename);
+        }
+    }
+}
+
+// Lossless JPEG saving
+//
+// A JPEG that has only been cropped, rotated or flipped since it was opened
+// is saved by applying the same crop and transform to its DCT coefficients
+// with libjpeg-turbo, skipping the decode and re-encode.  Each undo entry
+// carries a LosslessPlan describing how its image derives from the source
+// file; any pixel edit clears it.  Saving falls back to the normal encoder,
+// PNG or re-encoded JPEG by the file name, when the target is not a .jpg,
+// the source file changed on disk, the crop does not start on an MCU (JPEG
+// block) boundary, or the transform would leave partial MCUs at an edge.
+// All markers are copied, keeping the ICC profile; only the EXIF
+// orientation is reset once the coefficients have been turned.
+typedef struct {
+    char *path;
+    gint64 mtime;
+    gint64 size;
+    int width;
+    int height;
+} LosslessSource;
+
+static LosslessSource lossless_source;
+
+// Remember a newly opened file as the source for lossless saves, and make
+// the initial undo entry the identity plan when it is a JPEG
+static void lossless_source_set(const gchar *filename) {
+    GdkPixbufFormat *format = NULL;
+    GStatBuf st;
+    
+    g_clear_pointer(&lossless_source.path, g_free);
+    if (!filename || !current_pixbuf || undo_stack.current != 0) return;
+    
+    format = gdk_pixbuf_get_file_info(filename, NULL, NULL);
+    if (!format || g_stat(filename, &st) != 0) return;
+    gchar *name = gdk_pixbuf_format_get_name(format);
+    gboolean is_jpeg = g_strcmp0(name, "jpeg") == 0;
+    g_free(name);
+    if (!is_jpeg) return;
+    
+    lossless_source.path = g_strdup(filename);
+    lossless_source.mtime = st.st_mtime;
+    lossless_source.size = st.st_size;
+    lossless_source.width = gdk_pixbuf_get_width(current_pixbuf);
+    lossless_source.height = gdk_pixbuf_get_height(current_pixbuf);
+    
+    LosslessPlan *plan = &undo_stack.ops[0].lossless;
+    plan->valid = TRUE;
+    plan->swap = plan->flip_x = plan->flip_y = FALSE;
+    plan->crop = (GdkRectangle){0, 0, lossless_source.width, lossless_source.height};
+}
+
+// The plan after applying a transform to an image with plan prev
+static void lossless_plan_transform(LosslessPlan *plan, const LosslessPlan *prev, ImageTransform transform) {
+    gboolean swap = FALSE, flip_x = FALSE, flip_y = FALSE;
+    
+    *plan = *prev;
+    if (!prev->valid) return;
+    
+    switch (transform) {
+        case TRANSFORM_ROTATE_90:
+            swap = flip_x = TRUE;
+            break;
+        case TRANSFORM_ROTATE_180:
+            flip_x = flip_y = TRUE;
+            break;
+        case TRANSFORM_ROTATE_270:
+            swap = flip_y = TRUE;
+            break;
+        case TRANSFORM_FLIP_HORIZONTAL:
+            flip_x = TRUE;
+            break;
+        case TRANSFORM_FLIP_VERTICAL:
+            flip_y = TRUE;
+            break;
+    }
+    
+    // A transpose after earlier flips turns them into flips of the other axis
+    plan->swap = prev->swap != swap;
+    plan->flip_x = flip_x != (swap ? prev->flip_y : prev->flip_x);
+    plan->flip_y = flip_y != (swap ? prev->flip_x : prev->flip_y);
+}
+
+// The plan after cropping a width x height image with plan prev
+static void lossless_plan_crop(LosslessPlan *plan, const LosslessPlan *prev, int width, int height,
+                               int x, int y, int crop_width, int crop_height) {
+    *plan = *prev;
+    if (!prev->valid) return;
+    
+    // Undo the orientation to find the rectangle in the cropped source
+    if (prev->flip_y) {
+        y = height - y - crop_height;
+    }
+    if (prev->flip_x) {
+        x = width - x - crop_width;
+    }
+    if (prev->swap) {
+        int t = x; x = y; y = t;
+        t = crop_width; crop_width = crop_height; crop_height = t;
+    }
+    plan->crop.x = prev->crop.x + x;
+    plan->crop.y = prev->crop.y + y;
+    plan->crop.width = crop_width;
+    plan->crop.height = crop_height;
+}
+
+// libjpeg-turbo operation for an orientation
+static int lossless_plan_op(const LosslessPlan *plan) {
+    static const int ops[2][2][2] = {
+        {{TJXOP_NONE, TJXOP_VFLIP}, {TJXOP_HFLIP, TJXOP_ROT180}},
+        {{TJXOP_TRANSPOSE, TJXOP_ROT270}, {TJXOP_ROT90, TJXOP_TRANSVERSE}}
+    };
+    return ops[plan->swap != 0][plan->flip_x != 0][plan->flip_y != 0];
+}
+
+static guint exif_get_u16(const guint8 *p, gboolean big_endian) {
+    return big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static guint32 exif_get_u32(const guint8 *p, gboolean big_endian) {
+    return big_endian ? exif_get_u16(p, TRUE) << 16 | exif_get_u16(p + 2, TRUE)
+                      : exif_get_u16(p + 2, FALSE) << 16 | exif_get_u16(p, FALSE);
+}
+
+// Set the orientation tag in the first IFD of a TIFF block to 1, as stored
+static void exif_reset_orientation(guint8 *tiff, gsize size) {
+    if (size < 8 || tiff[0] != tiff[1] || (tiff[0] != 'I' && tiff[0] != 'M')) return;
+    gboolean big_endian = tiff[0] == 'M';
+    
+    guint32 ifd = exif_get_u32(tiff + 4, big_endian);
+    if (ifd > size - 2) return;
+    guint count = exif_get_u16(tiff + ifd, big_endian);
+    
+    for (guint i = 0; i < count; i++) {
+        gsize entry = ifd + 2 + (gsize)i * 12;
+        if (entry + 12 > size) return;
+        // Orientation is one SHORT, stored in the first bytes of the value
+        if (exif_get_u16(tiff + entry, big_endian) == 0x0112 &&
+            exif_get_u16(tiff + entry + 2, big_endian) == 3) {
+            tiff[entry + 8] = big_endian ? 0 : 1;
+            tiff[entry + 9] = big_endian ? 1 : 0;
+            return;
+        }
+    }
+}
+
+// Find the EXIF APP1 segment among a JPEG's markers and reset its
+// orientation in place
+static void jpeg_reset_exif_orientation(guint8 *data, gsize size) {
+    if (size < 4 || data[0] != 0xff || data[1] != 0xd8) return;
+    
+    gsize pos = 2;
+    while (pos + 4 <= size && data[pos] == 0xff) {
+        guint8 marker = data[pos + 1];
+        if (marker == 0xff) {
+            pos++;  // Fill byte
+            continue;
+        }
+        gsize length = (data[pos + 2] << 8) | data[pos + 3];
+        if (marker == 0xda || length < 2 || pos + 2 + length > size) return;  // Start of scan
+        
+        if (marker == 0xe1 && length >= 8 && memcmp(data + pos + 4, "Exif\0\0", 6) == 0) {
+            exif_reset_orientation(data + pos + 10, length - 8);
+            return;
+        }
+        pos += 2 + length;
+    }
+}
+
+// Crop and transform a JPEG in memory as the plan says.  Returns the new
+// JPEG, to be released with tjFree, or NULL when that cannot be done exactly.
+static unsigned char *transform_jpeg(tjhandle handle, const gchar *data, gsize length,
+                                     const LosslessPlan *plan, unsigned long *output_size) {
+    int width, height, subsamp, colorspace;
+    if (tjDecompressHeader3(handle, (unsigned char *)data, length, &width, &height, &subsamp, &colorspace) != 0 ||
+        width != lossless_source.width || height != lossless_source.height ||
+        subsamp < 0 || subsamp >= TJ_NUMSAMP) {
+        return NULL;
+    }
+    
+    // The crop is given in transformed coordinates and must start on an MCU
+    int mcu_width = plan->swap ? tjMCUHeight[subsamp] : tjMCUWidth[subsamp];
+    int mcu_height = plan->swap ? tjMCUWidth[subsamp] : tjMCUHeight[subsamp];
+    GdkRectangle crop = plan->crop;
+    if (plan->swap) {
+        int t = crop.x; crop.x = crop.y; crop.y = t;
+        t = crop.width; crop.width = crop.height; crop.height = t;
+        t = width; width = height; height = t;
+    }
+    if (plan->flip_x) {
+        crop.x = width - crop.x - crop.width;
+    }
+    if (plan->flip_y) {
+        crop.y = height - crop.y - crop.height;
+    }
+    if (crop.x % mcu_width != 0 || crop.y % mcu_height != 0) {
+        g_debug("Lossless save skipped: crop at %d,%d is not on a %dx%d block boundary",
+                crop.x, crop.y, mcu_width, mcu_height);
+        return NULL;
+    }
+    
+    tjtransform transform = {0};
+    transform.op = lossless_plan_op(plan);
+    transform.options = TJXOPT_PERFECT;
+    if (crop.width != width || crop.height != height) {
+        transform.options |= TJXOPT_CROP;
+        transform.r.x = crop.x;
+        transform.r.y = crop.y;
+        transform.r.w = crop.width;
+        transform.r.h = crop.height;
+    }
+    
+    unsigned char *output = NULL;
+    *output_size = 0;
+    if (tjTransform(handle, (unsigned char *)data, length, 1, &output, output_size, &transform, 0) != 0) {
+        g_debug("Lossless save skipped: %s", tjGetErrorStr2(handle));
+        if (output) {
+            tjFree(output);
+        }
+        return NULL;
+    }
+    
+    // Only keep a result that has exactly the size being edited
+    if (tjDecompressHeader3(handle, output, *output_size, &width, &height, &subsamp, &colorspace) != 0 ||
+        width != gdk_pixbuf_get_width(current_pixbuf) || height != gdk_pixbuf_get_height(current_pixbuf)) {
+        tjFree(output);
+        return NULL;
+    }
+    
+    // A copied EXIF orientation tag would turn the result again
+    if (transform.op != TJXOP_NONE) {
+        jpeg_reset_exif_orientation(output, *output_size);
+    }
+    return output;
+}
+
+// The current image as a JPEG made by transforming the source file's
+// coefficients, to be released with tjFree, or NULL when that is not
+// possible
+static unsigned char *lossless_jpeg_output(unsigned long *output_size) {
+    if (!current_pixbuf || undo_stack.current < 0 || !lossless_source.path) return NULL;
+    const LosslessPlan *plan = &undo_stack.ops[undo_stack.current].lossless;
+    if (!plan->valid) return NULL;
+    
+    GStatBuf st;
+    if (g_stat(lossless_source.path, &st) != 0 ||
+        st.st_mtime != lossless_source.mtime || st.st_size != lossless_source.size) {
+        return NULL;
+    }
+    
+    gchar *data = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(lossless_source.path, &data, &length, NULL)) return NULL;
+    
+    tjhandle handle = tjInitTransform();
+    unsigned char *output = handle ? transform_jpeg(handle, data, length, plan, output_size) : NULL;
+    if (handle) {
+        tjDestroy(handle);
+    }
+    g_free(data);
+    return output;
+}
+
+// Write the current image by transforming the source JPEG's coefficients.
+// Returns FALSE without touching filename when that is not possible.
+static gboolean save_jpeg_lossless(const gchar *filename) {
+    if (!filename_is_jpeg(filename)) return FALSE;
+    
+    gint64 start_time = g_get_monotonic_time();
+    unsigned long output_size = 0;
+    unsigned char *output = lossless_jpeg_output(&output_size);
+    if (!output) return FALSE;
+    
+    GError *error = NULL;
+    gboolean saved = g_file_set_contents(filename, (const gchar *)output, output_size, &error);
+    if (saved) {
+        g_debug("Saved %dx%d JPEG losslessly in %.1f ms",
+                gdk_pixbuf_get_width(current_pixbuf), gdk_pixbuf_get_height(current_pixbuf),
+                (g_get_monotonic_time() - start_time) / 1000.0);
+    } else {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+    }
+    tjFree(output);
+    return saved;
+}
+
+// Review queue
+//
+// Several files or a directory on the command line become a queue that is
+// worked through with Previous, Next and Save and Next.  The next
+// REVIEW_PREFETCH images are decoded on background threads into pool
+// pixbufs ahead of time, so moving on installs an already decoded image.
+// Save and Next hands the finished image to a save thread and moves on
+// without waiting.  Annotated copies are written next to the originals as
+// NAME-annotated.png and are shown instead of the original when the queue
+// comes back to an item.
+#define REVIEW_PREFETCH 3
+#define REVIEW_DECODE_WORKERS 2
+#define REVIEW_SUFFIX "-annotated.png"
+
+typedef struct {
+    char *path;
+    guint generation;   // review.generation when requested
+    gint index;
+    GdkPixbuf *pixbuf;  // Pool pixbuf, NULL on failure
+} ReviewDecodeJob;
+
+typedef struct {
+    GdkPixbuf *pixbuf;  // Owned: the image has left the view
+    char *filename;
+    gboolean optimized;
+    ReviewItem *item;   // Only touched on the main thread
+    guint generation;
+    gboolean written;
+    gboolean lossy;
+    GError *error;
+    gint64 start_time;
+} ReviewSaveJob;
+
+static void review_prefetch(void);
+
+static void review_item_free(gpointer data) {
+    ReviewItem *item = data;
+    g_clear_object(&item->pixbuf);
+    g_free(item->path);
+    g_free(item);
+}
+
+static char *review_output_path(const char *path) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, G_DIR_SEPARATOR);
+    gsize stem = dot && (!slash || dot > slash) ? (gsize)(dot - path) : strlen(path);
+    char *base = g_strndup(path, stem);
+    char *output = g_strconcat(base, REVIEW_SUFFIX, NULL);
+    g_free(base);
+    return output;
+}
+
+// The annotated copy once there is one, else the original
+static char *review_source_path(ReviewItem *item) {
+    char *output = review_output_path(item->path);
+    if (g_file_test(output, G_FILE_TEST_IS_REGULAR)) {
+        return output;
+    }
+    g_free(output);
+    return g_strdup(item->path);
+}
+
+static void review_update_bar(void) {
+    guint n_items = review.items ? review.items->len : 0;
+    gtk_widget_set_visible(review_bar, n_items > 0);
+    if (n_items == 0) return;
+    
+    ReviewItem *item = g_ptr_array_index(review.items, review.index);
+    char *name = g_path_get_basename(item->path);
+    char *text = g_strdup_printf("%d of %u: %s%s", review.index + 1, n_items, name,
+                                 review.waiting ? " (loading)" : item->failed ? " (could not load)" : "");
+    gtk_label_set_text(GTK_LABEL(review_label), text);
+    g_free(text);
+    g_free(name);
+    
+    gtk_widget_set_sensitive(review_prev_button, review.index > 0);
+    gtk_widget_set_sensitive(review_next_button, review.index + 1 < (gint)n_items);
+    gtk_widget_set_sensitive(review_save_button, current_pixbuf != NULL);
+}
+
+// Install a decoded image as the current item
+static void review_show(ReviewItem *item, GdkPixbuf *pixbuf) {
+    char *source = review_source_path(item);
+    review.waiting = FALSE;
+    show_loaded_image(source, pixbuf);
+    g_free(source);
+    review_update_bar();
+}
+
+static gboolean deliver_review_decode(gpointer data) {
+    ReviewDecodeJob *job = data;
+    
+    if (job->generation == review.generation) {
+        ReviewItem *item = g_ptr_array_index(review.items, job->index);
+        item->decoding = FALSE;
+        item->failed = job->pixbuf == NULL;
+        
+        if (job->index == review.index && review.waiting) {
+            if (job->pixbuf) {
+                review_show(item, job->pixbuf);
+                job->pixbuf = NULL;
+            } else {
+                review.waiting = FALSE;
+                review_update_bar();
+            }
+            review_prefetch();
+        } else if (job->index >= review.index && job->index <= review.index + REVIEW_PREFETCH) {
+            item->pixbuf = job->pixbuf;
+            job->pixbuf = NULL;
+            memory_update();
+        }
+    }
+    
+    g_clear_object(&job->pixbuf);
+    g_free(job->path);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void review_decode_worker(gpointer data, gpointer user_data) {
+    ReviewDecodeJob *job = data;
+    
+    // The queue was replaced or ended while this waited its turn
+    if ((guint)g_atomic_int_get(&review.generation) != job->generation) {
+        g_idle_add(deliver_review_decode, job);
+        return;
+    }
+    
+    gint64 start_time = g_get_monotonic_time();
+    GError *error = NULL;
+    GdkPixbuf *decoded = gdk_pixbuf_new_from_file(job->path, &error);
+    
+    if (decoded) {
+        // Into a pool buffer here rather than on the main thread
+        job->pixbuf = pool_pixbuf_import(decoded);
+        g_object_unref(decoded);
+        g_debug("Prefetched %s in %.1f ms", job->path, (g_get_monotonic_time() - start_time) / 1000.0);
+    } else {
+        g_printerr("Could not load %s: %s\n", job->path, error->message);
+        g_error_free(error);
+    }
+    g_idle_add(deliver_review_decode, job);
+}
+
+static void review_request_decode(gint index) {
+    ReviewItem *item = g_ptr_array_index(review.items, index);
+    if (item->pixbuf || item->decoding || item->saving || item->failed) return;
+    
+    if (!review.decode_pool) {
+        review.decode_pool = g_thread_pool_new(review_decode_worker, NULL, REVIEW_DECODE_WORKERS, FALSE, NULL);
+    }
+    
+    ReviewDecodeJob *job = g_new0(ReviewDecodeJob, 1);
+    job->path = review_source_path(item);
+    job->generation = review.generation;
+    job->index = index;
+    item->decoding = TRUE;
+    g_thread_pool_push(review.decode_pool, job, NULL);
+}
+
+// Keep the current item and the next REVIEW_PREFETCH decoded, and nothing
+// else; only the next one while memory is over budget
+static void review_prefetch(void) {
+    gint depth = memory.pressure ? 1 : REVIEW_PREFETCH;
+    
+    for (gint i = 0; i < (gint)review.items->len; i++) {
+        ReviewItem *item = g_ptr_array_index(review.items, i);
+        if (i < review.index || i > review.index + depth) {
+            g_clear_object(&item->pixbuf);
+        }
+    }
+    
+    // The current item first, for when it is still being waited for
+    for (gint i = review.index; i <= MIN(review.index + depth, (gint)review.items->len - 1); i++) {
+        review_request_decode(i);
+    }
+}
+
+static void review_go(gint index) {
+    if (!review.items || index < 0 || index >= (gint)review.items->len) return;
+    
+    ReviewItem *item = g_ptr_array_index(review.items, index);
+    review.index = index;
+    
+    if (item->pixbuf) {
+        GdkPixbuf *pixbuf = item->pixbuf;
+        item->pixbuf = NULL;
+        review_show(item, pixbuf);
+    } else {
+        // Nothing to edit until the image arrives
+        review.waiting = TRUE;
+        if (current_pixbuf) {
+            g_object_unref(current_pixbuf);
+            current_pixbuf = NULL;
+        }
+        reset_undo_history();
+        update_drawing_area();
+        review_update_bar();
+    }
+    review_prefetch();
+}
+
+// Leaving an image with edits throws them away; ask first
+static gboolean review_confirm_leave(void) {
+    if (undo_stack.current <= 0) return TRUE;
+    
+    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(main_window), GTK_DIALOG_MODAL,
+                                               GTK_MESSAGE_QUESTION, GTK_BUTTONS_NONE,
+                                               "Discard the changes to this image?");
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog), "_Cancel", GTK_RESPONSE_CANCEL,
+                           "_Discard", GTK_RESPONSE_ACCEPT, NULL);
+    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    return response == GTK_RESPONSE_ACCEPT;
+}
+
+static gboolean deliver_review_save(gpointer data) {
+    ReviewSaveJob *job = data;
+    
+    review.saves_pending--;
+    memory_charge_save(job->pixbuf, FALSE);
+    if (job->written) {
+        g_debug("Saved %s in the background in %.1f ms", job->filename,
+                (g_get_monotonic_time() - job->start_time) / 1000.0);
+        forget_thumbnail(job->filename);
+        remember_recent_file(job->filename);
+    } else {
+        g_printerr("%s\n", job->error->message);
+        g_error_free(job->error);
+    }
+    
+    // The item can be decoded again now that its file is complete
+    if (job->generation == review.generation) {
+        job->item->saving = FALSE;
+        review_prefetch();
+    }
+    
+    g_object_unref(job->pixbuf);
+    g_free(job->filename);
+    g_free(job);
+    memory_update();
+    return G_SOURCE_REMOVE;
+}
+
+static void review_save_worker(gpointer data, gpointer user_data) {
+    ReviewSaveJob *job = data;
+    job->written = write_image_file(job->pixbuf, job->filename, job->optimized, &job->lossy, &job->error);
+    g_idle_add(deliver_review_save, job);
+}
+
+static void on_review_save_next_clicked(GtkButton *button, gpointer data) {
+    if (!current_pixbuf || !review.items || review.index < 0 || review.waiting) return;
+    
+    ReviewItem *item = g_ptr_array_index(review.items, review.index);
+    char *output = review_output_path(item->path);
+    
+    // The last image stays in view, so it is saved in place
+    if (review.index + 1 >= (gint)review.items->len) {
+        save_image(output);
+        g_free(output);
+        return;
+    }
+    
+    if (!review.save_pool) {
+        // One thread, so saves finish in order
+        review.save_pool = g_thread_pool_new(review_save_worker, NULL, 1, FALSE, NULL);
+    }
+    
+    ReviewSaveJob *job = g_new0(ReviewSaveJob, 1);
+    job->pixbuf = g_object_ref(current_pixbuf);  // Nothing edits it once it is replaced
+    job->filename = output;
+    job->optimized = save_optimized;
+    job->item = item;
+    job->generation = review.generation;
+    job->start_time = g_get_monotonic_time();
+    item->saving = TRUE;
+    review.saves_pending++;
+    memory_charge_save(job->pixbuf, TRUE);
+    
+    review_go(review.index + 1);
+    g_thread_pool_push(review.save_pool, job, NULL);
+}
+
+static void on_review_prev_clicked(GtkButton *button, gpointer data) {
+    if (review_confirm_leave()) {
+        review_go(review.index - 1);
+    }
+}
+
+static void on_review_next_clicked(GtkButton *button, gpointer data) {
+    if (review_confirm_leave()) {
+        review_go(review.index + 1);
+    }
+}
+
+static gint review_compare_paths(gconstpointer a, gconstpointer b) {
+    const ReviewItem *item_a = *(ReviewItem * const *)a;
+    const ReviewItem *item_b = *(ReviewItem * const *)b;
+    char *key_a = g_utf8_collate_key_for_filename(item_a->path, -1);
+    char *key_b = g_utf8_collate_key_for_filename(item_b->path, -1);
+    gint result = strcmp(key_a, key_b);
+    g_free(key_a);
+    g_free(key_b);
+    return result;
+}
+
+static void review_add_path(GPtrArray *items, const char *path) {
+    ReviewItem *item = g_new0(ReviewItem, 1);
+    item->path = g_strdup(path);
+    g_ptr_array_add(items, item);
+}
+
+// Images of a directory by name, in file-manager order, leaving out
+// annotated copies
+static void review_add_directory(GPtrArray *items, const char *dir_path) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    if (!dir) return;
+    
+    guint first = items->len;
+    const char *name;
+    while ((name = g_dir_read_name(dir))) {
+        if (g_str_has_suffix(name, REVIEW_SUFFIX)) continue;
+        
+        char *type = g_content_type_guess(name, NULL, 0, NULL);
+        char *mime = g_content_type_get_mime_type(type);
+        if (mime && g_str_has_prefix(mime, "image/")) {
+            char *path = g_build_filename(dir_path, name, NULL);
+            review_add_path(items, path);
+            g_free(path);
+        }
+        g_free(mime);
+        g_free(type);
+    }
+    g_dir_close(dir);
+    
+    // Sort just this directory's entries
+    GPtrArray *found = g_ptr_array_new();
+    for (guint i = first; i < items->len; i++) {
+        g_ptr_array_add(found, g_ptr_array_index(items, i));
+    }
+    g_ptr_array_sort(found, review_compare_paths);
+    for (guint i = 0; i < found->len; i++) {
+        items->pdata[first + i] = g_ptr_array_index(found, i);
+    }
+    g_ptr_array_free(found, TRUE);
+}
+
+// Replace the queue with files and directories; returns FALSE when they hold
+// no images
+static gboolean review_start(GFile **files, gint n_files) {
+    GPtrArray *items = g_ptr_array_new_with_free_func(review_item_free);
+    
+    for (gint i = 0; i < n_files; i++) {
+        char *path = g_file_get_path(files[i]);
+        if (!path) continue;
+        
+        if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            review_add_directory(items, path);
+        } else {
+            review_add_path(items, path);
+        }
+        g_free(path);
+    }
+    
+    if (items->len == 0) {
+        g_ptr_array_free(items, TRUE);
+        return FALSE;
+    }
+    
+    if (review.items) {
+        g_ptr_array_free(review.items, TRUE);
+    }
+    review.items = items;
+    g_atomic_int_inc(&review.generation);
+    g_debug("Review queue of %u images", items->len);
+    
+    review_go(0);
+    return TRUE;
+}
+
+// An image from outside the queue replaced the one in view: drop the queue
+// so Save and Next cannot write the new image over a queue item's copy.
+// Decodes still waiting are skipped and their results discarded; saves
+// already handed off still finish.
+static void review_end(void) {
+    if (!review.items) return;
+    
+    g_ptr_array_free(review.items, TRUE);
+    review.items = NULL;
+    review.index = -1;
+    review.waiting = FALSE;
+    g_atomic_int_inc(&review.generation);
+    review_update_bar();
+    memory_update();
+}
+
+// Let background saves finish before the process exits
+static void review_shutdown(void) {
+    if (review.save_pool) {
+        g_thread_pool_free(review.save_pool, FALSE, TRUE);
+        review.save_pool = NULL;
+    }
+}
+
+static GtkWidget *build_review_bar(void) {
+    GtkWidget *bar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_container_set_border_width(GTK_CONTAINER(bar), 5);
+    
+    review_prev_button = gtk_button_new_from_icon_name("go-previous", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(review_prev_button, "Previous Image");
+    g_signal_connect(review_prev_button, "clicked", G_CALLBACK(on_review_prev_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), review_prev_button, FALSE, FALSE, 0);
+    
+    review_label = gtk_label_new(NULL);
+    gtk_box_pack_start(GTK_BOX(bar), review_label, FALSE, FALSE, 0);
+    
+    review_next_button = gtk_button_new_from_icon_name("go-next", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(review_next_button, "Next Image");
+    g_signal_connect(review_next_button, "clicked", G_CALLBACK(on_review_next_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), review_next_button, FALSE, FALSE, 0);
+    
+    review_save_button = gtk_button_new_with_label("Save and Next");
+    gtk_widget_set_tooltip_text(review_save_button, "Save as NAME" REVIEW_SUFFIX " and open the next image");
+    g_signal_connect(review_save_button, "clicked", G_CALLBACK(on_review_save_next_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), review_save_button, FALSE, FALSE, 0);
+    
+    return bar;
+}
+
+// Display rendering
+//
+// on_draw paints the front buffer of render.target, a copy of current_pixbuf
+// in cairo's premultiplied format whose device scale matches the widget's
+// scale factor, so one image pixel lands on one device pixel with no
+// per-frame conversion or rescaling.  Image coordinates are therefore device
+// pixels; widget coordinates are converted with widget_to_image().
+//
+// The conversion runs on a render thread.  The UI thread posts commands (a
+// new image, or an area changed in place) to a lock-free ring and goes back
+// to handling input.  The render thread drains the ring, converts what the
+// back buffer is missing and hands it over as the new front buffer.  It then
+// waits for the UI thread to adopt that frame before touching the other
+// buffer.  Damage is tracked per buffer, so each frame converts only what
+// changed since that buffer was last shown.
+static int display_scale(void) {
+    return drawing_area ? gtk_widget_get_scale_factor(drawing_area) : 1;
+}
+
+static gdouble widget_to_image(gdouble coordinate) {
+    return coordinate * display_scale();
+}
+
+static PixelFormat pixbuf_pixel_format(GdkPixbuf *pixbuf) {
+    return gdk_pixbuf_get_has_alpha(pixbuf) ? PIXEL_FORMAT_RGBA32 : PIXEL_FORMAT_RGB24;
+}
+
+// Opaque images use RGB24 surfaces, which cairo never has to blend against
+static cairo_format_t pixel_format_cairo(PixelFormat format) {
+    return format == PIXEL_FORMAT_RGBA32 ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24;
+}
+
+// Premultiply one row of RGB(A) bytes into native-endian (A)RGB32, rounding
+// like gdk_cairo_set_source_pixbuf.  Always inlined with a constant
+// n_channels, giving one kernel per pixel format without per-pixel checks.
+static inline __attribute__((always_inline))
+void rgba_row_to_argb32(const guint8 *in, guint32 *out, int width, int n_channels) {
+    for (int x = 0; x < width; x++, in += n_channels) {
+        guint32 alpha = n_channels == 4 ? in[3] : 0xff;
+        
+        if (alpha == 0xff) {
+            out[x] = 0xff000000 | (in[0] << 16) | (in[1] << 8) | in[2];
+        } else if (alpha == 0) {
+            out[x] = 0;
+        } else {
+            guint32 r = in[0] * alpha + 0x80;
+            guint32 g = in[1] * alpha + 0x80;
+            guint32 b = in[2] * alpha + 0x80;
+            out[x] = (alpha << 24) |
+                     ((((r >> 8) + r) >> 8) << 16) |
+                     ((((g >> 8) + g) >> 8) << 8) |
+                     (((b >> 8) + b) >> 8);
+        }
+    }
+}
+
+static void rgb24_row_to_cairo(const guint8 *in, guint32 *out, int width) {
+    rgba_row_to_argb32(in, out, width, 3);
+}
+
+static void rgba32_row_to_cairo(const guint8 *in, guint32 *out, int width) {
+    rgba_row_to_argb32(in, out, width, 4);
+}
+
+static PixelRowToCairo pixel_row_to_cairo(PixelFormat format) {
+    return format == PIXEL_FORMAT_RGBA32 ? rgba32_row_to_cairo : rgb24_row_to_cairo;
+}
+
+static gboolean rect_empty(const GdkRectangle *rect) {
+    return rect->width <= 0 || rect->height <= 0;
+}
+
+// Grow a damage rectangle to cover another, clipped to the target
+static void render_damage_add(RenderTarget *target, int buffer, const GdkRectangle *area) {
+    GdkRectangle bounds = {0, 0, target->width, target->height};
+    GdkRectangle clipped;
+    
+    if (!gdk_rectangle_intersect(area, &bounds, &clipped)) return;
+    if (rect_empty(&target->damage[buffer])) {
+        target->damage[buffer] = clipped;
+    } else {
+        gdk_rectangle_union(&target->damage[buffer], &clipped, &target->damage[buffer]);
+    }
+}
+
+static void render_target_free(RenderTarget *target) {
+    if (!target) return;
+    g_clear_pointer(&target->surfaces[0], cairo_surface_destroy);
+    g_clear_pointer(&target->surfaces[1], cairo_surface_destroy);
+    g_free(target);
+}
+
+// NULL when the image is too large for a cairo surface
+static RenderTarget *render_target_new(GdkPixbuf *pixbuf, int scale) {
+    RenderTarget *target = g_new0(RenderTarget, 1);
+    target->width = gdk_pixbuf_get_width(pixbuf);
+    target->height = gdk_pixbuf_get_height(pixbuf);
+    target->scale = scale;
+    target->format = pixel_format_cairo(pixbuf_pixel_format(pixbuf));
+    for (int i = 0; i < 2; i++) {
+        target->surfaces[i] = pool_surface_new(target->format, target->width, target->height);
+        if (!target->surfaces[i]) {
+            render_target_free(target);
+            return NULL;
+        }
+        cairo_surface_set_device_scale(target->surfaces[i], scale, scale);
+        target->damage[i] = (GdkRectangle){0, 0, target->width, target->height};
+    }
+    return target;
+}
+
+static gboolean render_target_fits(const RenderTarget *target, GdkPixbuf *pixbuf, int scale) {
+    return target && target->scale == scale &&
+           target->width == gdk_pixbuf_get_width(pixbuf) &&
+           target->height == gdk_pixbuf_get_height(pixbuf) &&
+           target->format == pixel_format_cairo(pixbuf_pixel_format(pixbuf));
+}
+
+typedef struct {
+    GdkPixbuf *pixbuf;
+    cairo_surface_t *surface;
+    GdkRectangle area;
+} RenderConvertPass;
+
+static void render_convert_rows(int start, int end, gpointer data) {
+    RenderConvertPass *pass = data;
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pass->pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pass->pixbuf);
+    int n_channels = gdk_pixbuf_get_n_channels(pass->pixbuf);
+    guint8 *out = cairo_image_surface_get_data(pass->surface);
+    int stride = cairo_image_surface_get_stride(pass->surface);
+    PixelRowToCairo convert = pixel_row_to_cairo(pixbuf_pixel_format(pass->pixbuf));
+    
+    for (int row = pass->area.y + start; row < pass->area.y + end; row++) {
+        convert(pixels + (gsize)row * rowstride + pass->area.x * n_channels,
+                (guint32 *)(out + (gsize)row * stride) + pass->area.x, pass->area.width);
+    }
+}
+
+typedef struct {
+    RenderTarget *target;
+    int buffer;
+    guint seq;
+    GdkRectangle area;  // What changed since the previous frame
+} RenderFrame;
+
+static void render_wake(void) {
+    if (g_atomic_int_get(&render.sleeping)) {
+        g_mutex_lock(&render.lock);
+        g_cond_signal(&render.cond);
+        g_mutex_unlock(&render.lock);
+    }
+}
+
+// Make a finished frame the front buffer; runs on the UI thread
+static gboolean render_frame_ready(gpointer data) {
+    RenderFrame *frame = data;
+    gboolean new_target = frame->target != render.target;
+    
+    if (new_target) {
+        // The render thread let go of the old pair when it made this one
+        render_target_free(render.target);
+        render.target = frame->target;
+    }
+    render.front = frame->buffer;
+    render.shown_seq = frame->seq;
+    cairo_surface_mark_dirty(render.target->surfaces[render.front]);
+    
+    if (new_target) {
+        gtk_widget_queue_draw(drawing_area);
+    } else {
+        queue_image_area(frame->area.x, frame->area.y, frame->area.width, frame->area.height);
+    }
+    loupe_queue_draw();  // It may show the changed pixels
+    
+    if (render.overlay && render.shown_seq >= render.overlay_seq) {
+        cairo_surface_destroy(render.overlay);
+        render.overlay = NULL;
+    }
+    
+    g_free(frame);
+    g_atomic_int_set(&render.frame_pending, 0);
+    render_wake();
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean render_has_commands(void) {
+    return g_atomic_int_get(&render.head) != g_atomic_int_get(&render.tail);
+}
+
+// Drains commands as they come, and converts and publishes a frame whenever
+// the previous one has been adopted and the back buffer is behind
+static gpointer render_thread(gpointer data) {
+    GdkPixbuf *pixbuf = NULL;
+    RenderTarget *target = NULL;
+    RenderTarget *published = NULL;  // Shared with the UI thread
+    int back = 0;
+    guint seq = 0;
+    gboolean running = TRUE;
+    
+    while (running) {
+        g_mutex_lock(&render.lock);
+        g_atomic_int_set(&render.sleeping, 1);
+        while (!render_has_commands() &&
+               (g_atomic_int_get(&render.frame_pending) || !target || !pixbuf ||
+                rect_empty(&target->damage[back]))) {
+            g_cond_wait(&render.cond, &render.lock);
+        }
+        g_atomic_int_set(&render.sleeping, 0);
+        g_mutex_unlock(&render.lock);
+        
+        gint tail = render.tail;
+        while (running && tail != g_atomic_int_get(&render.head)) {
+            RenderCommand *command = &render.commands[tail & (RENDER_QUEUE_SIZE - 1)];
+            
+            switch (command->type) {
+                case RENDER_IMAGE:
+                    g_clear_object(&pixbuf);
+                    pixbuf = command->pixbuf;
+                    if (!pixbuf) break;
+                    
+                    if (render_target_fits(target, pixbuf, command->scale)) {
+                        GdkRectangle all = {0, 0, target->width, target->height};
+                        render_damage_add(target, 0, &all);
+                        render_damage_add(target, 1, &all);
+                    } else {
+                        // A pair the UI thread never saw can go right away
+                        if (target != published) {
+                            render_target_free(target);
+                        }
+                        target = render_target_new(pixbuf, command->scale);
+                        back = 0;
+                    }
+                    break;
+                case RENDER_AREA:
+                    if (target) {
+                        render_damage_add(target, 0, &command->area);
+                        render_damage_add(target, 1, &command->area);
+                    }
+                    break;
+                case RENDER_STOP:
+                    running = FALSE;
+                    break;
+            }
+            seq = command->seq;
+            g_atomic_int_set(&render.tail, ++tail);
+        }
+        
+        if (!running || g_atomic_int_get(&render.frame_pending) || !target || !pixbuf ||
+            rect_empty(&target->damage[back])) {
+            continue;
+        }
+        
+        // The UI thread may change pixels of this image while they are read
+        // here; such an edit posts its own area, so a frame is at worst
+        // briefly a mix and the next one is exact
+        gint64 start_time = g_get_monotonic_time();
+        RenderConvertPass pass = {pixbuf, target->surfaces[back], target->damage[back]};
+        parallel_for(pass.area.height, 64, render_convert_rows, &pass);
+        if ((gsize)pass.area.width * pass.area.height >= (gsize)target->width * target->height / 2) {
+            g_debug("Rendered %dx%d frame in %.1f ms", pass.area.width, pass.area.height,
+                    (g_get_monotonic_time() - start_time) / 1000.0);
+        }
+        
+        RenderFrame *frame = g_new(RenderFrame, 1);
+        frame->target = target;
+        frame->buffer = back;
+        frame->seq = seq;
+        frame->area = target->damage[back];
+        target->damage[back] = (GdkRectangle){0, 0, 0, 0};
+        published = target;
+        back ^= 1;
+        
+        g_atomic_int_set(&render.frame_pending, 1);
+        g_idle_add_full(G_PRIORITY_HIGH_IDLE, render_frame_ready, frame, NULL);
+    }
+    
+    g_clear_object(&pixbuf);
+    if (target != published) {
+        render_target_free(target);
+    }
+    return NULL;
+}
+
+// Queue a command for the render thread; never waits unless the thread has
+// fallen a whole queue behind.  Returns the command's sequence number.
+static guint render_post(RenderCommand *command) {
+    if (!render.thread) {
+        render.thread = g_thread_new("render", render_thread, NULL);
+    }
+    
+    gint head = render.head;
+    while (head - g_atomic_int_get(&render.tail) == RENDER_QUEUE_SIZE) {
+        g_thread_yield();
+    }
+    command->seq = ++render.posted_seq;
+    render.commands[head & (RENDER_QUEUE_SIZE - 1)] = *command;
+    g_atomic_int_set(&render.head, head + 1);
+    render_wake();
+    return command->seq;
+}
+
+// The buffer on_draw paints, or NULL before the first frame
+static cairo_surface_t *render_front_surface(void) {
+    return render.front >= 0 ? render.target->surfaces[render.front] : NULL;
+}
+
+// Keep a committed stroke on screen until the frame with its pixels is shown
+static void render_hold_overlay(cairo_surface_t *layer, int x, int y, int width, int height, double alpha) {
+    if (render.overlay) {
+        cairo_surface_destroy(render.overlay);
+    }
+    render.overlay = NULL;
+    
+    // Nothing to wait for when no command is outstanding
+    if (render.shown_seq >= render.posted_seq) {
+        cairo_surface_destroy(layer);
+        queue_image_area(x, y, width, height);
+        return;
+    }
+    render.overlay = layer;
+    render.overlay_area = (GdkRectangle){x, y, width, height};
+    render.overlay_alpha = alpha;
+    render.overlay_seq = render.posted_seq;
+}
+
+static void render_shutdown(void) {
+    if (!render.thread) return;
+    
+    RenderCommand command = {.type = RENDER_STOP};
+    render_post(&command);
+    g_thread_join(render.thread);
+    render.thread = NULL;
+}
+
+// Redraw a rectangle given in image pixels
+static void queue_image_area(int x, int y, int width, int height) {
+    int scale = display_scale();
+    int left = floor((double)x / scale);
+    int top = floor((double)y / scale);
+    int right = ceil((double)(x + width) / scale);
+    int bottom = ceil((double)(y + height) / scale);
+    
+    gtk_widget_queue_draw_area(drawing_area, left, top, right - left, bottom - top);
+}
+
+// current_pixbuf was replaced or resized: render all of it again
+static void update_drawing_area() {
+    RenderCommand command = {.type = RENDER_IMAGE, .scale = display_scale()};
+    command.pixbuf = current_pixbuf ? g_object_ref(current_pixbuf) : NULL;
+    render_post(&command);
+    
+    image_generation++;
+    compare_invalidate();
+    if (current_pixbuf) {
+        int scale = display_scale();
+        gtk_widget_set_size_request(drawing_area,
+                                    (gdk_pixbuf_get_width(current_pixbuf) + scale - 1) / scale,
+                                    (gdk_pixbuf_get_height(current_pixbuf) + scale - 1) / scale);
+    }
+    gtk_widget_queue_draw(drawing_area);
+    memory_update();
+}
+
+// Pixels of current_pixbuf changed in place within a rectangle
+static void update_drawing_area_region(int x, int y, int width, int height) {
+    if (!current_pixbuf) return;
+    
+    int x1 = CLAMP(x + width, 0, gdk_pixbuf_get_width(current_pixbuf));
+    int y1 = CLAMP(y + height, 0, gdk_pixbuf_get_height(current_pixbuf));
+    x = CLAMP(x, 0, x1);
+    y = CLAMP(y, 0, y1);
+    image_generation++;
+    compare_invalidate();
+    if (x1 > x && y1 > y) {
+        RenderCommand command = {.type = RENDER_AREA, .area = {x, y, x1 - x, y1 - y}};
+        render_post(&command);
+    }
+}
+
+static void on_scale_factor_changed(GObject *object, GParamSpec *pspec, gpointer data) {
+    update_drawing_area();
+}
+
+// Grow the stroke layer so it covers the given image rectangle
+static void stroke_layer_ensure(int x0, int y0, int x1, int y1) {
+    int image_width = gdk_pixbuf_get_width(current_pixbuf);
+    int image_height = gdk_pixbuf_get_height(current_pixbuf);
+    
+    x0 = CLAMP(x0, 0, image_width);
+    y0 = CLAMP(y0, 0, image_height);
+    x1 = CLAMP(x1, 0, image_width);
+    y1 = CLAMP(y1, 0, image_height);
+    if (x1 <= x0 || y1 <= y0) return;
+    
+    if (stroke_layer.surface &&
+        x0 >= stroke_layer.x && y0 >= stroke_layer.y &&
+        x1 <= stroke_layer.x + stroke_layer.width &&
+        y1 <= stroke_layer.y + stroke_layer.height) {
+        return;
+    }
+    
+    // Allocate some slack so the next few segments fit without regrowing
+    if (stroke_layer.surface) {
+        x0 = MIN(x0, stroke_layer.x);
+        y0 = MIN(y0, stroke_layer.y);
+        x1 = MAX(x1, stroke_layer.x + stroke_layer.width);
+        y1 = MAX(y1, stroke_layer.y + stroke_layer.height);
+    }
+    x0 = MAX(x0 - STROKE_LAYER_SLACK, 0);
+    y0 = MAX(y0 - STROKE_LAYER_SLACK, 0);
+    x1 = MIN(x1 + STROKE_LAYER_SLACK, image_width);
+    y1 = MIN(y1 + STROKE_LAYER_SLACK, image_height);
+    
+    cairo_surface_t *grown = pool_surface_new(CAIRO_FORMAT_ARGB32, x1 - x0, y1 - y0);
+    if (!grown) return;
+    if (stroke_layer.surface) {
+        cairo_t *cr = cairo_create(grown);
+        cairo_set_source_surface(cr, stroke_layer.surface,
+                                 stroke_layer.x - x0, stroke_layer.y - y0);
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        cairo_surface_destroy(stroke_layer.surface);
+    }
+    
+    stroke_layer.surface = grown;
+    stroke_layer.x = x0;
+    stroke_layer.y = y0;
+    stroke_layer.width = x1 - x0;
+    stroke_layer.height = y1 - y0;
+}
+
+static void stroke_layer_add_segment(gdouble x0, gdouble y0, gdouble x1, gdouble y1) {
+    // Round caps reach half the pen width past the end points
+    int reach = stroke_layer.line_width / 2 + 2;
+    int left = floor(MIN(x0, x1)) - reach;
+    int top = floor(MIN(y0, y1)) - reach;
+    int right = ceil(MAX(x0, x1)) + reach;
+    int bottom = ceil(MAX(y0, y1)) + reach;
+    
+    stroke_layer_ensure(left, top, right, bottom);
+    if (!stroke_layer.surface) return;
+    
+    // Draw opaque; the pen alpha is applied once when compositing
+    cairo_t *cr = cairo_create(stroke_layer.surface);
+    cairo_translate(cr, -stroke_layer.x, -stroke_layer.y);
+    cairo_set_source_rgb(cr, current_color.red, current_color.green, current_color.blue);
+    cairo_set_line_width(cr, stroke_layer.line_width);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+    cairo_move_to(cr, x0, y0);
+    cairo_line_to(cr, x1, y1);
+    cairo_stroke(cr);
+    cairo_destroy(cr);
+    
+    queue_image_area(left, top, right - left, bottom - top);
+}
+
+// Composite a layer covering a rectangle of pixbuf onto it with the given alpha
+static void composite_layer(GdkPixbuf *pixbuf, cairo_surface_t *layer,
+                            int x, int y, int width, int height, double alpha) {
+    cairo_surface_t *merged = pixbuf_area_to_surface(pixbuf, x, y, width, height);
+    if (!merged) return;
+    cairo_t *cr = cairo_create(merged);
+    
+    cairo_set_source_surface(cr, layer, 0, 0);
+    cairo_paint_with_alpha(cr, alpha);
+    cairo_destroy(cr);
+    
+    surface_to_pixbuf_area(merged, pixbuf, x, y);
+    
+    cairo_surface_destroy(merged);
+}
+
+// Merge the stroke into current_pixbuf, touching only the layer's bounding box
+static void stroke_layer_commit(void) {
+    if (!stroke_layer.surface || !current_pixbuf) return;
+    
+    composite_layer(current_pixbuf, stroke_layer.surface, stroke_layer.x, stroke_layer.y,
+                    stroke_layer.width, stroke_layer.height, current_color.alpha);
+    update_drawing_area_region(stroke_layer.x, stroke_layer.y, stroke_layer.width, stroke_layer.height);
+    
+    // The layer stays on screen until the render thread has caught up
+    render_hold_overlay(stroke_layer.surface, stroke_layer.x, stroke_layer.y,
+                        stroke_layer.width, stroke_layer.height, current_color.alpha);
+    stroke_layer.surface = NULL;
+}
+
+// Draw a whole stroke into a pixbuf segment by segment, as it would have been
+// drawn interactively, through a layer covering only its bounding box
+static void render_stroke(GdkPixbuf *pixbuf, const JournalPoint *points, int n_points,
+                          const GdkRGBA *color, int line_width) {
+    if (n_points < 2) return;
+    
+    double min_x = points[0].x, min_y = points[0].y;
+    double max_x = points[0].x, max_y = points[0].y;
+    for (int i = 1; i < n_points; i++) {
+        min_x = MIN(min_x, points[i].x);
+        min_y = MIN(min_y, points[i].y);
+        max_x = MAX(max_x, points[i].x);
+        max_y = MAX(max_y, points[i].y);
+    }
+    
+    int reach = line_width / 2 + 2;
+    int x0 = CLAMP((int)floor(min_x) - reach, 0, gdk_pixbuf_get_width(pixbuf));
+    int y0 = CLAMP((int)floor(min_y) - reach, 0, gdk_pixbuf_get_height(pixbuf));
+    int x1 = CLAMP((int)ceil(max_x) + reach, 0, gdk_pixbuf_get_width(pixbuf));
+    int y1 = CLAMP((int)ceil(max_y) + reach, 0, gdk_pixbuf_get_height(pixbuf));
+    if (x1 <= x0 || y1 <= y0) return;
+    
+    cairo_surface_t *layer = pool_surface_new(CAIRO_FORMAT_ARGB32, x1 - x0, y1 - y0);
+    if (!layer) return;
+    cairo_t *cr = cairo_create(layer);
+    cairo_translate(cr, -x0, -y0);
+    cairo_set_source_rgb(cr, color->red, color->green, color->blue);
+    cairo_set_line_width(cr, line_width);
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+    for (int i = 1; i < n_points; i++) {
+        cairo_move_to(cr, points[i - 1].x, points[i - 1].y);
+        cairo_line_to(cr, points[i].x, points[i].y);
+        cairo_stroke(cr);
+    }
+    cairo_destroy(cr);
+    
+    composite_layer(pixbuf, layer, x0, y0, x1 - x0, y1 - y0, color->alpha);
+    cairo_surface_destroy(layer);
+}
+
+// Merge the finished stroke into the image as one undoable edit
+static void finish_stroke(void) {
+    stroke_layer_commit();
+    push_undo_state();
+    journal_stroke();
+    gtk_widget_set_sensitive(undo_button, TRUE);
+    gtk_widget_set_sensitive(redo_button, FALSE);
+}
+
+static void stroke_layer_discard(void) {
+    if (stroke_layer.surface) {
+        cairo_surface_destroy(stroke_layer.surface);
+        stroke_layer.surface = NULL;
+        queue_image_area(stroke_layer.x, stroke_layer.y, stroke_layer.width, stroke_layer.height);
+    }
+}
+
+// Convert one row of premultiplied, native-endian ARGB32 to RGB(A) bytes;
+// inlined per pixel format like rgba_row_to_argb32
+static inline __attribute__((always_inline))
+void argb32_row_to_rgba(const guint32 *in, guint8 *out, int width, int n_channels) {
+    for (int x = 0; x < width; x++, out += n_channels) {
+        guint32 pixel = in[x];
+        guint32 alpha = pixel >> 24;
+        
+        if (alpha == 0xff || n_channels == 3) {
+            out[0] = (pixel >> 16) & 0xff;
+            out[1] = (pixel >> 8) & 0xff;
+            out[2] = pixel & 0xff;
+        } else if (alpha == 0) {
+            out[0] = out[1] = out[2] = 0;
+        } else {
+            out[0] = (((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+            out[1] = (((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha;
+            out[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+        }
+        if (n_channels == 4) {
+            out[3] = alpha;
+        }
+    }
+}
+
+static void rgb24_row_from_cairo(const guint32 *in, guint8 *out, int width) {
+    argb32_row_to_rgba(in, out, width, 3);
+}
+
+static void rgba32_row_from_cairo(const guint32 *in, guint8 *out, int width) {
+    argb32_row_to_rgba(in, out, width, 4);
+}
+
+static PixelRowFromCairo pixel_row_from_cairo(PixelFormat format) {
+    return format == PIXEL_FORMAT_RGBA32 ? rgba32_row_from_cairo : rgb24_row_from_cairo;
+}
+
+// A pool surface in the pixbuf's cairo format holding a region of it, ready
+// to draw on and write back with surface_to_pixbuf_area
+static cairo_surface_t *pixbuf_area_to_surface(GdkPixbuf *pixbuf, int x, int y, int width, int height) {
+    PixelFormat format = pixbuf_pixel_format(pixbuf);
+    PixelRowToCairo convert = pixel_row_to_cairo(format);
+    cairo_surface_t *surface = pool_surface_new(pixel_format_cairo(format), width, height);
+    if (!surface) return NULL;
+    
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+    guint8 *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    
+    width = MIN(width, gdk_pixbuf_get_width(pixbuf) - x);
+    height = MIN(height, gdk_pixbuf_get_height(pixbuf) - y);
+    for (int row = 0; row < height; row++) {
+        convert(pixels + (gsize)(y + row) * rowstride + x * n_channels,
+                (guint32 *)(data + (gsize)row * stride), width);
+    }
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+// Write an ARGB32 or RGB24 surface into a region of an existing pixbuf
+static void surface_to_pixbuf_area(cairo_surface_t *src, GdkPixbuf *dest, int dest_x, int dest_y) {
+    cairo_surface_flush(src);
+    
+    int width = MIN(cairo_image_surface_get_width(src), gdk_pixbuf_get_width(dest) - dest_x);
+    int height = MIN(cairo_image_surface_get_height(src), gdk_pixbuf_get_height(dest) - dest_y);
+    const guint8 *src_data = cairo_image_surface_get_data(src);
+    int src_stride = cairo_image_surface_get_stride(src);
+    guint8 *dest_data = gdk_pixbuf_get_pixels(dest);
+    int dest_stride = gdk_pixbuf_get_rowstride(dest);
+    int n_channels = gdk_pixbuf_get_n_channels(dest);
+    PixelRowFromCairo convert = pixel_row_from_cairo(pixbuf_pixel_format(dest));
+    
+    for (int y = 0; y < height; y++) {
+        convert((const guint32 *)(src_data + (gsize)y * src_stride),
+                dest_data + (gsize)(dest_y + y) * dest_stride + dest_x * n_channels, width);
+    }
+}
+
+// Select the family and size of a Pango font string on a cairo context
+static void set_cairo_font(cairo_t *cr, const char *font) {
+    PangoFontDescription *font_desc = pango_font_description_from_string(font ? font : "Sans 12");
+    double font_size = pango_font_description_get_size(font_desc) / PANGO_SCALE;
+    const char *font_family = pango_font_description_get_family(font_desc);
+    
+    cairo_select_font_face(cr, 
+                         font_family ? font_family : "Sans",
+                         CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, font_size > 0 ? font_size : 12);
+    
+    pango_font_description_free(font_desc);
+}
+
+// Draw text into a pixbuf in place, converting only the text's bounding box,
+// which is returned in area (if not NULL)
+static void draw_text_on_pixbuf(GdkPixbuf *pixbuf, double x, double y, const char *text,
+                                const char *font, const GdkRGBA *color, GdkRectangle *area) {
+    cairo_text_extents_t extents;
+    cairo_surface_t *probe = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *cr = cairo_create(probe);
+    set_cairo_font(cr, font);
+    cairo_text_extents(cr, text, &extents);
+    cairo_destroy(cr);
+    cairo_surface_destroy(probe);
+    
+    // Pad for antialiasing, then clip to the image
+    int x0 = MAX((int)floor(x + extents.x_bearing) - 2, 0);
+    int y0 = MAX((int)floor(y + extents.y_bearing) - 2, 0);
+    int x1 = MIN((int)ceil(x + extents.x_bearing + extents.width) + 2, gdk_pixbuf_get_width(pixbuf));
+    int y1 = MIN((int)ceil(y + extents.y_bearing + extents.height) + 2, gdk_pixbuf_get_height(pixbuf));
+    if (area) {
+        area->x = x0;
+        area->y = y0;
+        area->width = MAX(x1 - x0, 0);
+        area->height = MAX(y1 - y0, 0);
+    }
+    if (x1 <= x0 || y1 <= y0) return;
+    
+    cairo_surface_t *surface = pixbuf_area_to_surface(pixbuf, x0, y0, x1 - x0, y1 - y0);
+    if (!surface) return;
+    cr = cairo_create(surface);
+    
+    cairo_set_source_rgba(cr, color->red, color->green, color->blue, color->alpha);
+    set_cairo_font(cr, font);
+    cairo_move_to(cr, x - x0, y - y0);
+    cairo_show_text(cr, text);
+    cairo_destroy(cr);
+    
+    surface_to_pixbuf_area(surface, pixbuf, x0, y0);
+    
+    cairo_surface_destroy(surface);
+}
+
+static void add_text_at_position(gdouble x, gdouble y) {
+    GtkWidget *dialog;
+    GtkWidget *content_area;
+    GtkWidget *entry;
+    gint response;
+
+    // Store the current state before adding text
+    if (current_pixbuf) {
+        if (undo_stack.current == -1) {
+            undo_stack.current = 0;
+            undo_stack.top = 0;
+            set_undo_snapshot(0, pool_pixbuf_copy(current_pixbuf));
+        }
+    }
+
+    dialog = gtk_dialog_new_with_buttons("Enter Text",
+                                       GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
+                                       GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                       "_OK", GTK_RESPONSE_ACCEPT,
+                                       "_Cancel", GTK_RESPONSE_CANCEL,
+                                       NULL);
+
+    content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    entry = gtk_entry_new();
+    g_signal_connect(entry, "activate", G_CALLBACK(on_entry_activate), dialog);
+    gtk_container_add(GTK_CONTAINER(content_area), entry);
+    gtk_widget_show_all(dialog);
+    gtk_widget_grab_focus(entry);
+
+    response = gtk_dialog_run(GTK_DIALOG(dialog));
+    if (response == GTK_RESPONSE_ACCEPT) {
+        const gchar *text = gtk_entry_get_text(GTK_ENTRY(entry));
+        if (text && *text && current_pixbuf) {
+            // Font sizes are in logical pixels, like the pen width
+            PangoFontDescription *font_desc = pango_font_description_from_string(
+                current_font ? current_font : "Sans 12");
+            gint size = pango_font_description_get_size(font_desc) * display_scale();
+            if (pango_font_description_get_size_is_absolute(font_desc)) {
+                pango_font_description_set_absolute_size(font_desc, size);
+            } else {
+                pango_font_description_set_size(font_desc, size);
+            }
+            char *font = pango_font_description_to_string(font_desc);
+            
+            place_text(x, y, text, font, &text_color);
+            
+            g_free(font);
+            pango_font_description_free(font_desc);
+        }
+    }
+
+    gtk_widget_destroy(dialog);
+}
+
+// Draw text onto the image as one undoable edit
+static void place_text(double x, double y, const char *text, const char *font, const GdkRGBA *color) {
+    GdkRectangle area;
+    
+    draw_text_on_pixbuf(current_pixbuf, x, y, text, font, color, &area);
+    push_undo_state();
+    journal_text(x, y, text, font, color);
+    update_drawing_area_region(area.x, area.y, area.width, area.height);
+}
+
+// Drop an entry's snapshot and any operation data it owns
+static void clear_undo_entry(int index) {
+    if (undo_stack.states[index]) {
+        g_object_unref(undo_stack.states[index]);
+        undo_stack.states[index] = NULL;
+    }
+    if (undo_stack.packed[index]) {
+        packed_snapshot_free(undo_stack.packed[index]);
+        undo_stack.packed[index] = NULL;
+    }
+    if (undo_stack.ops[index].spans) {
+        g_array_free(undo_stack.ops[index].spans, TRUE);
+        undo_stack.ops[index].spans = NULL;
+    }
+}
+
+static gboolean undo_has_snapshot(int index) {
+    return undo_stack.states[index] || undo_stack.packed[index];
+}
+
+// Make a pixbuf (owned) the snapshot of an entry, replacing any it had
+static void set_undo_snapshot(int index, GdkPixbuf *pixbuf) {
+    if (undo_stack.states[index]) {
+        g_object_unref(undo_stack.states[index]);
+    }
+    if (undo_stack.packed[index]) {
+        packed_snapshot_free(undo_stack.packed[index]);
+        undo_stack.packed[index] = NULL;
+    }
+    undo_stack.states[index] = pixbuf;
+}
+
+// A new pool copy of an entry's snapshot, or NULL when it cannot be allocated
+static GdkPixbuf *copy_undo_snapshot(int index) {
+    if (undo_stack.states[index]) {
+        return pool_pixbuf_copy(undo_stack.states[index]);
+    }
+    return unpack_snapshot(undo_stack.packed[index]);
+}
+
+// Apply an operation entry to a pixbuf (owned); returns the result, which
+// replaces it for transforms, or NULL with the pixbuf released when the
+// result cannot be allocated.  A NULL pixbuf, a snapshot that could not be
+// copied, passes straight through.
+static GdkPixbuf *apply_undo_op(GdkPixbuf *pixbuf, const UndoOp *op) {
+    if (!pixbuf) return NULL;
+    
+    switch (op->kind) {
+        case UNDO_TRANSFORM: {
+            GdkPixbuf *transformed = transform_pixbuf(pixbuf, op->transform);
+            g_object_unref(pixbuf);
+            pixbuf = transformed;
+            break;
+        }
+        case UNDO_FILL:
+            fill_apply_spans(pixbuf, op->spans, &op->color);
+            break;
+        case UNDO_ADJUST:
+            adjust_pixbuf(pixbuf, pixbuf, &op->adjust);
+            break;
+        case UNDO_SNAPSHOT:
+            break;
+    }
+    return pixbuf;
+}
+
+// Forget the oldest entry to make room, turning the next one into a snapshot
+// if it only recorded an operation.  Returns FALSE, leaving the stack as it
+// was, when that snapshot cannot be allocated.
+static gboolean undo_drop_oldest(void) {
+    if (undo_stack.top < 1) return FALSE;
+    
+    if (!undo_has_snapshot(1) && undo_has_snapshot(0)) {
+        GdkPixbuf *rebuilt = apply_undo_op(copy_undo_snapshot(0), &undo_stack.ops[1]);
+        if (!rebuilt) return FALSE;
+        undo_stack.states[1] = rebuilt;
+    }
+    clear_undo_entry(0);
+    
+    int n = undo_stack.top;
+    memmove(&undo_stack.states[0], &undo_stack.states[1], n * sizeof(undo_stack.states[0]));
+    memmove(&undo_stack.packed[0], &undo_stack.packed[1], n * sizeof(undo_stack.packed[0]));
+    memmove(&undo_stack.ops[0], &undo_stack.ops[1], n * sizeof(undo_stack.ops[0]));
+    undo_stack.states[n] = NULL;
+    undo_stack.packed[n] = NULL;
+    memset(&undo_stack.ops[n], 0, sizeof(undo_stack.ops[n]));
+    
+    undo_stack.current--;
+    undo_stack.top--;
+    journal_undo_shifted();
+    return TRUE;
+}
+
+// The history is full and its oldest entry could not be dropped: start it
+// over from the image as it is now
+static void undo_restart_history(void) {
+    reset_undo_history();
+    journal_begin_snapshot();
+}
+
+static void push_undo_state(void) {
+    g_print("Push: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+    
+    // Clear redo states
+    for (int i = undo_stack.current + 1; i <= undo_stack.top; i++) {
+        clear_undo_entry(i);
+    }
+    if (undo_stack.current == MAX_UNDO_STACK - 1 && !undo_drop_oldest()) {
+        undo_restart_history();
+        return;
+    }
+
+    // Add new state
+    undo_stack.current++;
+    undo_stack.top = undo_stack.current;
+    undo_stack.ops[undo_stack.current].kind = UNDO_SNAPSHOT;
+    undo_stack.ops[undo_stack.current].lossless.valid = FALSE;
+    if (current_pixbuf) {
+        set_undo_snapshot(undo_stack.current, pool_pixbuf_copy(current_pixbuf));
+        g_print("Stored pixbuf at %d: %dx%d\n", undo_stack.current, 
+                gdk_pixbuf_get_width(undo_stack.states[undo_stack.current]),
+                gdk_pixbuf_get_height(undo_stack.states[undo_stack.current]));
+    }
+
+    g_print("After Push: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+    
+    // Update button sensitivity - enable undo if we have more than one state
+    gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
+    gtk_widget_set_sensitive(redo_button, undo_stack.current < undo_stack.top);
+    memory_update();
+}
+
+// Record an operation that can be replayed instead of a full snapshot
+static void push_undo_op(const UndoOp *op) {
+    g_print("Push op: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+    
+    // Clear redo states
+    for (int i = undo_stack.current + 1; i <= undo_stack.top; i++) {
+        clear_undo_entry(i);
+    }
+    if (undo_stack.current == MAX_UNDO_STACK - 1 && !undo_drop_oldest()) {
+        undo_restart_history();
+        return;
+    }
+    
+    undo_stack.current++;
+    undo_stack.top = undo_stack.current;
+    undo_stack.ops[undo_stack.current] = *op;
+    undo_stack.ops[undo_stack.current].lossless.valid = FALSE;
+    if (op->kind == UNDO_TRANSFORM && undo_stack.current > 0) {
+        lossless_plan_transform(&undo_stack.ops[undo_stack.current].lossless,
+                                &undo_stack.ops[undo_stack.current - 1].lossless, op->transform);
+    }
+    
+    gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
+    gtk_widget_set_sensitive(redo_button, FALSE);
+    memory_update();
+}
+
+static ImageTransform inverse_transform(ImageTransform transform) {
+    switch (transform) {
+        case TRANSFORM_ROTATE_90:
+            return TRANSFORM_ROTATE_270;
+        case TRANSFORM_ROTATE_270:
+            return TRANSFORM_ROTATE_90;
+        default:
+            return transform;  // 180 degrees and flips are their own inverse
+    }
+}
+
+// Apply an entry's operation to current_pixbuf, which shows the entry
+// before it; FALSE, leaving current_pixbuf alone, when out of memory
+static gboolean replay_undo_op(int index) {
+    GdkPixbuf *pixbuf;
+    
+    if (undo_has_snapshot(index)) {
+        pixbuf = copy_undo_snapshot(index);
+    } else if (current_pixbuf) {
+        pixbuf = apply_undo_op(g_object_ref(current_pixbuf), &undo_stack.ops[index]);
+    } else {
+        return TRUE;
+    }
+    if (!pixbuf) return FALSE;
+    
+    if (current_pixbuf) {
+        g_object_unref(current_pixbuf);
+    }
+    current_pixbuf = pixbuf;
+    return TRUE;
+}
+
+// Rebuild the image at an index from the nearest snapshot at or before it.
+// current_pixbuf is only replaced once the whole rebuild has succeeded.
+static gboolean restore_undo_state(int index) {
+    int base = index;
+    while (base > 0 && !undo_has_snapshot(base)) {
+        base--;
+    }
+    
+    GdkPixbuf *pixbuf = copy_undo_snapshot(base);
+    for (int i = base + 1; pixbuf && i <= index; i++) {
+        pixbuf = apply_undo_op(pixbuf, &undo_stack.ops[i]);
+    }
+    if (!pixbuf) return FALSE;
+    
+    if (current_pixbuf) {
+        g_object_unref(current_pixbuf);
+    }
+    current_pixbuf = pixbuf;
+    return TRUE;
+}
+
+static void undo(void) {
+    g_print("Undo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+    
+    if (undo_stack.current > 0) {
+        const UndoOp *op = &undo_stack.ops[undo_stack.current];
+        
+        // Invertible operations are undone in place, everything else is
+        // restored, as is a transform whose result could not be allocated
+        if (!(op->kind == UNDO_TRANSFORM && transform_current_image(inverse_transform(op->transform))) &&
+            !restore_undo_state(undo_stack.current - 1)) {
+            g_printerr("Not enough memory to undo\n");
+            return;
+        }
+        undo_stack.current--;
+        journal_undo_redo(JOURNAL_UNDO);
+        
+        g_print("Undoing to size: %dx%d\n", 
+                gdk_pixbuf_get_width(current_pixbuf),
+                gdk_pixbuf_get_height(current_pixbuf));
+        
+        // Update drawing area size
+        update_drawing_area();
+        
+        g_print("After Undo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+        
+        // Update button sensitivity
+        gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
+        gtk_widget_set_sensitive(redo_button, undo_stack.current < undo_stack.top);
+    }
+}
+
+static void redo(void) {
+    g_print("Redo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+    
+    if (undo_stack.current < undo_stack.top) {
+        if (!replay_undo_op(undo_stack.current + 1)) {
+            g_printerr("Not enough memory to redo\n");
+            return;
+        }
+        undo_stack.current++;
+        journal_undo_redo(JOURNAL_REDO);
+        
+        g_print("Redoing to size: %dx%d\n", 
+                gdk_pixbuf_get_width(current_pixbuf),
+                gdk_pixbuf_get_height(current_pixbuf));
+        
+        // Update drawing area size
+        update_drawing_area();
+        
+        g_print("After Redo: current=%d, top=%d\n", undo_stack.current, undo_stack.top);
+        
+        // Update button sensitivity
+        gtk_widget_set_sensitive(undo_button, undo_stack.current > 0);
+        gtk_widget_set_sensitive(redo_button, undo_stack.current < undo_stack.top);
+    }
+}
+
+static void perform_crop(void) {
+    if (!current_pixbuf) return;
+    
+    // Ensure valid crop coordinates
+    int x = MIN(crop_start_x, crop_end_x);
+    int y = MIN(crop_start_y, crop_end_y);
+    int width = abs(crop_end_x - crop_start_x);
+    int height = abs(crop_end_y - crop_start_y);
+    
+    // Ensure crop region is within image bounds
+    x = CLAMP(x, 0, gdk_pixbuf_get_width(current_pixbuf));
+    y = CLAMP(y, 0, gdk_pixbuf_get_height(current_pixbuf));
+    width = CLAMP(width, 1, gdk_pixbuf_get_width(current_pixbuf) - x);
+    height = CLAMP(height, 1, gdk_pixbuf_get_height(current_pixbuf) - y);
+    
+    // Copy the area out, so the full-size buffer is not kept alive behind it
+    GdkPixbuf *area = gdk_pixbuf_new_subpixbuf(current_pixbuf, x, y, width, height);
+    GdkPixbuf *cropped = area ? pool_pixbuf_copy(area) : NULL;
+    g_clear_object(&area);
+    if (cropped) {
+        // First store the old pixbuf
+        GdkPixbuf *old_pixbuf = current_pixbuf;
+        
+        // Set the new cropped pixbuf
+        current_pixbuf = cropped;
+        
+        // Now push the state (after we've made the change)
+        push_undo_state();
+        if (undo_stack.current > 0) {
+            lossless_plan_crop(&undo_stack.ops[undo_stack.current].lossless,
+                               &undo_stack.ops[undo_stack.current - 1].lossless,
+                               gdk_pixbuf_get_width(old_pixbuf), gdk_pixbuf_get_height(old_pixbuf),
+                               x, y, width, height);
+        }
+        journal_rect(JOURNAL_CROP, x, y, width, height);
+        
+        // Free the old pixbuf
+        g_object_unref(old_pixbuf);
+        
+        // Reset crop coordinates
+        crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
+        is_selecting = FALSE;
+        
+        // Update the display
+        update_drawing_area();
+        
+        // Disable crop button until new selection is made
+        gtk_widget_set_sensitive(crop_button, FALSE);
+    }
+}
+
+// Operation journal
+//
+// Every edit is appended to a small binary journal, so a session can be
+// restored after a crash by replaying it onto its base image: the file that
+// was opened or last saved, or a PNG snapshot kept next to the journal for
+// clipboard images.  The UI thread only encodes a record and queues it; a
+// writer thread appends records as they arrive and fsyncs them in batches.
+// A clean exit removes the journal, so only a crash or kill leaves a session
+// to restore, and copying the image to the clipboard rebases the session on
+// the copied image since it has been handed on.
+//
+// File layout: JOURNAL_MAGIC, then records of {guint32 payload size, guint32
+// FNV-1a checksum of type and payload, guint8 type, payload} in host byte
+// order.  The first record is always JOURNAL_BEGIN.  A torn tail fails its
+// checksum and is ignored.
+#define JOURNAL_MAGIC "IAJ1"
+#define JOURNAL_RECORD_HEADER 9
+#define JOURNAL_SYNC_DELAY_US 50000  // Longest a written record waits for fsync
+#define JOURNAL_WRITE_CHUNK 65536
+
+typedef enum {
+    JOURNAL_CMD_APPEND,
+    JOURNAL_CMD_BEGIN,
+    JOURNAL_CMD_STOP
+} JournalCommand;
+
+typedef struct {
+    JournalCommand command;
+    GByteArray *record;   // APPEND: a sealed record
+    char *base_path;      // BEGIN
+    GdkPixbuf *snapshot;  // BEGIN: written to base_path first when set
+} JournalMessage;
+
+typedef struct {
+    GThread *thread;
+    GAsyncQueue *queue;
+    char *dir;
+    gboolean active;       // A session has begun
+    int base_index;        // Undo position of the base image
+    int top_index;         // Highest undo position recorded since the base
+    guint64 records;
+    gint64 enqueue_time;   // Microseconds spent on the UI thread in total
+} Journal;
+
+static Journal journal = {0};
+
+typedef struct {
+    const guint8 *pos;
+    const guint8 *end;
+    gboolean ok;  // Cleared by reads past the end of the payload
+} JournalReader;
+
+static guint32 journal_checksum(const guint8 *data, gsize length) {
+    guint32 hash = 2166136261u;
+    for (gsize i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static char *journal_file_path(const char *suffix) {
+    return g_strconcat(journal.dir, G_DIR_SEPARATOR_S, "session.journal", suffix, NULL);
+}
+
+static GByteArray *journal_record_new(JournalRecordType type) {
+    guint8 header[JOURNAL_RECORD_HEADER] = {0};
+    GByteArray *record = g_byte_array_sized_new(64);
+    
+    header[8] = type;
+    g_byte_array_append(record, header, sizeof(header));
+    return record;
+}
+
+static void journal_put_i32(GByteArray *record, gint32 value) {
+    g_byte_array_append(record, (const guint8 *)&value, sizeof(value));
+}
+
+static void journal_put_i64(GByteArray *record, gint64 value) {
+    g_byte_array_append(record, (const guint8 *)&value, sizeof(value));
+}
+
+static void journal_put_f32(GByteArray *record, gfloat value) {
+    g_byte_array_append(record, (const guint8 *)&value, sizeof(value));
+}
+
+static void journal_put_f64(GByteArray *record, gdouble value) {
+    g_byte_array_append(record, (const guint8 *)&value, sizeof(value));
+}
+
+static void journal_put_color(GByteArray *record, const GdkRGBA *color) {
+    journal_put_f32(record, color->red);
+    journal_put_f32(record, color->green);
+    journal_put_f32(record, color->blue);
+    journal_put_f32(record, color->alpha);
+}
+
+static void journal_put_string(GByteArray *record, const char *string) {
+    gint32 length = strlen(string);
+    journal_put_i32(record, length);
+    g_byte_array_append(record, (const guint8 *)string, length);
+}
+
+static void journal_get(JournalReader *reader, void *out, gsize size) {
+    if (!reader->ok || (gsize)(reader->end - reader->pos) < size) {
+        reader->ok = FALSE;
+        memset(out, 0, size);
+        return;
+    }
+    memcpy(out, reader->pos, size);
+    reader->pos += size;
+}
+
+static gint32 journal_get_i32(JournalReader *reader) {
+    gint32 value;
+    journal_get(reader, &value, sizeof(value));
+    return value;
+}
+
+static gint64 journal_get_i64(JournalReader *reader) {
+    gint64 value;
+    journal_get(reader, &value, sizeof(value));
+    return value;
+}
+
+static gfloat journal_get_f32(JournalReader *reader) {
+    gfloat value;
+    journal_get(reader, &value, sizeof(value));
+    return value;
+}
+
+static gdouble journal_get_f64(JournalReader *reader) {
+    gdouble value;
+    journal_get(reader, &value, sizeof(value));
+    return value;
+}
+
+static void journal_get_color(JournalReader *reader, GdkRGBA *color) {
+    color->red = journal_get_f32(reader);
+    color->green = journal_get_f32(reader);
+    color->blue = journal_get_f32(reader);
+    color->alpha = journal_get_f32(reader);
+}
+
+static char *journal_get_string(JournalReader *reader) {
+    gint32 length = journal_get_i32(reader);
+    if (length < 0 || (gsize)(reader->end - reader->pos) < (gsize)length) {
+        reader->ok = FALSE;
+        return g_strdup("");
+    }
+    char *string = g_strndup((const char *)reader->pos, length);
+    reader->pos += length;
+    return string;
+}
+
+// Fill in the size and checksum of a finished record
+static void journal_seal(GByteArray *record) {
+    guint32 size = record->len - JOURNAL_RECORD_HEADER;
+    guint32 checksum = journal_checksum(record->data + 8, record->len - 8);
+    
+    memcpy(record->data, &size, sizeof(size));
+    memcpy(record->data + 4, &checksum, sizeof(checksum));
+}
+
+// Step to the next intact record; FALSE at the end or at a torn tail
+static gboolean journal_next_record(const guint8 **pos, const guint8 *end,
+                                    JournalRecordType *type, JournalReader *payload) {
+    guint32 size, checksum;
+    
+    if (end - *pos < JOURNAL_RECORD_HEADER) return FALSE;
+    memcpy(&size, *pos, sizeof(size));
+    memcpy(&checksum, *pos + 4, sizeof(checksum));
+    if ((gsize)(end - *pos - JOURNAL_RECORD_HEADER) < size ||
+        journal_checksum(*pos + 8, (gsize)size + 1) != checksum) {
+        return FALSE;
+    }
+    
+    *type = (*pos)[8];
+    payload->pos = *pos + JOURNAL_RECORD_HEADER;
+    payload->end = payload->pos + size;
+    payload->ok = TRUE;
+    *pos = payload->end;
+    return TRUE;
+}
+
+// Writer thread side
+
+static void journal_write_all(int fd, GByteArray *pending) {
+    gsize done = 0;
+    
+    while (fd >= 0 && done < pending->len) {
+        gssize written = write(fd, pending->data + done, pending->len - done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            g_printerr("Journal write failed: %s\n", g_strerror(errno));
+            break;
+        }
+        done += written;
+    }
+    g_byte_array_set_size(pending, 0);
+}
+
+// Snapshots of earlier sessions are no longer needed once a new one begins;
+// a NULL base_path removes them all
+static void journal_remove_stale_bases(const char *base_path) {
+    GDir *dir = g_dir_open(journal.dir, 0, NULL);
+    const char *name;
+    
+    if (!dir) return;
+    while ((name = g_dir_read_name(dir))) {
+        if (g_str_has_prefix(name, "base-") && g_str_has_suffix(name, ".png")) {
+            char *path = g_build_filename(journal.dir, name, NULL);
+            if (g_strcmp0(path, base_path) != 0) {
+                g_unlink(path);
+            }
+            g_free(path);
+        }
+    }
+    g_dir_close(dir);
+}
+
+// Start a new journal file for a BEGIN message; returns its descriptor or -1
+static int journal_start_file(const JournalMessage *msg) {
+    GStatBuf st;
+    
+    g_mkdir_with_parents(journal.dir, 0700);
+    if (msg->snapshot) {
+        PngRowSource source;
+        GError *error = NULL;
+        
+        init_pixbuf_png_source(&source, msg->snapshot);
+        if (!write_png(msg->base_path, &source, &error)) {
+            g_printerr("Journal snapshot failed: %s\n", error->message);
+            g_error_free(error);
+            return -1;
+        }
+    }
+    if (g_stat(msg->base_path, &st) != 0) {
+        return -1;
+    }
+    
+    GByteArray *head = g_byte_array_new();
+    GByteArray *record = journal_record_new(JOURNAL_BEGIN);
+    journal_put_i64(record, st.st_mtime);
+    journal_put_i64(record, st.st_size);
+    journal_put_string(record, msg->base_path);
+    journal_seal(record);
+    g_byte_array_append(head, (const guint8 *)JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+    g_byte_array_append(head, record->data, record->len);
+    g_byte_array_unref(record);
+    
+    // Build the new journal aside and rename it over the old one, so there is
+    // always one complete session on disk
+    char *path = journal_file_path("");
+    char *tmp_path = journal_file_path(".tmp");
+    int fd = g_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        journal_write_all(fd, head);
+        if (fsync(fd) != 0 || g_rename(tmp_path, path) != 0) {
+            close(fd);
+            g_unlink(tmp_path);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        journal_remove_stale_bases(msg->base_path);
+    }
+    
+    g_byte_array_unref(head);
+    g_free(tmp_path);
+    g_free(path);
+    return fd;
+}
+
+static gpointer journal_writer(gpointer data) {
+    GByteArray *pending = g_byte_array_new();
+    gint64 sync_deadline = 0;  // Nonzero while written records await fsync
+    gboolean running = TRUE;
+    int fd = -1;
+    
+    while (running) {
+        JournalMessage *msg;
+        
+        if (sync_deadline) {
+            gint64 wait = sync_deadline - g_get_monotonic_time();
+            msg = wait > 0 ? g_async_queue_timeout_pop(journal.queue, wait) : NULL;
+        } else {
+            msg = g_async_queue_pop(journal.queue);
+        }
+        
+        if (!msg) {
+            // Batch window over: make everything written so far durable
+            journal_write_all(fd, pending);
+            if (fd >= 0) fsync(fd);
+            sync_deadline = 0;
+            continue;
+        }
+        
+        switch (msg->command) {
+            case JOURNAL_CMD_APPEND:
+                g_byte_array_append(pending, msg->record->data, msg->record->len);
+                g_byte_array_unref(msg->record);
+                if (!sync_deadline) {
+                    sync_deadline = g_get_monotonic_time() + JOURNAL_SYNC_DELAY_US;
+                }
+                break;
+            case JOURNAL_CMD_BEGIN:
+                journal_write_all(fd, pending);
+                if (fd >= 0) close(fd);
+                fd = journal_start_file(msg);
+                sync_deadline = 0;
+                g_free(msg->base_path);
+                if (msg->snapshot) {
+                    memory_charge_save(msg->snapshot, FALSE);
+                    g_clear_object(&msg->snapshot);
+                }
+                break;
+            case JOURNAL_CMD_STOP: {
+                // A clean exit: nothing is left to restore next time
+                char *path = journal_file_path("");
+                if (fd >= 0) close(fd);
+                g_byte_array_set_size(pending, 0);
+                g_unlink(path);
+                journal_remove_stale_bases(NULL);
+                g_free(path);
+                fd = -1;
+                running = FALSE;
+                break;
+            }
+        }
+        g_free(msg);
+        
+        // Hand records to the kernel as soon as the queue drains
+        if (pending->len >= JOURNAL_WRITE_CHUNK || g_async_queue_length(journal.queue) <= 0) {
+            journal_write_all(fd, pending);
+        }
+    }
+    
+    g_byte_array_unref(pending);
+    return NULL;
+}
+
+// UI thread side
+
+static void journal_init(void) {
+    if (!journal.dir) {
+        journal.dir = g_build_filename(g_get_user_cache_dir(), "image-annotator", NULL);
+        journal.queue = g_async_queue_new();
+        journal.thread = g_thread_new("journal", journal_writer, NULL);
+    }
+}
+
+static gboolean journal_owns_path(const char *path) {
+    journal_init();
+    return g_str_has_prefix(path, journal.dir);
+}
+
+// Queue a record for the writer; start_time is when encoding began
+static void journal_submit(GByteArray *record, gint64 start_time) {
+    JournalMessage *msg = g_new0(JournalMessage, 1);
+    
+    journal_seal(record);
+    msg->command = JOURNAL_CMD_APPEND;
+    msg->record = record;
+    g_async_queue_push(journal.queue, msg);
+    
+    journal.records++;
+    journal.enqueue_time += g_get_monotonic_time() - start_time;
+}
+
+// Submit an edit that was just pushed onto the undo stack
+static void journal_submit_op(GByteArray *record, gint64 start_time) {
+    journal.top_index = undo_stack.current;
+    journal_submit(record, start_time);
+}
+
+// Start a new session on a base image; snapshot (owned) is written there first
+static void journal_begin(const char *base_path, GdkPixbuf *snapshot) {
+    JournalMessage *msg = g_new0(JournalMessage, 1);
+    
+    journal_init();
+    msg->command = JOURNAL_CMD_BEGIN;
+    msg->base_path = g_strdup(base_path);
+    msg->snapshot = snapshot;
+    if (snapshot) {
+        memory_charge_save(snapshot, TRUE);
+    }
+    g_async_queue_push(journal.queue, msg);
+    
+    journal.active = TRUE;
+    journal.base_index = undo_stack.current;
+    journal.top_index = undo_stack.current;
+}
+
+static void journal_begin_file(const char *filename) {
+    journal_begin(filename, NULL);
+}
+
+// Start a session on the current image when no file on disk holds it
+static void journal_begin_snapshot(void) {
+    journal_init();
+    char *name = g_strdup_printf("base-%" G_GINT64_FORMAT ".png", g_get_real_time());
+    char *path = g_build_filename(journal.dir, name, NULL);
+    
+    journal_begin(path, pool_pixbuf_copy(current_pixbuf));
+    g_free(path);
+    g_free(name);
+}
+
+// The current image was handed on (copied to the clipboard): make it the
+// base, so its edits are not brought back by the next launch
+static void journal_rebase(void) {
+    if (journal.active) {
+        journal_begin_snapshot();
+    }
+}
+
+static void journal_stroke(void) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_STROKE);
+    journal_put_color(record, &current_color);
+    journal_put_i32(record, stroke_layer.line_width);
+    journal_put_i32(record, stroke_points->len);
+    g_byte_array_append(record, (const guint8 *)stroke_points->data,
+                        stroke_points->len * sizeof(JournalPoint));
+    journal_submit_op(record, start_time);
+}
+
+static void journal_text(double x, double y, const char *text, const char *font, const GdkRGBA *color) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_TEXT);
+    journal_put_f32(record, x);
+    journal_put_f32(record, y);
+    journal_put_color(record, color);
+    journal_put_string(record, font ? font : "");
+    journal_put_string(record, text);
+    journal_submit_op(record, start_time);
+}
+
+static void journal_rect(JournalRecordType type, int x, int y, int width, int height) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(type);
+    if (type == JOURNAL_REDACT) {
+        journal_put_i32(record, redact_style);
+    }
+    journal_put_i32(record, x);
+    journal_put_i32(record, y);
+    journal_put_i32(record, width);
+    journal_put_i32(record, height);
+    journal_submit_op(record, start_time);
+}
+
+static void journal_resize(int width, int height) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_RESIZE);
+    journal_put_i32(record, width);
+    journal_put_i32(record, height);
+    journal_submit_op(record, start_time);
+}
+
+static void journal_transform(ImageTransform transform) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_TRANSFORM);
+    journal_put_i32(record, transform);
+    journal_submit_op(record, start_time);
+}
+
+// The fill is recorded by its seed; replay finds the same region again
+static void journal_fill(int x, int y, const GdkRGBA *color) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_FILL);
+    journal_put_i32(record, x);
+    journal_put_i32(record, y);
+    journal_put_color(record, color);
+    journal_submit_op(record, start_time);
+}
+
+static void journal_rectangles(const GdkRectangle *rects, int n_rects, const GdkRGBA *color, int line_width) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_OUTLINE);
+    journal_put_color(record, color);
+    journal_put_i32(record, line_width);
+    journal_put_i32(record, n_rects);
+    for (int i = 0; i < n_rects; i++) {
+        journal_put_i32(record, rects[i].x);
+        journal_put_i32(record, rects[i].y);
+        journal_put_i32(record, rects[i].width);
+        journal_put_i32(record, rects[i].height);
+    }
+    journal_submit_op(record, start_time);
+}
+
+static void journal_adjust(const Adjustments *adjust) {
+    if (!journal.active) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GByteArray *record = journal_record_new(JOURNAL_ADJUST);
+    journal_put_i32(record, adjust->black);
+    journal_put_i32(record, adjust->white);
+    // Full precision, so the replayed lookup table matches the original
+    journal_put_f64(record, adjust->gamma);
+    journal_put_i32(record, adjust->brightness);
+    journal_put_i32(record, adjust->contrast);
+    journal_put_i32(record, adjust->grayscale);
+    journal_submit_op(record, start_time);
+}
+
+// The undo stack forgot its oldest entry, moving every position down by one
+static void journal_undo_shifted(void) {
+    journal.base_index--;
+    journal.top_index--;
+}
+
+// Called after undo or redo has moved undo_stack.current
+static void journal_undo_redo(JournalRecordType type) {
+    if (!journal.active) return;
+    
+    // Positions this session never recorded can't be rebuilt from its base
+    if (undo_stack.current < journal.base_index || undo_stack.current > journal.top_index) {
+        journal_begin_snapshot();
+    } else {
+        journal_submit(journal_record_new(type), g_get_monotonic_time());
+    }
+}
+
+// Draw a recorded stroke the same way it was drawn interactively
+static void replay_stroke(const JournalPoint *points, int n_points, const GdkRGBA *color, int width) {
+    GdkRGBA saved_color = current_color;
+    
+    current_color = *color;
+    stroke_layer.line_width = width;
+    g_array_set_size(stroke_points, 0);
+    g_array_append_vals(stroke_points, points, n_points);
+    for (int i = 1; i < n_points; i++) {
+        stroke_layer_add_segment(points[i - 1].x, points[i - 1].y, points[i].x, points[i].y);
+    }
+    finish_stroke();
+    
+    current_color = saved_color;
+}
+
+// Apply one record through the same paths as the interactive edit, which
+// also journals it again for the new session
+static void journal_replay_record(JournalRecordType type, JournalReader *reader) {
+    GdkRGBA color;
+    
+    switch (type) {
+        case JOURNAL_STROKE: {
+            journal_get_color(reader, &color);
+            int width = journal_get_i32(reader);
+            gint32 n_points = journal_get_i32(reader);
+            if (!reader->ok || n_points < 2 ||
+                (gsize)(reader->end - reader->pos) < n_points * sizeof(JournalPoint)) {
+                return;
+            }
+            // Records are packed, so copy the points out to align them
+            JournalPoint *points = g_new(JournalPoint, n_points);
+            memcpy(points, reader->pos, n_points * sizeof(JournalPoint));
+            replay_stroke(points, n_points, &color, width);
+            g_free(points);
+            break;
+        }
+        case JOURNAL_TEXT: {
+            double x = journal_get_f32(reader);
+            double y = journal_get_f32(reader);
+            journal_get_color(reader, &color);
+            char *font = journal_get_string(reader);
+            char *text = journal_get_string(reader);
+            if (reader->ok) {
+                place_text(x, y, text, font, &color);
+            }
+            g_free(text);
+            g_free(font);
+            break;
+        }
+        case JOURNAL_CROP:
+        case JOURNAL_REDACT: {
+            RedactStyle style = type == JOURNAL_REDACT ? (RedactStyle)journal_get_i32(reader) : redact_style;
+            int x = journal_get_i32(reader);
+            int y = journal_get_i32(reader);
+            int width = journal_get_i32(reader);
+            int height = journal_get_i32(reader);
+            if (!reader->ok) return;
+            
+            if (type == JOURNAL_CROP) {
+                crop_start_x = x;
+                crop_start_y = y;
+                crop_end_x = x + width;
+                crop_end_y = y + height;
+                perform_crop();
+            } else {
+                RedactStyle saved_style = redact_style;
+                redact_style = style;
+                apply_redaction(x, y, width, height);
+                redact_style = saved_style;
+            }
+            break;
+        }
+        case JOURNAL_RESIZE: {
+            int width = journal_get_i32(reader);
+            int height = journal_get_i32(reader);
+            if (reader->ok && width > 0 && height > 0) {
+                resize_current_image(width, height);
+            }
+            break;
+        }
+        case JOURNAL_TRANSFORM: {
+            gint32 transform = journal_get_i32(reader);
+            if (reader->ok && transform >= TRANSFORM_ROTATE_90 && transform <= TRANSFORM_FLIP_VERTICAL) {
+                on_transform_activate(NULL, GINT_TO_POINTER(transform));
+            }
+            break;
+        }
+        case JOURNAL_FILL: {
+            gint32 x = journal_get_i32(reader);
+            gint32 y = journal_get_i32(reader);
+            GdkRGBA color;
+            journal_get_color(reader, &color);
+            if (reader->ok) {
+                flood_fill_at(x, y, &color);
+            }
+            break;
+        }
+        case JOURNAL_OUTLINE: {
+            journal_get_color(reader, &color);
+            int width = journal_get_i32(reader);
+            gint32 n_rects = journal_get_i32(reader);
+            if (!reader->ok || n_rects < 1) return;
+            
+            GArray *rects = g_array_new(FALSE, FALSE, sizeof(GdkRectangle));
+            for (gint32 i = 0; i < n_rects && reader->ok; i++) {
+                GdkRectangle rect;
+                rect.x = journal_get_i32(reader);
+                rect.y = journal_get_i32(reader);
+                rect.width = journal_get_i32(reader);
+                rect.height = journal_get_i32(reader);
+                g_array_append_val(rects, rect);
+            }
+            if (reader->ok) {
+                annotate_rectangles((const GdkRectangle *)rects->data, rects->len, &color, width);
+            }
+            g_array_free(rects, TRUE);
+            break;
+        }
+        case JOURNAL_ADJUST: {
+            Adjustments adjust;
+            adjust.black = journal_get_i32(reader);
+            adjust.white = journal_get_i32(reader);
+            adjust.gamma = journal_get_f64(reader);
+            adjust.brightness = journal_get_i32(reader);
+            adjust.contrast = journal_get_i32(reader);
+            adjust.grayscale = journal_get_i32(reader);
+            if (reader->ok && adjust.gamma > 0 && adjust.black < adjust.white) {
+                apply_adjustments(&adjust);
+            }
+            break;
+        }
+        case JOURNAL_UNDO:
+            undo();
+            break;
+        case JOURNAL_REDO:
+            redo();
+            break;
+        case JOURNAL_BEGIN:
+            break;
+    }
+}
+
+// Restore the previous session if it has edits that were never saved.
+// Only done before this process has started a session of its own.
+static gboolean journal_restore_session(void) {
+    if (journal.active) return FALSE;
+    
+    journal_init();
+    char *path = journal_file_path("");
+    gchar *contents = NULL;
+    gsize length = 0;
+    gboolean restored = FALSE;
+    
+    if (!g_file_get_contents(path, &contents, &length, NULL)) {
+        g_free(path);
+        return FALSE;
+    }
+    
+    const guint8 *pos = (const guint8 *)contents + strlen(JOURNAL_MAGIC);
+    const guint8 *end = (const guint8 *)contents + length;
+    JournalRecordType type;
+    JournalReader payload;
+    
+    if (length >= strlen(JOURNAL_MAGIC) && memcmp(contents, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) == 0 &&
+        journal_next_record(&pos, end, &type, &payload) && type == JOURNAL_BEGIN) {
+        gint64 mtime = journal_get_i64(&payload);
+        gint64 size = journal_get_i64(&payload);
+        char *base_path = journal_get_string(&payload);
+        const guint8 *ops = pos;
+        int n_ops = 0;
+        GStatBuf st;
+        
+        while (journal_next_record(&pos, end, &type, &payload)) {
+            n_ops++;
+        }
+        
+        if (n_ops > 0) {
+            if (g_stat(base_path, &st) != 0 || st.st_mtime != mtime || st.st_size != size) {
+                g_printerr("Not restoring the previous session: %s has changed\n", base_path);
+            } else {
+                gint64 start_time = g_get_monotonic_time();
+                
+                if (load_image_from_file(base_path)) {
+                    pos = ops;
+                    while (journal_next_record(&pos, end, &type, &payload)) {
+                        journal_replay_record(type, &payload);
+                    }
+                    gtk_widget_queue_draw(drawing_area);
+                    g_debug("Restored %d operations from the previous session in %.1f ms",
+                            n_ops, (g_get_monotonic_time() - start_time) / 1000.0);
+                    restored = TRUE;
+                }
+            }
+        }
+        g_free(base_path);
+    }
+    
+    g_free(contents);
+    g_free(path);
+    return restored;
+}
+
+// Close the journal on a clean exit, removing it with its snapshots
+static void journal_shutdown(void) {
+    if (!journal.thread) return;
+    
+    JournalMessage *msg = g_new0(JournalMessage, 1);
+    msg->command = JOURNAL_CMD_STOP;
+    g_async_queue_push(journal.queue, msg);
+    g_thread_join(journal.thread);
+    journal.thread = NULL;
+    
+    if (journal.records) {
+        g_debug("Journal: %" G_GUINT64_FORMAT " records, %.1f us each on the UI thread",
+                journal.records, (double)journal.enqueue_time / journal.records);
+    }
+}
+
+// Parallel helpers
+//
+// Work is split into chunks that pool threads and the calling thread claim
+// with an atomic counter, so a caller never waits on a chunk nobody started
+// (which keeps nested use from worker threads deadlock-free).
+typedef void (*ParallelFunc)(gint start, gint end, gpointer data);
+
+typedef struct {
+    ParallelFunc func;
+    gpointer data;
+    gint n_items;
+    gint chunk_size;
+    gint n_chunks;
+    gint next_chunk;
+    gint done_chunks;
+    gint ref_count;
+    GMutex mutex;
+    GCond cond;
+} ParallelJob;
+
+static GThreadPool *parallel_pool = NULL;
+
+static void parallel_job_unref(ParallelJob *job) {
+    if (g_atomic_int_dec_and_test(&job->ref_count)) {
+        g_mutex_clear(&job->mutex);
+        g_cond_clear(&job->cond);
+        g_free(job);
+    }
+}
+
+static void parallel_job_run(ParallelJob *job) {
+    gint chunk;
+    while ((chunk = g_atomic_int_add(&job->next_chunk, 1)) < job->n_chunks) {
+        gint start = chunk * job->chunk_size;
+        gint end = MIN(start + job->chunk_size, job->n_items);
+        job->func(start, end, job->data);
+        
+        g_mutex_lock(&job->mutex);
+        if (++job->done_chunks == job->n_chunks) {
+            g_cond_signal(&job->cond);
+        }
+        g_mutex_unlock(&job->mutex);
+    }
+}
+
+static void parallel_worker(gpointer task_data, gpointer user_data) {
+    ParallelJob *job = task_data;
+    parallel_job_run(job);
+    parallel_job_unref(job);
+}
+
+// Run func over [0, n_items) in chunks of at least min_chunk items
+static void parallel_for(gint n_items, gint min_chunk, ParallelFunc func, gpointer data) {
+    gint n_threads = g_get_num_processors();
+    gint n_chunks = MIN(n_threads * 4, (n_items + min_chunk - 1) / MAX(min_chunk, 1));
+    
+    if (n_items <= 0) return;
+    if (n_threads < 2 || n_chunks < 2) {
+        func(0, n_items, data);
+        return;
+    }
+    
+    // Background threads call this too, so the pool is created exactly once
+    if (g_once_init_enter(&parallel_pool)) {
+        g_once_init_leave(&parallel_pool, g_thread_pool_new(parallel_worker, NULL, n_threads - 1, FALSE, NULL));
+    }
+    
+    ParallelJob *job = g_new0(ParallelJob, 1);
+    job->func = func;
+    job->data = data;
+    job->n_items = n_items;
+    job->chunk_size = (n_items + n_chunks - 1) / n_chunks;
+    job->n_chunks = (n_items + job->chunk_size - 1) / job->chunk_size;
+    job->ref_count = 1;
+    g_mutex_init(&job->mutex);
+    g_cond_init(&job->cond);
+    
+    gint helpers = MIN(n_threads - 1, job->n_chunks - 1);
+    for (gint i = 0; i < helpers; i++) {
+        g_atomic_int_inc(&job->ref_count);
+        g_thread_pool_push(parallel_pool, job, NULL);
+    }
+    
+    // The calling thread works too, then waits for chunks claimed by others
+    parallel_job_run(job);
+    g_mutex_lock(&job->mutex);
+    while (job->done_chunks < job->n_chunks) {
+        g_cond_wait(&job->cond, &job->mutex);
+    }
+    g_mutex_unlock(&job->mutex);
+    parallel_job_unref(job);
+}
+
+// Undo snapshot packing
+//
+// Snapshots are deflated at the fastest zlib level in independent bands of
+// PACK_BAND_ROWS rows, so both directions run on every core.
+#define PACK_BAND_ROWS 256
+
+typedef struct {
+    GdkPixbuf *pixbuf;
+    PackedSnapshot *packed;
+    gboolean failed;  // Set by any band; bands are independent
+} SnapshotPackPass;
+
+// Run a zlib converter over one buffer until it reports the end of stream;
+// output goes to out, or is appended to grow when out is NULL
+static gboolean convert_buffer(GConverter *converter, const guint8 *in, gsize in_size,
+                               guint8 *out, gsize out_size, GByteArray *grow) {
+    gsize used = 0;
+    
+    for (;;) {
+        gsize bytes_read = 0;
+        gsize bytes_written = 0;
+        
+        if (grow) {
+            if (grow->len - used < 65536) {
+                g_byte_array_set_size(grow, grow->len + MAX(grow->len, 65536u));
+            }
+            out = grow->data;
+            out_size = grow->len;
+        }
+        GConverterResult result = g_converter_convert(converter, in, in_size, out + used, out_size - used,
+                                                      G_CONVERTER_INPUT_AT_END, &bytes_read,
+                                                      &bytes_written, NULL);
+        in += bytes_read;
+        in_size -= bytes_read;
+        used += bytes_written;
+        
+        // A full fixed buffer holds everything expected
+        if (result == G_CONVERTER_FINISHED || (!grow && used == out_size)) break;
+        if (result == G_CONVERTER_ERROR) return FALSE;
+    }
+    if (grow) {
+        g_byte_array_set_size(grow, used);
+    }
+    return TRUE;
+}
+
+static void band_rows(const SnapshotPackPass *pass, int band, gsize *offset, gsize *length) {
+    int rowstride = gdk_pixbuf_get_rowstride(pass->pixbuf);
+    int y0 = band * PACK_BAND_ROWS;
+    int y1 = MIN(y0 + PACK_BAND_ROWS, pass->packed->height);
+    
+    *offset = (gsize)y0 * rowstride;
+    *length = (gsize)(y1 - y0) * rowstride;
+    if (y1 == pass->packed->height) {
+        // The last row has no padding in a pixbuf
+        *length = gdk_pixbuf_get_byte_length(pass->pixbuf) - *offset;
+    }
+}
+
+static void pack_bands(int start, int end, gpointer data) {
+    SnapshotPackPass *pass = data;
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pass->pixbuf);
+    
+    for (int band = start; band < end; band++) {
+        gsize offset, length;
+        band_rows(pass, band, &offset, &length);
+        
+        GConverter *compressor = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, 1));
+        GByteArray *out = g_byte_array_new();
+        if (!convert_buffer(compressor, pixels + offset, length, NULL, 0, out)) {
+            pass->failed = TRUE;
+        }
+        pass->packed->bands[band] = g_byte_array_free_to_bytes(out);
+        g_object_unref(compressor);
+    }
+}
+
+static void unpack_bands(int start, int end, gpointer data) {
+    SnapshotPackPass *pass = data;
+    guint8 *pixels = gdk_pixbuf_get_pixels(pass->pixbuf);
+    
+    for (int band = start; band < end; band++) {
+        gsize offset, length, packed_size;
+        band_rows(pass, band, &offset, &length);
+        const guint8 *packed = g_bytes_get_data(pass->packed->bands[band], &packed_size);
+        
+        GConverter *decompressor = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+        if (!convert_buffer(decompressor, packed, packed_size, pixels + offset, length, NULL)) {
+            pass->failed = TRUE;
+        }
+        g_object_unref(decompressor);
+    }
+}
+
+// Deflate a pool pixbuf; returns NULL if zlib fails
+static PackedSnapshot *pack_snapshot(GdkPixbuf *pixbuf) {
+    gint64 start_time = g_get_monotonic_time();
+    PackedSnapshot *packed = g_new0(PackedSnapshot, 1);
+    SnapshotPackPass pass = {pixbuf, packed, FALSE};
+    
+    packed->width = gdk_pixbuf_get_width(pixbuf);
+    packed->height = gdk_pixbuf_get_height(pixbuf);
+    packed->has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    packed->n_bands = (packed->height + PACK_BAND_ROWS - 1) / PACK_BAND_ROWS;
+    packed->bands = g_new0(GBytes *, packed->n_bands);
+    
+    parallel_for(packed->n_bands, 1, pack_bands, &pass);
+    if (pass.failed) {
+        packed_snapshot_free(packed);
+        return NULL;
+    }
+    
+    g_debug("Packed %dx%d undo snapshot from %.1f MB to %.1f MB in %.1f ms",
+            packed->width, packed->height, pixbuf_bytes(pixbuf) / (1024.0 * 1024.0),
+            packed_snapshot_bytes(packed) / (1024.0 * 1024.0),
+            (g_get_monotonic_time() - start_time) / 1000.0);
+    return packed;
+}
+
+// Inflate into a new pool pixbuf, laid out like the one packed; NULL when it
+// cannot be allocated
+static GdkPixbuf *unpack_snapshot(const PackedSnapshot *packed) {
+    gint64 start_time = g_get_monotonic_time();
+    GdkPixbuf *pixbuf = pool_pixbuf_new(packed->has_alpha, packed->width, packed->height);
+    if (!pixbuf) return NULL;
+    
+    SnapshotPackPass pass = {pixbuf, (PackedSnapshot *)packed, FALSE};
+    
+    parallel_for(packed->n_bands, 1, unpack_bands, &pass);
+    if (pass.failed) {
+        g_printerr("Undo snapshot is corrupt\n");
+    }
+    g_debug("Unpacked %dx%d undo snapshot in %.1f ms", packed->width, packed->height,
+            (g_get_monotonic_time() - start_time) / 1000.0);
+    return pixbuf;
+}
+
+static void packed_snapshot_free(PackedSnapshot *packed) {
+    if (!packed) return;
+    for (int i = 0; i < packed->n_bands; i++) {
+        if (packed->bands[i]) {
+            g_bytes_unref(packed->bands[i]);
+        }
+    }
+    g_free(packed->bands);
+    g_free(packed);
+}
+
+static gsize packed_snapshot_bytes(const PackedSnapshot *packed) {
+    gsize bytes = 0;
+    for (int i = 0; packed && i < packed->n_bands; i++) {
+        bytes += g_bytes_get_size(packed->bands[i]);
+    }
+    return bytes;
+}
+
+// SIMD vector types (GCC vector extensions, lowered to SSE2/NEON)
+typedef guint32 v4u32 __attribute__((vector_size(16)));
+typedef guint32 v16u32 __attribute__((vector_size(64)));
+typedef guint8 v16u8 __attribute__((vector_size(16)));
+typedef guint16 v16u16 __attribute__((vector_size(32)));
+
+// Per-byte |a - b|, without widening
+static inline v16u8 v16u8_absdiff(v16u8 a, v16u8 b) {
+    v16u8 greater = (v16u8)(a > b);
+    return ((a - b) & greater) | ((b - a) & ~greater);
+}
+
+static inline v4u32 load_pixel(const guint8 *p, gint n_channels) {
+    v4u32 v = {p[0], p[1], p[2], n_channels == 4 ? p[3] : 0};
+    return v;
+}
+
+static inline void store_pixel(guint8 *p, v4u32 v, gint n_channels) {
+    p[0] = v[0];
+    p[1] = v[1];
+    p[2] = v[2];
+    if (n_channels == 4) p[3] = v[3];
+}
+
+// Palette quantization
+//
+// An optimized save writes an indexed PNG when the image can be described by
+// at most 256 colors.  Colors are first collected exactly with a small
+// open-addressed hash table; flat annotated screenshots nearly always fit and
+// are saved losslessly, with a tRNS chunk only when some color is not opaque.
+// Opaque images with more colors are reduced by median cut over a histogram
+// of 5-bit-per-channel cells built in parallel, each cell then mapping to the
+// mean color of its box.  Translucent images that do not fit stay RGBA.
+#define PALETTE_MAX_COLORS 256
+#define PALETTE_HASH_BITS 10  // Four slots per color keeps probes short
+#define PALETTE_CELL_BITS 5
+#define PALETTE_CELLS (1 << (3 * PALETTE_CELL_BITS))
+
+typedef struct {
+    GdkPixbuf *pixbuf;
+    png_color colors[PALETTE_MAX_COLORS];
+    png_byte alpha[PALETTE_MAX_COLORS];
+    int n_colors;
+    int n_trans;                             // Leading entries that are not opaque
+    guint32 keys[1 << PALETTE_HASH_BITS];    // Packed RGBA, exact palettes only
+    gint16 slots[1 << PALETTE_HASH_BITS];    // Palette index, -1 when empty
+    guint8 *cell_index;                      // Cell to palette index, quantized palettes only
+} Palette;
+
+typedef struct {
+    guint64 count;
+    guint64 sum[3];
+} PaletteCell;
+
+typedef struct {
+    GdkPixbuf *pixbuf;
+    PaletteCell *cells;
+    gboolean translucent;
+    GMutex mutex;
+} PaletteHistogram;
+
+// A box of cells for median cut: cells[start, end) of the sorted cell list
+typedef struct {
+    gint start;
+    gint end;
+    guint64 count;
+    gint min[3];
+    gint max[3];
+} PaletteBox;
+
+static inline guint32 palette_key(const guint8 *p, gint n_channels) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (guint32)(n_channels == 4 ? p[3] : 0xff) << 24;
+}
+
+static inline gint palette_cell(const guint8 *p) {
+    gint shift = 8 - PALETTE_CELL_BITS;
+    return (p[0] >> shift) << (2 * PALETTE_CELL_BITS) | (p[1] >> shift) << PALETTE_CELL_BITS | p[2] >> shift;
+}
+
+static inline gint palette_cell_channel(gint cell, gint channel) {
+    return (cell >> ((2 - channel) * PALETTE_CELL_BITS)) & ((1 << PALETTE_CELL_BITS) - 1);
+}
+
+// Hash slot holding key, or the empty slot where it belongs
+static inline guint palette_slot(const Palette *palette, guint32 key) {
+    guint mask = (1 << PALETTE_HASH_BITS) - 1;
+    guint slot = (key * 2654435761u) >> (32 - PALETTE_HASH_BITS);
+    
+    while (palette->slots[slot] >= 0 && palette->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Collect every color, giving up at the first one past PALETTE_MAX_COLORS
+static gboolean palette_collect_exact(Palette *palette) {
+    const guint8 *pixels = gdk_pixbuf_read_pixels(palette->pixbuf);
+    gint rowstride = gdk_pixbuf_get_rowstride(palette->pixbuf);
+    gint width = gdk_pixbuf_get_width(palette->pixbuf);
+    gint height = gdk_pixbuf_get_height(palette->pixbuf);
+    gint n_channels = gdk_pixbuf_get_n_channels(palette->pixbuf);
+    guint32 last_key = ~palette_key(pixels, n_channels);
+    
+    memset(palette->slots, 0xff, sizeof(palette->slots));
+    for (gint y = 0; y < height; y++) {
+        const guint8 *p = pixels + (gsize)y * rowstride;
+        for (gint x = 0; x < width; x++, p += n_channels) {
+            guint32 key = palette_key(p, n_channels);
+            if (key == last_key) continue;  // Flat runs skip the hash
+            last_key = key;
+            
+            guint slot = palette_slot(palette, key);
+            if (palette->slots[slot] >= 0) continue;
+            if (palette->n_colors == PALETTE_MAX_COLORS) return FALSE;
+            
+            palette->keys[slot] = key;
+            palette->slots[slot] = palette->n_colors++;
+        }
+    }
+    
+    // tRNS covers a prefix of the palette, so translucent colors go first
+    gint index = 0;
+    for (gint pass = 0; pass < 2; pass++) {
+        for (guint slot = 0; slot < G_N_ELEMENTS(palette->slots); slot++) {
+            guint32 key = palette->keys[slot];
+            if (palette->slots[slot] < 0 || ((key >> 24) == 0xff) != pass) continue;
+            
+            palette->colors[index].red = key & 0xff;
+            palette->colors[index].green = (key >> 8) & 0xff;
+            palette->colors[index].blue = (key >> 16) & 0xff;
+            palette->alpha[index] = key >> 24;
+            palette->slots[slot] = index++;
+        }
+        if (pass == 0) {
+            palette->n_trans = index;
+        }
+    }
+    return TRUE;
+}
+
+static void palette_histogram_rows(gint start, gint end, gpointer data) {
+    PaletteHistogram *histogram = data;
+    const guint8 *pixels = gdk_pixbuf_read_pixels(histogram->pixbuf);
+    gint rowstride = gdk_pixbuf_get_rowstride(histogram->pixbuf);
+    gint width = gdk_pixbuf_get_width(histogram->pixbuf);
+    gint n_channels = gdk_pixbuf_get_n_channels(histogram->pixbuf);
+    PaletteCell *cells = g_new0(PaletteCell, PALETTE_CELLS);
+    gboolean translucent = FALSE;
+    
+    for (gint y = start; y < end; y++) {
+        const guint8 *p = pixels + (gsize)y * rowstride;
+        for (gint x = 0; x < width; x++, p += n_channels) {
+            PaletteCell *cell = &cells[palette_cell(p)];
+            cell->count++;
+            cell->sum[0] += p[0];
+            cell->sum[1] += p[1];
+            cell->sum[2] += p[2];
+            translucent |= n_channels == 4 && p[3] != 0xff;
+        }
+    }
+    
+    // Merge this band's histogram into the shared one
+    g_mutex_lock(&histogram->mutex);
+    for (gint i = 0; i < PALETTE_CELLS; i++) {
+        if (cells[i].count) {
+            histogram->cells[i].count += cells[i].count;
+            for (gint c = 0; c < 3; c++) {
+                histogram->cells[i].sum[c] += cells[i].sum[c];
+            }
+        }
+    }
+    histogram->translucent |= translucent;
+    g_mutex_unlock(&histogram->mutex);
+    g_free(cells);
+}
+
+static void palette_box_update(PaletteBox *box, const guint16 *order, const PaletteCell *cells) {
+    box->count = 0;
+    for (gint c = 0; c < 3; c++) {
+        box->min[c] = G_MAXINT;
+        box->max[c] = -1;
+    }
+    for (gint i = box->start; i < box->end; i++) {
+        box->count += cells[order[i]].count;
+        for (gint c = 0; c < 3; c++) {
+            gint value = palette_cell_channel(order[i], c);
+            box->min[c] = MIN(box->min[c], value);
+            box->max[c] = MAX(box->max[c], value);
+        }
+    }
+}
+
+// Split a box at the pixel median of its widest channel.  Returns FALSE if
+// the box is a single cell.
+static gboolean palette_box_split(PaletteBox *box, PaletteBox *upper, guint16 *order, const PaletteCell *cells) {
+    gint channel = 0;
+    for (gint c = 1; c < 3; c++) {
+        if (box->max[c] - box->min[c] > box->max[channel] - box->min[channel]) {
+            channel = c;
+        }
+    }
+    if (box->max[channel] == box->min[channel]) return FALSE;
+    
+    // Pixels per value of the channel; the split keeps both halves non-empty
+    guint64 counts[1 << PALETTE_CELL_BITS] = {0};
+    for (gint i = box->start; i < box->end; i++) {
+        counts[palette_cell_channel(order[i], channel)] += cells[order[i]].count;
+    }
+    gint split = box->min[channel];
+    guint64 below = counts[split];
+    while (split + 1 < box->max[channel] && below * 2 < box->count) {
+        below += counts[++split];
+    }
+    
+    // Partition cells at or below the split value to the front
+    gint middle = box->start;
+    for (gint i = box->start; i < box->end; i++) {
+        if (palette_cell_channel(order[i], channel) <= split) {
+            guint16 cell = order[i];
+            order[i] = order[middle];
+            order[middle++] = cell;
+        }
+    }
+    
+    upper->start = middle;
+    upper->end = box->end;
+    box->end = middle;
+    palette_box_update(box, order, cells);
+    palette_box_update(upper, order, cells);
+    return TRUE;
+}
+
+// Median cut over the histogram of an opaque image
+static gboolean palette_quantize(Palette *palette) {
+    PaletteHistogram histogram = {.pixbuf = palette->pixbuf, .cells = g_new0(PaletteCell, PALETTE_CELLS)};
+    
+    g_mutex_init(&histogram.mutex);
+    parallel_for(gdk_pixbuf_get_height(palette->pixbuf), 64, palette_histogram_rows, &histogram);
+    g_mutex_clear(&histogram.mutex);
+    if (histogram.translucent) {
+        g_free(histogram.cells);
+        return FALSE;
+    }
+    
+    guint16 *order = g_new(guint16, PALETTE_CELLS);
+    gint n_cells = 0;
+    for (gint i = 0; i < PALETTE_CELLS; i++) {
+        if (histogram.cells[i].count) {
+            order[n_cells++] = i;
+        }
+    }
+    
+    // Repeatedly split the box holding the most pixels that can still split
+    PaletteBox boxes[PALETTE_MAX_COLORS];
+    gboolean splittable[PALETTE_MAX_COLORS];
+    gint n_boxes = 1;
+    boxes[0].start = 0;
+    boxes[0].end = n_cells;
+    palette_box_update(&boxes[0], order, histogram.cells);
+    splittable[0] = TRUE;
+    
+    while (n_boxes < PALETTE_MAX_COLORS) {
+        gint best = -1;
+        for (gint i = 0; i < n_boxes; i++) {
+            if (splittable[i] && (best < 0 || boxes[i].count > boxes[best].count)) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        
+        if (palette_box_split(&boxes[best], &boxes[n_boxes], order, histogram.cells)) {
+            splittable[n_boxes++] = TRUE;
+        } else {
+            splittable[best] = FALSE;
+        }
+    }
+    
+    // Each box becomes the pixel-weighted mean of its cells
+    palette->cell_index = g_malloc0(PALETTE_CELLS);
+    for (gint i = 0; i < n_boxes; i++) {
+        guint64 sum[3] = {0};
+        for (gint j = boxes[i].start; j < boxes[i].end; j++) {
+            const PaletteCell *cell = &histogram.cells[order[j]];
+            for (gint c = 0; c < 3; c++) {
+                sum[c] += cell->sum[c];
+            }
+            palette->cell_index[order[j]] = i;
+        }
+        palette->colors[i].red = (sum[0] + boxes[i].count / 2) / boxes[i].count;
+        palette->colors[i].green = (sum[1] + boxes[i].count / 2) / boxes[i].count;
+        palette->colors[i].blue = (sum[2] + boxes[i].count / 2) / boxes[i].count;
+        palette->alpha[i] = 0xff;
+    }
+    palette->n_colors = n_boxes;
+    palette->n_trans = 0;
+    
+    g_free(order);
+    g_free(histogram.cells);
+    return TRUE;
+}
+
+static png_bytep palette_png_row(gpointer data, int y, guint8 *scratch) {
+    const Palette *palette = data;
+    const guint8 *p = gdk_pixbuf_read_pixels(palette->pixbuf) + (gsize)y * gdk_pixbuf_get_rowstride(palette->pixbuf);
+    gint width = gdk_pixbuf_get_width(palette->pixbuf);
+    gint n_channels = gdk_pixbuf_get_n_channels(palette->pixbuf);
+    
+    if (palette->cell_index) {
+        for (gint x = 0; x < width; x++, p += n_channels) {
+            scratch[x] = palette->cell_index[palette_cell(p)];
+        }
+        return scratch;
+    }
+    
+    guint32 last_key = ~palette_key(p, n_channels);
+    guint8 index = 0;
+    for (gint x = 0; x < width; x++, p += n_channels) {
+        guint32 key = palette_key(p, n_channels);
+        if (key != last_key) {
+            last_key = key;
+            index = palette->slots[palette_slot(palette, key)];
+        }
+        scratch[x] = index;
+    }
+    return scratch;
+}
+
+// Point source at an indexed version of pixbuf.  Returns FALSE when the image
+// has to stay RGBA; sets *lossy when colors had to be merged.
+static gboolean init_palette_png_source(PngRowSource *source, GdkPixbuf *pixbuf, gboolean *lossy) {
+    Palette *palette = g_new0(Palette, 1);
+    palette->pixbuf = pixbuf;
+    
+    if (palette_collect_exact(palette)) {
+        *lossy = FALSE;
+    } else if (palette_quantize(palette)) {
+        *lossy = TRUE;
+    } else {
+        g_free(palette);
+        return FALSE;
+    }
+    
+    init_pixbuf_png_source(source, pixbuf);
+    source->get_row = palette_png_row;
+    source->converts = TRUE;
+    source->data = palette;
+    source->palette = palette->colors;
+    source->n_palette = palette->n_colors;
+    source->trans = palette->alpha;
+    source->n_trans = palette->n_trans;
+    return TRUE;
+}
+
+static void free_palette_png_source(PngRowSource *source) {
+    Palette *palette = source->data;
+    g_free(palette->cell_index);
+    g_free(palette);
+}
+
+// A rectangular block of 8-bit pixels, as used by the redaction kernels
+typedef struct {
+    guint8 *pixels;
+    gint width;
+    gint height;
+    gint rowstride;
+    gint n_channels;
+} PixelRegion;
+
+typedef struct {
+    const PixelRegion *src;
+    PixelRegion *dst;
+    gint radius;
+    guint16 scale;  // 0.16 fixed-point reciprocal of the window size
+} BoxBlurPass;
+
+// Box sums stay below 65536 for radii up to 127, so the blur runs on 16-bit
+// lanes and dividing by the window is a single multiply-high per lane
+G_STATIC_ASSERT(255 * (2 * REDACT_MAX_RADIUS + 1) < 65536);
+
+#define BOX_SCALE(sum, scale) \
+    __builtin_convertvector((__builtin_convertvector((sum), v16u32) * (scale)) >> 16, v16u16)
+
+// Vertical box blur: items are byte columns, processed in cache-sized strips
+// and accumulated sixteen at a time so every load walks a row contiguously
+#define BLUR_STRIP_BYTES 2048
+
+static void box_blur_column_strip(const BoxBlurPass *pass, gint start, gint span, guint16 *sums) {
+    const PixelRegion *src = pass->src;
+    PixelRegion *dst = pass->dst;
+    gint h = src->height;
+    gint r = pass->radius;
+    gint vec_span = span & ~15;
+    
+    for (gint i = 0; i < span; i++) {
+        guint16 sum = src->pixels[start + i] * (r + 1);
+        for (gint k = 1; k <= r; k++) {
+            sum += src->pixels[(gsize)MIN(k, h - 1) * src->rowstride + start + i];
+        }
+        sums[i] = sum;
+    }
+    
+    for (gint y = 0; y < h; y++) {
+        const guint8 *add = src->pixels + (gsize)MIN(y + r + 1, h - 1) * src->rowstride + start;
+        const guint8 *sub = src->pixels + (gsize)MAX(y - r, 0) * src->rowstride + start;
+        guint8 *out = dst->pixels + (gsize)y * dst->rowstride + start;
+        gint i = 0;
+        
+        for (; i < vec_span; i += 16) {
+            v16u16 sum;
+            v16u8 a, b;
+            memcpy(&sum, sums + i, sizeof(sum));
+            memcpy(&a, add + i, sizeof(a));
+            memcpy(&b, sub + i, sizeof(b));
+            v16u8 value = __builtin_convertvector(BOX_SCALE(sum, pass->scale), v16u8);
+            memcpy(out + i, &value, sizeof(value));
+            sum += __builtin_convertvector(a, v16u16) - __builtin_convertvector(b, v16u16);
+            memcpy(sums + i, &sum, sizeof(sum));
+        }
+        for (; i < span; i++) {
+            out[i] = (sums[i] * (guint32)pass->scale) >> 16;
+            sums[i] += add[i];
+            sums[i] -= sub[i];
+        }
+    }
+}
+
+// Horizontal box blur: items are rows.  Each band of rows is transposed
+// into a small buffer so the vertical kernel can run on it with every lane
+// busy, then transposed back.
+#define BLUR_BAND_ROWS 8
+
+static void transpose_band(const guint8 *src, gint src_stride, guint8 *dst, gint dst_stride,
+                           gint rows, gint cols, gint n_channels) {
+    for (gint y = 0; y < rows; y++) {
+        const guint8 *in = src + (gsize)y * src_stride;
+        guint8 *out = dst + y * n_channels;
+        if (n_channels == 4) {
+            for (gint x = 0; x < cols; x++) {
+                memcpy(out + (gsize)x * dst_stride, in + x * 4, 4);
+            }
+        } else {
+            for (gint x = 0; x < cols; x++) {
+                memcpy(out + (gsize)x * dst_stride, in + x * 3, 3);
+            }
+        }
+    }
+}
+
+static void untranspose_band(const guint8 *src, gint src_stride, guint8 *dst, gint dst_stride,
+                             gint rows, gint cols, gint n_channels) {
+    for (gint y = 0; y < rows; y++) {
+        const guint8 *in = src + y * n_channels;
+        guint8 *out = dst + (gsize)y * dst_stride;
+        if (n_channels == 4) {
+            for (gint x = 0; x < cols; x++) {
+                memcpy(out + x * 4, in + (gsize)x * src_stride, 4);
+            }
+        } else {
+            for (gint x = 0; x < cols; x++) {
+                memcpy(out + x * 3, in + (gsize)x * src_stride, 3);
+            }
+        }
+    }
+}
+
+static void box_blur_rows(gint start, gint end, gpointer data) {
+    BoxBlurPass *pass = data;
+    gint w = pass->src->width;
+    gint nch = pass->src->n_channels;
+    gint band_stride = BLUR_BAND_ROWS * nch;
+    guint8 *band_in = g_malloc((gsize)w * band_stride);
+    guint8 *band_out = g_malloc((gsize)w * band_stride);
+    guint16 *sums = g_new(guint16, band_stride);
+    
+    for (gint y = start; y < end; y += BLUR_BAND_ROWS) {
+        gint rows = MIN(BLUR_BAND_ROWS, end - y);
+        PixelRegion in = {band_in, rows, w, band_stride, nch};
+        PixelRegion out = {band_out, rows, w, band_stride, nch};
+        BoxBlurPass band = {&in, &out, pass->radius, pass->scale};
+        
+        transpose_band(pass->src->pixels + (gsize)y * pass->src->rowstride, pass->src->rowstride,
+                       band_in, band_stride, rows, w, nch);
+        box_blur_column_strip(&band, 0, rows * nch, sums);
+        untranspose_band(band_out, band_stride,
+                         pass->dst->pixels + (gsize)y * pass->dst->rowstride, pass->dst->rowstride,
+                         rows, w, nch);
+    }
+    
+    g_free(sums);
+    g_free(band_out);
+    g_free(band_in);
+}
+
+static void box_blur_columns(gint start, gint end, gpointer data) {
+    guint16 *sums = g_new(guint16, BLUR_STRIP_BYTES);
+    
+    for (gint strip = start; strip < end; strip += BLUR_STRIP_BYTES) {
+        box_blur_column_strip(data, strip, MIN(BLUR_STRIP_BYTES, end - strip), sums);
+    }
+    
+    g_free(sums);
+}
+
+// Returns FALSE, leaving the region untouched, if the scratch copy cannot
+// be allocated
+static gboolean box_blur_region(PixelRegion *region, gint radius, gint passes) {
+    PixelRegion tmp = *region;
+    tmp.rowstride = region->width * region->n_channels;
+    tmp.pixels = pixel_pool_alloc((gsize)tmp.rowstride * region->height, FALSE);
+    if (!tmp.pixels) return FALSE;
+    
+    // Rounded up so a flat area keeps its exact value
+    guint16 scale = (65536 + 2 * radius) / (2 * radius + 1);
+    
+    for (gint i = 0; i < passes; i++) {
+        BoxBlurPass horizontal = {region, &tmp, radius, scale};
+        parallel_for(region->height, 16, box_blur_rows, &horizontal);
+        
+        BoxBlurPass vertical = {&tmp, region, radius, scale};
+        parallel_for(tmp.rowstride, 256, box_blur_columns, &vertical);
+    }
+    
+    pixel_pool_release(tmp.pixels);
+    return TRUE;
+}
+
+typedef struct {
+    PixelRegion *region;
+    gint block;
+} PixelatePass;
+
+// Replace every block with its mean; one row of blocks per item
+static void pixelate_block_rows(gint start, gint end, gpointer data) {
+    PixelatePass *pass = data;
+    PixelRegion *region = pass->region;
+    gint nch = region->n_channels;
+    
+    for (gint by = start; by < end; by++) {
+        gint y0 = by * pass->block;
+        gint y1 = MIN(y0 + pass->block, region->height);
+        
+        for (gint x0 = 0; x0 < region->width; x0 += pass->block) {
+            gint x1 = MIN(x0 + pass->block, region->width);
+            guint32 count = (guint32)((x1 - x0) * (y1 - y0));
+            v4u32 sum = {0, 0, 0, 0};
+            
+            for (gint y = y0; y < y1; y++) {
+                const guint8 *row = region->pixels + (gsize)y * region->rowstride;
+                for (gint x = x0; x < x1; x++) {
+                    sum += load_pixel(row + x * nch, nch);
+                }
+            }
+            
+            v4u32 mean = (sum + count / 2) / count;
+            for (gint y = y0; y < y1; y++) {
+                guint8 *row = region->pixels + (gsize)y * region->rowstride;
+                for (gint x = x0; x < x1; x++) {
+                    store_pixel(row + x * nch, mean, nch);
+                }
+            }
+        }
+    }
+}
+
+static void pixelate_region(PixelRegion *region, gint block) {
+    PixelatePass pass = {region, block};
+    parallel_for((region->height + block - 1) / block, 1, pixelate_block_rows, &pass);
+}
+
+// Obscure a rectangle of a pixbuf in place.  The original pixels are
+// overwritten, so nothing recoverable reaches the saved file.  area is
+// clipped to the image; returns FALSE if too little of it was inside.
+static gboolean redact_pixbuf_area(GdkPixbuf *pixbuf, RedactStyle style, GdkRectangle *area) {
+    int image_width = gdk_pixbuf_get_width(pixbuf);
+    int image_height = gdk_pixbuf_get_height(pixbuf);
+    
+    // Clip the selection to the image
+    int x1 = CLAMP(area->x + area->width, 0, image_width);
+    int y1 = CLAMP(area->y + area->height, 0, image_height);
+    int x = CLAMP(area->x, 0, image_width);
+    int y = CLAMP(area->y, 0, image_height);
+    if (x1 - x < 2 || y1 - y < 2) return FALSE;
+    
+    gint n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+    gint rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    PixelRegion region = {
+        gdk_pixbuf_get_pixels(pixbuf) + (gsize)y * rowstride + x * n_channels,
+        x1 - x, y1 - y, rowstride, n_channels
+    };
+    
+    gint64 start_time = g_get_monotonic_time();
+    int extent = MIN(region.width, region.height);
+    
+    // Keep the blur kernel smaller than the region so edge clamping stays
+    // sane; pixelating needs no scratch memory, so it stands in for a blur
+    // that could not get any rather than leaving the area readable
+    int radius = CLAMP(extent / 6, REDACT_MIN_RADIUS, REDACT_MAX_RADIUS);
+    if (style == REDACT_PIXELATE ||
+        !box_blur_region(&region, MIN(radius, extent), REDACT_BLUR_PASSES)) {
+        pixelate_region(&region, CLAMP(extent / 6, REDACT_MIN_BLOCK, REDACT_MAX_BLOCK));
+    }
+    
+    g_debug("Redacted %dx%d region in %.1f ms", region.width, region.height,
+            (g_get_monotonic_time() - start_time) / 1000.0);
+    
+    area->x = x;
+    area->y = y;
+    area->width = x1 - x;
+    area->height = y1 - y;
+    return TRUE;
+}
+
+static void apply_redaction(int x, int y, int width, int height) {
+    GdkRectangle area = {x, y, width, height};
+    
+    if (!current_pixbuf || !redact_pixbuf_area(current_pixbuf, redact_style, &area)) return;
+    
+    push_undo_state();
+    journal_rect(JOURNAL_REDACT, area.x, area.y, area.width, area.height);
+    update_drawing_area_region(area.x, area.y, area.width, area.height);
+}
+
+// Rotate and flip kernels
+//
+// Every transform is expressed as a walk over the source: destination pixel
+// (x, y) comes from base + x * step_x + y * step_y.  Rotations make step_y a
+// single pixel, so the image is processed in cache-sized tiles of 4x4 blocks,
+// each read as four contiguous vectors and transposed with shuffles.  3-byte
+// pixels do not fit vector lanes; without byte shuffles (SSSE3, above the
+// default build's baseline) emulated ones lose to plain copies of a
+// constant three bytes, so those are what their tiles and rows use.
+#define TRANSFORM_TILE 64
+
+typedef struct {
+    const guint8 *base;
+    gssize step_x;
+    gssize step_y;
+    guint8 *dst;
+    gint dst_stride;
+    gint width;   // Destination size
+    gint height;
+    gint n_channels;
+} TransformPass;
+
+static inline const guint8 *transform_source(const TransformPass *pass, gint x, gint y) {
+    return pass->base + x * pass->step_x + y * pass->step_y;
+}
+
+static inline v4u32 load_pixels4(const guint8 *p, gssize step) {
+    v4u32 v;
+    if (step > 0) {
+        memcpy(&v, p, sizeof(v));
+    } else {
+        memcpy(&v, p - 12, sizeof(v));
+        v = __builtin_shuffle(v, (v4u32){3, 2, 1, 0});
+    }
+    return v;
+}
+
+static inline void transform_pixel(const TransformPass *pass, gint x, gint y) {
+    memcpy(pass->dst + (gsize)y * pass->dst_stride + x * pass->n_channels,
+           transform_source(pass, x, y), pass->n_channels);
+}
+
+// Tile of a rotation on 3-byte pixels, a destination column at a time so
+// the source is read along its rows
+static void transform_tile_rgb(const TransformPass *pass, gint x0, gint y0, gint x1, gint y1) {
+    for (gint x = x0; x < x1; x++) {
+        const guint8 *in = transform_source(pass, x, y0);
+        guint8 *out = pass->dst + (gsize)y0 * pass->dst_stride + x * 3;
+        for (gint y = y0; y < y1; y++, in += pass->step_y, out += pass->dst_stride) {
+            memcpy(out, in, 3);
+        }
+    }
+}
+
+// Tile of a rotation on 4-byte pixels
+static void transform_tile_transpose(const TransformPass *pass, gint x0, gint y0, gint x1, gint y1) {
+    gint y = y0;
+    
+    for (; y + 4 <= y1; y += 4) {
+        gint x = x0;
+        for (; x + 4 <= x1; x += 4) {
+            // c[i][j] is destination pixel (x + i, y + j)
+            v4u32 c0 = load_pixels4(transform_source(pass, x, y), pass->step_y);
+            v4u32 c1 = load_pixels4(transform_source(pass, x + 1, y), pass->step_y);
+            v4u32 c2 = load_pixels4(transform_source(pass, x + 2, y), pass->step_y);
+            v4u32 c3 = load_pixels4(transform_source(pass, x + 3, y), pass->step_y);
+            
+            v4u32 t0 = __builtin_shuffle(c0, c1, (v4u32){0, 4, 1, 5});
+            v4u32 t1 = __builtin_shuffle(c0, c1, (v4u32){2, 6, 3, 7});
+            v4u32 t2 = __builtin_shuffle(c2, c3, (v4u32){0, 4, 1, 5});
+            v4u32 t3 = __builtin_shuffle(c2, c3, (v4u32){2, 6, 3, 7});
+            v4u32 rows[4] = {
+                __builtin_shuffle(t0, t2, (v4u32){0, 1, 4, 5}),
+                __builtin_shuffle(t0, t2, (v4u32){2, 3, 6, 7}),
+                __builtin_shuffle(t1, t3, (v4u32){0, 1, 4, 5}),
+                __builtin_shuffle(t1, t3, (v4u32){2, 3, 6, 7})
+            };
+            
+            for (gint j = 0; j < 4; j++) {
+                memcpy(pass->dst + (gsize)(y + j) * pass->dst_stride + x * 4, &rows[j], sizeof(rows[j]));
+            }
+        }
+        for (; x < x1; x++) {
+            for (gint j = 0; j < 4; j++) {
+                transform_pixel(pass, x, y + j);
+            }
+        }
+    }
+    for (; y < y1; y++) {
+        for (gint x = x0; x < x1; x++) {
+            transform_pixel(pass, x, y);
+        }
+    }
+}
+
+// Row of a flip or 180 degree rotation: rows map to rows
+static void transform_row(const TransformPass *pass, gint y) {
+    guint8 *out = pass->dst + (gsize)y * pass->dst_stride;
+    const guint8 *in = transform_source(pass, 0, y);
+    gint x = 0;
+    
+    if (pass->step_x > 0) {
+        memcpy(out, in, (gsize)pass->width * pass->n_channels);
+        return;
+    }
+    
+    if (pass->n_channels == 4) {
+        for (; x + 4 <= pass->width; x += 4) {
+            v4u32 v = load_pixels4(transform_source(pass, x, y), pass->step_x);
+            memcpy(out + x * 4, &v, sizeof(v));
+        }
+    } else if (pass->n_channels == 3) {
+        for (; x < pass->width; x++, in -= 3) {
+            memcpy(out + x * 3, in, 3);
+        }
+    }
+    for (; x < pass->width; x++) {
+        transform_pixel(pass, x, y);
+    }
+}
+
+static void transform_rows(gint start, gint end, gpointer data) {
+    const TransformPass *pass = data;
+    gboolean transposed = pass->step_x != pass->n_channels && pass->step_x != -pass->n_channels;
+    
+    if (!transposed) {
+        for (gint y = start; y < end; y++) {
+            transform_row(pass, y);
+        }
+        return;
+    }
+    
+    for (gint ty = start; ty < end; ty += TRANSFORM_TILE) {
+        gint ty1 = MIN(ty + TRANSFORM_TILE, end);
+        for (gint tx = 0; tx < pass->width; tx += TRANSFORM_TILE) {
+            gint tx1 = MIN(tx + TRANSFORM_TILE, pass->width);
+            if (pass->n_channels == 4) {
+                transform_tile_transpose(pass, tx, ty, tx1, ty1);
+            } else if (pass->n_channels == 3) {
+                transform_tile_rgb(pass, tx, ty, tx1, ty1);
+            } else {
+                for (gint y = ty; y < ty1; y++) {
+                    for (gint x = tx; x < tx1; x++) {
+                        transform_pixel(pass, x, y);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static GdkPixbuf *transform_pixbuf(GdkPixbuf *src, ImageTransform transform) {
+    gint width = gdk_pixbuf_get_width(src);
+    gint height = gdk_pixbuf_get_height(src);
+    gint n_channels = gdk_pixbuf_get_n_channels(src);
+    gssize stride = gdk_pixbuf_get_rowstride(src);
+    const guint8 *pixels = gdk_pixbuf_read_pixels(src);
+    gboolean swaps = transform == TRANSFORM_ROTATE_90 || transform == TRANSFORM_ROTATE_270;
+    
+    GdkPixbuf *dst = pool_pixbuf_new(gdk_pixbuf_get_has_alpha(src),
+                                     swaps ? height : width, swaps ? width : height);
+    if (!dst) return NULL;
+    
+    TransformPass pass = {
+        .dst = gdk_pixbuf_get_pixels(dst),
+        .dst_stride = gdk_pixbuf_get_rowstride(dst),
+        .width = gdk_pixbuf_get_width(dst),
+        .height = gdk_pixbuf_get_height(dst),
+        .n_channels = n_channels
+    };
+    
+    switch (transform) {
+        case TRANSFORM_ROTATE_90:
+            pass.base = pixels + (height - 1) * stride;
+            pass.step_x = -stride;
+            pass.step_y = n_channels;
+            break;
+        case TRANSFORM_ROTATE_270:
+            pass.base = pixels + (width - 1) * n_channels;
+            pass.step_x = stride;
+            pass.step_y = -n_channels;
+            break;
+        case TRANSFORM_ROTATE_180:
+            pass.base = pixels + (height - 1) * stride + (width - 1) * n_channels;
+            pass.step_x = -n_channels;
+            pass.step_y = -stride;
+            break;
+        case TRANSFORM_FLIP_HORIZONTAL:
+            pass.base = pixels + (width - 1) * n_channels;
+            pass.step_x = -n_channels;
+            pass.step_y = stride;
+            break;
+        case TRANSFORM_FLIP_VERTICAL:
+            pass.base = pixels + (height - 1) * stride;
+            pass.step_x = n_channels;
+            pass.step_y = -stride;
+            break;
+    }
+    
+    parallel_for(pass.height, TRANSFORM_TILE, transform_rows, &pass);
+    return dst;
+}
+
+// Replace current_pixbuf with a rotated or flipped copy; FALSE, leaving it
+// as it was, when the copy cannot be allocated
+static gboolean transform_current_image(ImageTransform transform) {
+    if (!current_pixbuf) return FALSE;
+    
+    gint64 start_time = g_get_monotonic_time();
+    GdkPixbuf *transformed = transform_pixbuf(current_pixbuf, transform);
+    if (!transformed) return FALSE;
+    
+    g_debug("Transformed %dx%d image in %.1f ms",
+            gdk_pixbuf_get_width(current_pixbuf), gdk_pixbuf_get_height(current_pixbuf),
+            (g_get_monotonic_time() - start_time) / 1000.0);
+    
+    g_object_unref(current_pixbuf);
+    current_pixbuf = transformed;
+    
+    update_drawing_area();
+    return TRUE;
+}
+
+// Auto-trim
+//
+// Borders are runs of rows and columns within TRIM_TOLERANCE of the border
+// color, the color of the corner pixel that most other corners agree with,
+// so a cursor or badge in one corner does not stop the trim.  Rows are
+// compared sixteen bytes at a time against the border color repeated over 48
+// bytes (a whole number of 3- and 4-byte pixels), and every scan stops at the
+// first mismatch.
+#define TRIM_TOLERANCE 16
+#define TRIM_PATTERN_BYTES 48
+
+typedef struct {
+    const guint8 *pixels;
+    gint rowstride;
+    gint width;
+    gint n_channels;
+    guint8 pattern[TRIM_PATTERN_BYTES];
+    gint top;
+    gint bottom;
+    gint left;    // First column that is not border
+    gint right;   // Last column that is not border
+    GMutex lock;
+} TrimScan;
+
+// Mask of bytes further than the tolerance from the pattern
+static inline gboolean trim_chunk_differs(const guint8 *p, const guint8 *pattern) {
+    v16u8 a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, pattern, sizeof(b));
+    
+    v16u8 over = (v16u8)(v16u8_absdiff(a, b) > (guint8)TRIM_TOLERANCE);
+    
+    guint64 halves[2];
+    memcpy(halves, &over, sizeof(halves));
+    return (halves[0] | halves[1]) != 0;
+}
+
+static inline gboolean trim_byte_differs(guint8 value, guint8 border) {
+    return ABS((gint)value - (gint)border) > TRIM_TOLERANCE;
+}
+
+// Index of the first pixel in [0, limit) that is not border, or limit
+static gint trim_first_mismatch(const TrimScan *scan, const guint8 *row, gint limit) {
+    gint n_bytes = limit * scan->n_channels;
+    gint i = 0;
+    
+    for (; i + 16 <= n_bytes; i += 16) {
+        if (trim_chunk_differs(row + i, scan->pattern + i % TRIM_PATTERN_BYTES)) {
+            break;
+        }
+    }
+    for (; i < n_bytes; i++) {
+        if (trim_byte_differs(row[i], scan->pattern[i % TRIM_PATTERN_BYTES])) {
+            return i / scan->n_channels;
+        }
+    }
+    return limit;
+}
+
+// Index of the last pixel in (limit, width) that is not border, or limit
+static gint trim_last_mismatch(const TrimScan *scan, const guint8 *row, gint limit) {
+    gint start = (limit + 1) * scan->n_channels;
+    gint i = scan->width * scan->n_channels;
+    
+    // Keep chunks aligned to the pattern so offsets stay pixel-aligned
+    while (i > start && i % 16 != 0) {
+        i--;
+        if (trim_byte_differs(row[i], scan->pattern[i % TRIM_PATTERN_BYTES])) {
+            return i / scan->n_channels;
+        }
+    }
+    for (; i - 16 >= start; i -= 16) {
+        if (trim_chunk_differs(row + i - 16, scan->pattern + (i - 16) % TRIM_PATTERN_BYTES)) {
+            break;
+        }
+    }
+    while (i > start) {
+        i--;
+        if (trim_byte_differs(row[i], scan->pattern[i % TRIM_PATTERN_BYTES])) {
+            return i / scan->n_channels;
+        }
+    }
+    return limit;
+}
+
+static gboolean trim_pixels_match(const guint8 *a, const guint8 *b, gint n_channels) {
+    for (gint c = 0; c < n_channels; c++) {
+        if (trim_byte_differs(a[c], b[c])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// The corner pixel matched by the most other corners, or NULL when no two
+// corners agree
+static const guint8 *trim_border_color(const TrimScan *scan, gint height) {
+    const guint8 *corners[4] = {
+        scan->pixels,
+        scan->pixels + (scan->width - 1) * scan->n_channels,
+        scan->pixels + (gsize)(height - 1) * scan->rowstride,
+        scan->pixels + (gsize)(height - 1) * scan->rowstride + (scan->width - 1) * scan->n_channels
+    };
+    const guint8 *best = NULL;
+    gint best_votes = 0;
+    
+    for (gint i = 0; i < 4; i++) {
+        gint votes = 0;
+        for (gint j = 0; j < 4; j++) {
+            if (j != i && trim_pixels_match(corners[i], corners[j], scan->n_channels)) {
+                votes++;
+            }
+        }
+        if (votes > best_votes) {
+            best = corners[i];
+            best_votes = votes;
+        }
+    }
+    return best;
+}
+
+static gboolean trim_row_is_border(const TrimScan *scan, gint y) {
+    const guint8 *row = scan->pixels + (gsize)y * scan->rowstride;
+    return trim_first_mismatch(scan, row, scan->width) == scan->width;
+}
+
+// Narrow left/right over a band of rows; each row only scans the part of
+// the border that is still undecided
+static void trim_scan_columns(gint start, gint end, gpointer data) {
+    TrimScan *scan = data;
+    
+    g_mutex_lock(&scan->lock);
+    gint left = scan->left;
+    gint right = scan->right;
+    g_mutex_unlock(&scan->lock);
+    
+    for (gint y = scan->top + start; y < scan->top + end; y++) {
+        const guint8 *row = scan->pixels + (gsize)y * scan->rowstride;
+        if (left > 0) {
+            left = trim_first_mismatch(scan, row, left);
+        }
+        if (right < scan->width - 1) {
+            right = trim_last_mismatch(scan, row, right);
+        }
+    }
+    
+    g_mutex_lock(&scan->lock);
+    scan->left = MIN(scan->left, left);
+    scan->right = MAX(scan->right, right);
+    g_mutex_unlock(&scan->lock);
+}
+
+// Find the content rectangle inside uniform borders.  Returns FALSE when
+// there is no border to trim (or the image is a single flat color).
+static gboolean detect_trim_rect(GdkPixbuf *pixbuf, GdkRectangle *rect) {
+    gint width = gdk_pixbuf_get_width(pixbuf);
+    gint height = gdk_pixbuf_get_height(pixbuf);
+    TrimScan scan = {
+        .pixels = gdk_pixbuf_read_pixels(pixbuf),
+        .rowstride = gdk_pixbuf_get_rowstride(pixbuf),
+        .width = width,
+        .n_channels = gdk_pixbuf_get_n_channels(pixbuf)
+    };
+    
+    const guint8 *border = trim_border_color(&scan, height);
+    if (!border) {
+        return FALSE;
+    }
+    for (gint i = 0; i < TRIM_PATTERN_BYTES; i++) {
+        scan.pattern[i] = border[i % scan.n_channels];
+    }
+    
+    while (scan.top < height && trim_row_is_border(&scan, scan.top)) {
+        scan.top++;
+    }
+    if (scan.top == height) {
+        return FALSE;
+    }
+    scan.bottom = height - 1;
+    while (scan.bottom > scan.top && trim_row_is_border(&scan, scan.bottom)) {
+        scan.bottom--;
+    }
+    
+    // Start from an empty span; rows widen it towards the image edges
+    scan.left = width;
+    scan.right = -1;
+    g_mutex_init(&scan.lock);
+    parallel_for(scan.bottom - scan.top + 1, 256, trim_scan_columns, &scan);
+    g_mutex_clear(&scan.lock);
+    
+    rect->x = scan.left;
+    rect->y = scan.top;
+    rect->width = scan.right - scan.left + 1;
+    rect->height = scan.bottom - scan.top + 1;
+    return rect->width < width || rect->height < height;
+}
+
+// Offer the trimmed rectangle as the crop selection
+static gboolean propose_trim_selection(void) {
+    GdkRectangle rect;
+    
+    if (!current_pixbuf || !detect_trim_rect(current_pixbuf, &rect)) {
+        return FALSE;
+    }
+    
+    crop_start_x = rect.x;
+    crop_start_y = rect.y;
+    crop_end_x = rect.x + rect.width;
+    crop_end_y = rect.y + rect.height;
+    is_selecting = FALSE;
+    gtk_widget_set_sensitive(crop_button, TRUE);
+    gtk_widget_queue_draw(drawing_area);
+    return TRUE;
+}
+
+static void on_autotrim_clicked(GtkButton *button, gpointer data) {
+    gint64 start_time = g_get_monotonic_time();
+    
+    if (propose_trim_selection()) {
+        g_debug("Detected borders in %.1f ms", (g_get_monotonic_time() - start_time) / 1000.0);
+        perform_crop();
+    }
+}
+
+// Flood fill
+//
+// Scanline fill from a seed pixel: a span is grown left and right along its
+// row, then the rows above and below are scanned across it for runs that
+// still need filling, which go on an explicit stack.  Pixels within
+// FILL_TOLERANCE of the seed color on every channel match.  Runs are matched
+// 48 bytes (a whole number of 3- and 4-byte pixels) at a time against the
+// seed color, as in auto-trim.  A bitmap of claimed pixels stops a fill color
+// close to the seed color from being visited twice.  The spans are painted
+// afterwards and kept as the undo entry.
+#define FILL_TOLERANCE 32
+#define FILL_PATTERN_PERIOD 48
+
+typedef struct {
+    const guint8 *pixels;
+    gint rowstride;
+    gint width;
+    gint height;
+    gint n_channels;
+    guint8 pattern[FILL_PATTERN_PERIOD + 16];  // Seed color repeated
+    guint64 *claimed;                          // One bit per pixel
+    gint words_per_row;
+} FillScan;
+
+// Mask of bytes further than the tolerance from the pattern
+static inline v16u8 fill_chunk_mismatch(const guint8 *p, v16u8 pattern) {
+    v16u8 a;
+    memcpy(&a, p, sizeof(a));
+    
+    return (v16u8)(v16u8_absdiff(a, pattern) > (guint8)FILL_TOLERANCE);
+}
+
+// Mismatch mask of the 48 bytes at p; pattern holds the seed color at p's phase
+static inline gboolean fill_block_differs(const guint8 *p, const v16u8 *pattern) {
+    v16u8 mask = fill_chunk_mismatch(p, pattern[0]) |
+                 fill_chunk_mismatch(p + 16, pattern[1]) |
+                 fill_chunk_mismatch(p + 32, pattern[2]);
+    
+    guint64 halves[2];
+    memcpy(halves, &mask, sizeof(halves));
+    return (halves[0] | halves[1]) != 0;
+}
+
+static inline void fill_load_pattern(const FillScan *scan, gint offset, v16u8 *pattern) {
+    for (gint k = 0; k < 3; k++) {
+        memcpy(&pattern[k], scan->pattern + (offset + 16 * k) % FILL_PATTERN_PERIOD, sizeof(v16u8));
+    }
+}
+
+static inline gboolean fill_pixel_matches(const FillScan *scan, const guint8 *p) {
+    for (gint c = 0; c < scan->n_channels; c++) {
+        if (ABS((gint)p[c] - (gint)scan->pattern[c]) > FILL_TOLERANCE) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// First pixel in [x, limit) that does not match, or limit
+static gint fill_match_end(const FillScan *scan, const guint8 *row, gint x, gint limit) {
+    gint n_channels = scan->n_channels;
+    gint i = x * n_channels;
+    gint end = limit * n_channels;
+    v16u8 pattern[3];
+    
+    fill_load_pattern(scan, i, pattern);
+    for (; i + 48 <= end; i += 48) {
+        if (fill_block_differs(row + i, pattern)) {
+            break;
+        }
+    }
+    for (x = i / n_channels; x < limit; x++) {
+        if (!fill_pixel_matches(scan, row + x * n_channels)) {
+            return x;
+        }
+    }
+    return limit;
+}
+
+// Start of the matching run that ends at x (which matches), no lower than limit
+static gint fill_match_start(const FillScan *scan, const guint8 *row, gint x, gint limit) {
+    gint n_channels = scan->n_channels;
+    gint i = (x + 1) * n_channels;
+    gint start = limit * n_channels;
+    v16u8 pattern[3];
+    
+    // Bytes from i up to the end of pixel x are known to match
+    fill_load_pattern(scan, i - 48 + FILL_PATTERN_PERIOD * 2, pattern);
+    for (; i - 48 >= start; i -= 48) {
+        if (fill_block_differs(row + i - 48, pattern)) {
+            break;
+        }
+    }
+    for (x = (i + n_channels - 1) / n_channels - 1; x >= limit; x--) {
+        if (!fill_pixel_matches(scan, row + x * n_channels)) {
+            return x + 1;
+        }
+    }
+    return limit;
+}
+
+static inline gboolean fill_is_claimed(const FillScan *scan, gint x, gint y) {
+    return (scan->claimed[(gsize)y * scan->words_per_row + x / 64] >> (x % 64)) & 1;
+}
+
+// First pixel of row y in [x, limit) whose claimed bit equals claimed, or limit
+static gint fill_next_with(const FillScan *scan, gint y, gint x, gint limit, gboolean claimed) {
+    const guint64 *words = scan->claimed + (gsize)y * scan->words_per_row;
+    guint64 flip = claimed ? 0 : ~(guint64)0;
+    
+    while (x < limit) {
+        guint64 word = (words[x / 64] ^ flip) >> (x % 64);
+        if (word) {
+            return MIN(x + __builtin_ctzll(word), limit);
+        }
+        x = (x / 64 + 1) * 64;
+    }
+    return limit;
+}
+
+// Last claimed pixel of row y in [limit, x], or limit - 1
+static gint fill_prev_claimed(const FillScan *scan, gint y, gint x, gint limit) {
+    const guint64 *words = scan->claimed + (gsize)y * scan->words_per_row;
+    
+    while (x >= limit) {
+        guint64 word = words[x / 64] << (63 - x % 64);
+        if (word) {
+            return MAX(x - __builtin_clzll(word), limit - 1);
+        }
+        x = (x / 64) * 64 - 1;
+    }
+    return limit - 1;
+}
+
+static void fill_claim(FillScan *scan, gint y, gint x0, gint x1) {
+    guint64 *words = scan->claimed + (gsize)y * scan->words_per_row;
+    
+    for (gint x = x0; x <= x1; ) {
+        gint bit = x % 64;
+        gint count = MIN(64 - bit, x1 - x + 1);
+        guint64 mask = count == 64 ? ~(guint64)0 : (((guint64)1 << count) - 1) << bit;
+        words[x / 64] |= mask;
+        x += count;
+    }
+}
+
+// Push each unclaimed matching run of row y within [x0, x1]
+static void fill_push_runs(const FillScan *scan, GArray *stack, gint y, gint x0, gint x1) {
+    const guint8 *row = scan->pixels + (gsize)y * scan->rowstride;
+    gint x = x0;
+    
+    while (x <= x1) {
+        x = fill_next_with(scan, y, x, x1 + 1, FALSE);
+        if (x > x1) break;
+        
+        if (!fill_pixel_matches(scan, row + x * scan->n_channels)) {
+            x++;
+            continue;
+        }
+        
+        // A run of matching, unclaimed pixels waiting to be grown into a span
+        FillSpan run = {y, x, 0};
+        run.x1 = fill_match_end(scan, row, x, fill_next_with(scan, y, x, x1 + 1, TRUE)) - 1;
+        g_array_append_val(stack, run);
+        x = run.x1 + 2;
+    }
+}
+
+// Collect the spans of the region connected to the seed, and their bounds
+static GArray *flood_fill_spans(GdkPixbuf *pixbuf, gint seed_x, gint seed_y, GdkRectangle *bounds) {
+    FillScan scan = {
+        .pixels = gdk_pixbuf_read_pixels(pixbuf),
+        .rowstride = gdk_pixbuf_get_rowstride(pixbuf),
+        .width = gdk_pixbuf_get_width(pixbuf),
+        .height = gdk_pixbuf_get_height(pixbuf),
+        .n_channels = gdk_pixbuf_get_n_channels(pixbuf)
+    };
+    const guint8 *seed = scan.pixels + (gsize)seed_y * scan.rowstride + seed_x * scan.n_channels;
+    
+    for (gint i = 0; i < (gint)sizeof(scan.pattern); i++) {
+        scan.pattern[i] = seed[i % scan.n_channels];
+    }
+    scan.words_per_row = (scan.width + 63) / 64;
+    scan.claimed = g_malloc0((gsize)scan.words_per_row * scan.height * sizeof(guint64));
+    
+    GArray *spans = g_array_new(FALSE, FALSE, sizeof(FillSpan));
+    GArray *stack = g_array_new(FALSE, FALSE, sizeof(FillSpan));  // Runs still to grow
+    FillSpan first = {seed_y, seed_x, seed_x};
+    gint left = seed_x, top = seed_y, right = seed_x, bottom = seed_y;
+    
+    g_array_append_val(stack, first);
+    while (stack->len > 0) {
+        FillSpan run = g_array_index(stack, FillSpan, stack->len - 1);
+        g_array_set_size(stack, stack->len - 1);
+        
+        // Another span reaching into a run always covers its first pixel
+        if (fill_is_claimed(&scan, run.x0, run.y)) continue;
+        
+        // Grow the run along the row up to a mismatch or a claimed pixel
+        const guint8 *row = scan.pixels + (gsize)run.y * scan.rowstride;
+        gint x0 = fill_match_start(&scan, row, run.x0, fill_prev_claimed(&scan, run.y, run.x0, 0) + 1);
+        gint x1 = fill_match_end(&scan, row, run.x1 + 1,
+                                 fill_next_with(&scan, run.y, run.x1 + 1, scan.width, TRUE)) - 1;
+        FillSpan span = {run.y, x0, x1};
+        
+        g_array_append_val(spans, span);
+        fill_claim(&scan, run.y, x0, x1);
+        left = MIN(left, x0);
+        right = MAX(right, x1);
+        top = MIN(top, run.y);
+        bottom = MAX(bottom, run.y);
+        
+        if (run.y > 0) {
+            fill_push_runs(&scan, stack, run.y - 1, x0, x1);
+        }
+        if (run.y + 1 < scan.height) {
+            fill_push_runs(&scan, stack, run.y + 1, x0, x1);
+        }
+    }
+    
+    bounds->x = left;
+    bounds->y = top;
+    bounds->width = right - left + 1;
+    bounds->height = bottom - top + 1;
+    
+    g_array_free(stack, TRUE);
+    g_free(scan.claimed);
+    return spans;
+}
+
+typedef struct {
+    guint8 *pixels;
+    gint rowstride;
+    gint n_channels;
+    const FillSpan *spans;
+    guint8 color[4];                      // Straight RGBA
+    guint8 pattern[FILL_PATTERN_PERIOD];  // Opaque color repeated
+} FillPaint;
+
+static void fill_paint_spans(gint start, gint end, gpointer data) {
+    const FillPaint *paint = data;
+    gint n_channels = paint->n_channels;
+    guint alpha = paint->color[3];
+    
+    for (gint i = start; i < end; i++) {
+        const FillSpan *span = &paint->spans[i];
+        guint8 *p = paint->pixels + (gsize)span->y * paint->rowstride + span->x0 * n_channels;
+        
+        if (alpha == 0xff) {
+            gsize length = (gsize)(span->x1 - span->x0 + 1) * n_channels;
+            for (; length >= FILL_PATTERN_PERIOD; length -= FILL_PATTERN_PERIOD, p += FILL_PATTERN_PERIOD) {
+                memcpy(p, paint->pattern, FILL_PATTERN_PERIOD);
+            }
+            memcpy(p, paint->pattern, length);
+            continue;
+        }
+        
+        // Composite the translucent fill color over each pixel
+        for (gint x = span->x0; x <= span->x1; x++, p += n_channels) {
+            guint dest_alpha = n_channels == 4 ? p[3] : 0xff;
+            guint src_weight = alpha * 0xff;
+            guint dest_weight = dest_alpha * (0xff - alpha);
+            guint total = src_weight + dest_weight;
+            
+            if (total == 0) continue;
+            for (gint c = 0; c < 3; c++) {
+                p[c] = (paint->color[c] * src_weight + p[c] * dest_weight + total / 2) / total;
+            }
+            if (n_channels == 4) {
+                p[3] = (total + 0x7f) / 0xff;
+            }
+        }
+    }
+}
+
+// Paint recorded spans with a color; used for the fill itself and on redo
+static void fill_apply_spans(GdkPixbuf *pixbuf, GArray *spans, const GdkRGBA *color) {
+    FillPaint paint = {
+        .pixels = gdk_pixbuf_get_pixels(pixbuf),
+        .rowstride = gdk_pixbuf_get_rowstride(pixbuf),
+        .n_channels = gdk_pixbuf_get_n_channels(pixbuf),
+        .spans = (const FillSpan *)spans->data,
+        .color = {
+            (guint8)(color->red * 255 + 0.5),
+            (guint8)(color->green * 255 + 0.5),
+            (guint8)(color->blue * 255 + 0.5),
+            (guint8)(color->alpha * 255 + 0.5)
+        }
+    };
+    
+    for (gint i = 0; i < FILL_PATTERN_PERIOD; i++) {
+        paint.pattern[i] = paint.color[i % paint.n_channels];
+    }
+    parallel_for(spans->len, 256, fill_paint_spans, &paint);
+}
+
+// Fill the region around an image pixel as one undoable edit
+static void flood_fill_at(int x, int y, const GdkRGBA *color) {
+    if (!current_pixbuf ||
+        x < 0 || y < 0 ||
+        x >= gdk_pixbuf_get_width(current_pixbuf) ||
+        y >= gdk_pixbuf_get_height(current_pixbuf)) {
+        return;
+    }
+    
+    gint64 start_time = g_get_monotonic_time();
+    GdkRectangle bounds;
+    GArray *spans = flood_fill_spans(current_pixbuf, x, y, &bounds);
+    fill_apply_spans(current_pixbuf, spans, color);
+    
+    g_debug("Filled %u spans (%dx%d bounds) in %.1f ms", spans->len,
+            bounds.width, bounds.height, (g_get_monotonic_time() - start_time) / 1000.0);
+    
+    UndoOp op = {.kind = UNDO_FILL, .spans = spans, .color = *color};
+    push_undo_op(&op);
+    journal_fill(x, y, color);
+    
+    update_drawing_area_region(bounds.x, bounds.y, bounds.width, bounds.height);
+}
+
+// Compare mode
+//
+// A second image is shown against current_pixbuf as a swipe (the other image
+// right of a draggable split), a blend, or a difference heatmap.  Both images
+// are kept as cairo surfaces, so swiping and blending are blits.  The
+// heatmap is rebuilt only when current_pixbuf changes: the images are
+// compared sixteen bytes at a time with a vector absolute difference, in
+// parallel bands of COMPARE_CELL rows.  Each band also records, per cell,
+// the bounds of the pixels that differ by more than COMPARE_THRESHOLD.
+// Touching cells are then merged into the listed changed regions.
+#define COMPARE_CELL 16
+#define COMPARE_THRESHOLD 8    // Ignores compression noise
+#define COMPARE_MAX_LISTED 100 // Regions offered in the list
+#define COMPARE_HANDLE_REACH 6 // Logical pixels either side of the swipe handle
+
+typedef struct {
+    gint x0;  // Bounds of changed pixels, x0 > x1 when the cell is unchanged
+    gint y0;
+    gint x1;
+    gint y1;
+} CompareCell;
+
+typedef struct {
+    GdkPixbuf *current;
+    GdkPixbuf *other;  // Same channel count as current
+    guint8 *heatmap;
+    gint heatmap_stride;
+    CompareCell *cells;
+    gint cells_per_row;
+} ComparePass;
+
+static inline void compare_mark(CompareCell *cell, gint x, gint y) {
+    cell->x0 = MIN(cell->x0, x);
+    cell->y0 = MIN(cell->y0, y);
+    cell->x1 = MAX(cell->x1, x);
+    cell->y1 = MAX(cell->y1, y);
+}
+
+static void compare_band_rows(gint start, gint end, gpointer data) {
+    const ComparePass *pass = data;
+    gint width = gdk_pixbuf_get_width(pass->current);
+    gint height = gdk_pixbuf_get_height(pass->current);
+    gint n_channels = gdk_pixbuf_get_n_channels(pass->current);
+    gint other_width = gdk_pixbuf_get_width(pass->other);
+    gint other_height = gdk_pixbuf_get_height(pass->other);
+    gint overlap = MIN(width, other_width);
+    gsize row_bytes = (gsize)overlap * n_channels;
+    guint8 *diff = g_malloc(row_bytes + 16);
+    
+    for (gint y = start * COMPARE_CELL; y < MIN(end * COMPARE_CELL, height); y++) {
+        const guint8 *a = gdk_pixbuf_read_pixels(pass->current) + (gsize)y * gdk_pixbuf_get_rowstride(pass->current);
+        const guint8 *b = gdk_pixbuf_read_pixels(pass->other) + (gsize)y * gdk_pixbuf_get_rowstride(pass->other);
+        guint32 *out = (guint32 *)(pass->heatmap + (gsize)y * pass->heatmap_stride);
+        CompareCell *cells = pass->cells + (gsize)(y / COMPARE_CELL) * pass->cells_per_row;
+        gint covered = y < other_height ? overlap : 0;
+        gsize i = 0;
+        
+        // Channel differences, a vector at a time
+        for (; i + 16 <= (gsize)covered * n_channels; i += 16) {
+            v16u8 va, vb;
+            memcpy(&va, a + i, sizeof(va));
+            memcpy(&vb, b + i, sizeof(vb));
+            v16u8 d = v16u8_absdiff(va, vb);
+            memcpy(diff + i, &d, sizeof(d));
+        }
+        for (; i < (gsize)covered * n_channels; i++) {
+            diff[i] = ABS((gint)a[i] - (gint)b[i]);
+        }
+        
+        for (gint x = 0; x < width; x++, a += n_channels) {
+            guint gray = (a[0] * 77 + a[1] * 150 + a[2] * 29) >> 8;
+            guint dim = 48 + gray / 3;
+            guint magnitude = 255;  // Outside the other image counts as changed
+            
+            if (x < covered) {
+                const guint8 *d = diff + (gsize)x * n_channels;
+                magnitude = MAX(MAX(d[0], d[1]), d[2]);
+                if (n_channels == 4) {
+                    magnitude = MAX(magnitude, d[3]);
+                }
+            }
+            
+            if (magnitude > COMPARE_THRESHOLD) {
+                guint fade = dim * (255 - magnitude) / 255;
+                out[x] = 0xffff0000 | (fade << 8) | fade;
+                compare_mark(&cells[x / COMPARE_CELL], x, y);
+            } else {
+                out[x] = 0xff000000 | (dim << 16) | (dim << 8) | dim;
+            }
+        }
+    }
+    
+    g_free(diff);
+}
+
+// Merge touching changed cells into regions, each an explicit-stack flood
+// over the cell grid
+static GArray *compare_collect_regions(CompareCell *cells, gint cells_per_row, gint n_rows) {
+    GArray *regions = g_array_new(FALSE, FALSE, sizeof(GdkRectangle));
+    GArray *stack = g_array_new(FALSE, FALSE, sizeof(gint));
+    
+    for (gint start = 0; start < cells_per_row * n_rows; start++) {
+        if (cells[start].x0 > cells[start].x1) continue;
+        
+        CompareCell bounds = cells[start];
+        cells[start].x0 = G_MAXINT;  // Visited
+        g_array_append_val(stack, start);
+        
+        while (stack->len > 0) {
+            gint index = g_array_index(stack, gint, stack->len - 1);
+            gint cx = index % cells_per_row;
+            gint cy = index / cells_per_row;
+            g_array_set_size(stack, stack->len - 1);
+            
+            for (gint ny = MAX(cy - 1, 0); ny <= MIN(cy + 1, n_rows - 1); ny++) {
+                for (gint nx = MAX(cx - 1, 0); nx <= MIN(cx + 1, cells_per_row - 1); nx++) {
+                    gint neighbor = ny * cells_per_row + nx;
+                    CompareCell *cell = &cells[neighbor];
+                    if (cell->x0 > cell->x1) continue;
+                    
+                    compare_mark(&bounds, cell->x0, cell->y0);
+                    compare_mark(&bounds, cell->x1, cell->y1);
+                    cell->x0 = G_MAXINT;
+                    g_array_append_val(stack, neighbor);
+                }
+            }
+        }
+        
+        GdkRectangle region = {bounds.x0, bounds.y0, bounds.x1 - bounds.x0 + 1, bounds.y1 - bounds.y0 + 1};
+        g_array_append_val(regions, region);
+    }
+    
+    g_array_free(stack, TRUE);
+    return regions;
+}
+
+// The other image with the same channel count as current_pixbuf, or NULL
+// when the converted copy cannot be allocated
+static GdkPixbuf *compare_matched_other(void) {
+    gboolean has_alpha = gdk_pixbuf_get_has_alpha(current_pixbuf);
+    
+    if (gdk_pixbuf_get_has_alpha(compare.other) == has_alpha) {
+        return g_object_ref(compare.other);
+    }
+    if (has_alpha) {
+        return gdk_pixbuf_add_alpha(compare.other, FALSE, 0, 0, 0);
+    }
+    
+    // Drop the alpha channel
+    int width = gdk_pixbuf_get_width(compare.other);
+    int height = gdk_pixbuf_get_height(compare.other);
+    GdkPixbuf *opaque = pool_pixbuf_new(FALSE, width, height);
+    if (!opaque) return NULL;
+    for (int y = 0; y < height; y++) {
+        const guint8 *in = gdk_pixbuf_read_pixels(compare.other) + (gsize)y * gdk_pixbuf_get_rowstride(compare.other);
+        guint8 *out = gdk_pixbuf_get_pixels(opaque) + (gsize)y * gdk_pixbuf_get_rowstride(opaque);
+        for (int x = 0; x < width; x++, in += 4, out += 3) {
+            memcpy(out, in, 3);
+        }
+    }
+    return opaque;
+}
+
+static void compare_refresh_region_list(void) {
+    g_signal_handlers_block_by_func(compare_region_combo, on_compare_region_changed, NULL);
+    gtk_combo_box_text_remove_all(GTK_COMBO_BOX_TEXT(compare_region_combo));
+    for (guint i = 0; i < MIN(compare.regions->len, COMPARE_MAX_LISTED); i++) {
+        GdkRectangle *region = &g_array_index(compare.regions, GdkRectangle, i);
+        char *label = g_strdup_printf("%d, %d  %d×%d", region->x, region->y, region->width, region->height);
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(compare_region_combo), label);
+        g_free(label);
+    }
+    g_signal_handlers_unblock_by_func(compare_region_combo, on_compare_region_changed, NULL);
+    compare.selected = -1;
+    
+    char *summary = g_strdup_printf("%u changed region%s", compare.regions->len,
+                                    compare.regions->len == 1 ? "" : "s");
+    gtk_label_set_text(GTK_LABEL(compare_summary), summary);
+    g_free(summary);
+    gtk_widget_set_sensitive(compare_region_combo, compare.regions->len > 0);
+    gtk_widget_set_sensitive(compare_annotate_button, compare.regions->len > 0);
+}
+
+// Recompute the heatmap and changed regions for the current image
+static void compare_rebuild(void) {
+    gint64 start_time = g_get_monotonic_time();
+    int width = gdk_pixbuf_get_width(current_pixbuf);
+    int height = gdk_pixbuf_get_height(current_pixbuf);
+    
+    if (!compare.heatmap ||
+        cairo_image_surface_get_width(compare.heatmap) != width ||
+        cairo_image_surface_get_height(compare.heatmap) != height) {
+        if (compare.heatmap) {
+            cairo_surface_destroy(compare.heatmap);
+        }
+        compare.heatmap = pool_surface_new(CAIRO_FORMAT_RGB24, width, height);
+    }
+    if (!compare.heatmap) {
+        if (compare.regions) {
+            g_array_free(compare.regions, TRUE);
+        }
+        compare.regions = g_array_new(FALSE, FALSE, sizeof(GdkRectangle));
+        compare.valid = TRUE;
+        compare_refresh_region_list();
+        return;
+    }
+    
+    // Skipped, leaving the comparison out of date, when the other image cannot
+    // be converted; the next edit tries again
+    GdkPixbuf *other = compare_matched_other();
+    if (!other) return;
+    
+    ComparePass pass = {
+        .current = current_pixbuf,
+        .other = other,
+        .cells_per_row = (width + COMPARE_CELL - 1) / COMPARE_CELL
+    };
+    gint n_rows = (height + COMPARE_CELL - 1) / COMPARE_CELL;
+    
+    cairo_surface_flush(compare.heatmap);
+    pass.heatmap = cairo_image_surface_get_data(compare.heatmap);
+    pass.heatmap_stride = cairo_image_surface_get_stride(compare.heatmap);
+    pass.cells = g_new(CompareCell, (gsize)pass.cells_per_row * n_rows);
+    for (gsize i = 0; i < (gsize)pass.cells_per_row * n_rows; i++) {
+        pass.cells[i] = (CompareCell){G_MAXINT, G_MAXINT, -1, -1};
+    }
+    
+    parallel_for(n_rows, 1, compare_band_rows, &pass);
+    cairo_surface_mark_dirty(compare.heatmap);
+    
+    if (compare.regions) {
+        g_array_free(compare.regions, TRUE);
+    }
+    compare.regions = compare_collect_regions(pass.cells, pass.cells_per_row, n_rows);
+    compare.valid = TRUE;
+    
+    g_debug("Compared %dx%d images in %.1f ms, %u changed regions", width, height,
+            (g_get_monotonic_time() - start_time) / 1000.0, compare.regions->len);
+    
+    g_free(pass.cells);
+    g_object_unref(pass.other);
+    compare_refresh_region_list();
+}
+
+// Runs ahead of the redraw, so a burst of edits costs one rebuild and the
+// region list is never changed from inside a draw handler
+static gboolean compare_rebuild_idle(gpointer data) {
+    compare.rebuild_source = 0;
+    if (compare.other && current_pixbuf && !compare.valid) {
+        compare_rebuild();
+        gtk_widget_queue_draw(drawing_area);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// current_pixbuf changed: the heatmap and regions are rebuilt when idle, and
+// the redraw has to cover the whole widget since any region may have moved
+static void compare_invalidate(void) {
+    compare.valid = FALSE;
+    if (compare.other) {
+        if (!compare.rebuild_source) {
+            compare.rebuild_source = g_idle_add_full(G_PRIORITY_HIGH_IDLE, compare_rebuild_idle,
+                                                     NULL, NULL);
+        }
+        gtk_widget_queue_draw(drawing_area);
+    }
+}
+
+// Draw the comparison over the image, in image pixels.  Until a pending
+// rebuild runs this shows the previous heatmap and regions.
+static void compare_draw(cairo_t *cr) {
+    int width = MAX(gdk_pixbuf_get_width(current_pixbuf), gdk_pixbuf_get_width(compare.other));
+    int height = MAX(gdk_pixbuf_get_height(current_pixbuf), gdk_pixbuf_get_height(compare.other));
+    double line_width = display_scale();
+    
+    switch (compare.view) {
+        case COMPARE_SWIPE: {
+            double split = compare.position * gdk_pixbuf_get_width(current_pixbuf);
+            
+            cairo_save(cr);
+            cairo_rectangle(cr, split, 0, width - split, height);
+            cairo_clip(cr);
+            cairo_set_source_rgb(cr, 1, 1, 1);
+            cairo_paint(cr);
+            cairo_set_source_surface(cr, compare.other_surface, 0, 0);
+            cairo_paint(cr);
+            cairo_restore(cr);
+            
+            // The handle: a light line with a dark outline, visible on any image
+            cairo_set_line_width(cr, 3 * line_width);
+            cairo_set_source_rgba(cr, 0, 0, 0, 0.6);
+            cairo_move_to(cr, split, 0);
+            cairo_line_to(cr, split, height);
+            cairo_stroke(cr);
+            cairo_set_line_width(cr, line_width);
+            cairo_set_source_rgb(cr, 1, 1, 1);
+            cairo_move_to(cr, split, 0);
+            cairo_line_to(cr, split, height);
+            cairo_stroke(cr);
+            break;
+        }
+        case COMPARE_BLEND:
+            cairo_set_source_surface(cr, compare.other_surface, 0, 0);
+            cairo_paint_with_alpha(cr, compare.position);
+            break;
+        case COMPARE_DIFFERENCE:
+            if (compare.heatmap) {
+                cairo_set_source_surface(cr, compare.heatmap, 0, 0);
+                cairo_paint(cr);
+            }
+            break;
+    }
+    
+    // Outline the changed regions, the selected one heavier
+    for (guint i = 0; compare.regions && i < compare.regions->len; i++) {
+        GdkRectangle *region = &g_array_index(compare.regions, GdkRectangle, i);
+        gboolean selected = (gint)i == compare.selected;
+        
+        cairo_set_source_rgba(cr, 1, 0, 1, selected ? 1.0 : 0.7);
+        cairo_set_line_width(cr, (selected ? 3 : 1) * line_width);
+        cairo_rectangle(cr, region->x - 0.5, region->y - 0.5, region->width + 1, region->height + 1);
+        cairo_stroke(cr);
+    }
+}
+
+static void compare_set_position(double position) {
+    compare.position = CLAMP(position, 0.0, 1.0);
+    gtk_range_set_value(GTK_RANGE(compare_scale), compare.position);
+    gtk_widget_queue_draw(drawing_area);
+}
+
+static void compare_close(void) {
+    g_clear_object(&compare.other);
+    g_clear_pointer(&compare.other_surface, cairo_surface_destroy);
+    g_clear_pointer(&compare.heatmap, cairo_surface_destroy);
+    if (compare.regions) {
+        g_array_free(compare.regions, TRUE);
+        compare.regions = NULL;
+    }
+    compare.dragging = FALSE;
+    compare.valid = FALSE;
+    if (compare.rebuild_source) {
+        g_source_remove(compare.rebuild_source);
+        compare.rebuild_source = 0;
+    }
+    
+    gtk_widget_hide(compare_bar);
+    gtk_widget_queue_draw(drawing_area);
+}
+
+static void compare_open(const char *filename) {
+    GError *error = NULL;
+    GdkPixbuf *other = gdk_pixbuf_new_from_file(filename, &error);
+    
+    if (!other) {
+        g_printerr("Could not load %s: %s\n", filename, error->message);
+        g_error_free(error);
+        return;
+    }
+    
+    compare_close();
+    compare.other = other;
+    compare.other_surface = gdk_cairo_surface_create_from_pixbuf(other, 1, NULL);
+    compare_invalidate();
+    
+    char *name = g_path_get_basename(filename);
+    char *title = g_strdup_printf("Comparing with %s", name);
+    gtk_label_set_text(GTK_LABEL(compare_title), title);
+    g_free(title);
+    g_free(name);
+    
+    gtk_widget_show(compare_bar);
+    compare_set_position(0.5);
+}
+
+// Outline rectangles with the pen as one undoable edit
+static void annotate_rectangles(const GdkRectangle *rects, int n_rects, const GdkRGBA *color, int line_width) {
+    int margin = line_width / 2 + 2;
+    
+    for (int i = 0; i < n_rects; i++) {
+        double x0 = rects[i].x - margin;
+        double y0 = rects[i].y - margin;
+        double x1 = rects[i].x + rects[i].width + margin;
+        double y1 = rects[i].y + rects[i].height + margin;
+        JournalPoint corners[5] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}, {x0, y0}};
+        
+        render_stroke(current_pixbuf, corners, 5, color, line_width);
+    }
+    
+    push_undo_state();
+    journal_rectangles(rects, n_rects, color, line_width);
+    update_drawing_area();
+}
+
+static void on_compare_annotate_clicked(GtkButton *button, gpointer data) {
+    if (!current_pixbuf || !compare.regions || compare.regions->len == 0) return;
+    
+    // The regions are rebuilt when idle, after the outlines are in
+    annotate_rectangles((const GdkRectangle *)compare.regions->data, compare.regions->len,
+                        &current_color, pen_width * display_scale());
+}
+
+// Whether a widget position is on the swipe handle
+static gboolean compare_on_handle(gdouble widget_x) {
+    if (!compare.other || !current_pixbuf || compare.view != COMPARE_SWIPE) return FALSE;
+    
+    double split = compare.position * gdk_pixbuf_get_width(current_pixbuf) / display_scale();
+    return fabs(widget_x - split) <= COMPARE_HANDLE_REACH;
+}
+
+static void on_compare_clicked(GtkButton *button, gpointer data) {
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Compare With",
+                                                    GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(button))),
+                                                    GTK_FILE_CHOOSER_ACTION_OPEN,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL,
+                                                    "_Compare", GTK_RESPONSE_ACCEPT,
+                                                    NULL);
+    GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
+    
+    GtkWidget *preview = gtk_image_new();
+    gtk_widget_set_size_request(preview, THUMBNAIL_SIZE + 16, -1);
+    gtk_file_chooser_set_preview_widget(chooser, preview);
+    g_signal_connect(chooser, "update-preview", G_CALLBACK(on_update_preview), preview);
+    
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        char *filename = gtk_file_chooser_get_filename(chooser);
+        compare_open(filename);
+        g_free(filename);
+    }
+    
+    gtk_widget_destroy(dialog);
+}
+
+static void on_compare_view_changed(GtkComboBox *combo, gpointer data) {
+    compare.view = gtk_combo_box_get_active(combo);
+    gtk_widget_set_sensitive(compare_scale, compare.view != COMPARE_DIFFERENCE);
+    gtk_widget_queue_draw(drawing_area);
+}
+
+static void on_compare_scale_changed(GtkRange *range, gpointer data) {
+    compare.position = gtk_range_get_value(range);
+    gtk_widget_queue_draw(drawing_area);
+}
+
+static void on_compare_region_changed(GtkComboBox *combo, gpointer data) {
+    compare.selected = gtk_combo_box_get_active(combo);
+    gtk_widget_queue_draw(drawing_area);
+}
+
+static void on_compare_close_clicked(GtkButton *button, gpointer data) {
+    compare_close();
+}
+
+// The bar shown under the toolbar while comparing
+static GtkWidget *build_compare_bar(void) {
+    GtkWidget *bar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_container_set_border_width(GTK_CONTAINER(bar), 5);
+    
+    compare_title = gtk_label_new(NULL);
+    gtk_box_pack_start(GTK_BOX(bar), compare_title, FALSE, FALSE, 0);
+    
+    GtkWidget *view_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(view_combo), "Swipe");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(view_combo), "Blend");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(view_combo), "Difference");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(view_combo), compare.view);
+    g_signal_connect(view_combo, "changed", G_CALLBACK(on_compare_view_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), view_combo, FALSE, FALSE, 0);
+    
+    compare_scale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0.0, 1.0, 0.01);
+    gtk_scale_set_draw_value(GTK_SCALE(compare_scale), FALSE);
+    gtk_widget_set_size_request(compare_scale, 200, -1);
+    gtk_widget_set_tooltip_text(compare_scale, "Swipe position or blend amount");
+    g_signal_connect(compare_scale, "value-changed", G_CALLBACK(on_compare_scale_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), compare_scale, FALSE, FALSE, 0);
+    
+    compare_summary = gtk_label_new(NULL);
+    gtk_box_pack_start(GTK_BOX(bar), compare_summary, FALSE, FALSE, 0);
+    
+    compare_region_combo = gtk_combo_box_text_new();
+    gtk_widget_set_tooltip_text(compare_region_combo, "Highlight a changed region");
+    g_signal_connect(compare_region_combo, "changed", G_CALLBACK(on_compare_region_changed), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), compare_region_combo, FALSE, FALSE, 0);
+    
+    compare_annotate_button = gtk_button_new_with_label("Outline Changes");
+    gtk_widget_set_tooltip_text(compare_annotate_button,
+                                "Draw a rectangle around every changed region with the pen");
+    g_signal_connect(compare_annotate_button, "clicked", G_CALLBACK(on_compare_annotate_clicked), NULL);
+    gtk_box_pack_start(GTK_BOX(bar), compare_annotate_button, FALSE, FALSE, 0);
+    
+    GtkWidget *close_button = gtk_button_new_from_icon_name("window-close", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    gtk_widget_set_tooltip_text(close_button, "Stop Comparing");
+    g_signal_connect(close_button, "clicked", G_CALLBACK(on_compare_close_clicked), NULL);
+    gtk_box_pack_end(GTK_BOX(bar), close_button, FALSE, FALSE, 0);
+    
+    return bar;
+}
+
+// Magnifier loupe
+//
+// A box next to the pointer showing the image pixels around it enlarged
+// LOUPE_ZOOM times with nearest-neighbor sampling, a pixel grid and the
+// color under the pointer.  It samples the display cache, so its cost does
+// not depend on the image size, and each move redraws only the loupe's old
+// and new boxes.
+#define LOUPE_PIXELS 21   // Image pixels across, odd so one is centered
+#define LOUPE_ZOOM 8      // Logical pixels per image pixel
+#define LOUPE_READOUT 20  // Height of the color readout below the view
+#define LOUPE_OFFSET 24   // Distance from the pointer
+
+// The loupe's box for a pointer position, flipped to stay inside the widget
+static GdkRectangle loupe_area_at(gdouble widget_x, gdouble widget_y) {
+    int size = LOUPE_PIXELS * LOUPE_ZOOM;
+    GdkRectangle area = {widget_x + LOUPE_OFFSET, widget_y + LOUPE_OFFSET, size, size + LOUPE_READOUT};
+    
+    if (area.x + area.width > gtk_widget_get_allocated_width(drawing_area)) {
+        area.x = widget_x - LOUPE_OFFSET - area.width;
+    }
+    if (area.y + area.height > gtk_widget_get_allocated_height(drawing_area)) {
+        area.y = widget_y - LOUPE_OFFSET - area.height;
+    }
+    return area;
+}
+
+static void loupe_queue_draw(void) {
+    if (loupe.visible) {
+        // One extra pixel for the border line
+        gtk_widget_queue_draw_area(drawing_area, loupe.area.x - 1, loupe.area.y - 1,
+                                   loupe.area.width + 2, loupe.area.height + 2);
+    }
+}
+
+static void loupe_move(gdouble widget_x, gdouble widget_y) {
+    if (!loupe.enabled || !current_pixbuf) return;
+    
+    loupe_queue_draw();
+    loupe.visible = TRUE;
+    loupe.image_x = floor(widget_to_image(widget_x));
+    loupe.image_y = floor(widget_to_image(widget_y));
+    loupe.area = loupe_area_at(widget_x, widget_y);
+    loupe_queue_draw();
+}
+
+static void loupe_hide(void) {
+    loupe_queue_draw();
+    loupe.visible = FALSE;
+}
+
+// Draw the loupe in widget coordinates, over everything else
+static void loupe_draw(cairo_t *cr) {
+    GdkRectangle *area = &loupe.area;
+    int view = LOUPE_PIXELS * LOUPE_ZOOM;
+    double center_x = area->x + view / 2.0;
+    double center_y = area->y + view / 2.0;
+    
+    cairo_save(cr);
+    cairo_rectangle(cr, area->x, area->y, view, view);
+    cairo_clip(cr);
+    cairo_set_source_rgb(cr, 0.88, 0.88, 0.88);
+    cairo_paint(cr);
+    
+    // Scale so one image pixel of the cache covers LOUPE_ZOOM logical pixels,
+    // with the pointer's pixel centered
+    cairo_surface_t *front = render_front_surface();
+    if (front) {
+        int scale = render.target->scale;
+        cairo_save(cr);
+        cairo_translate(cr, center_x, center_y);
+        cairo_scale(cr, LOUPE_ZOOM * scale, LOUPE_ZOOM * scale);
+        cairo_set_source_surface(cr, front, -(loupe.image_x + 0.5) / scale, -(loupe.image_y + 0.5) / scale);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+        cairo_paint(cr);
+        cairo_restore(cr);
+    }
+    
+    // Pixel grid
+    cairo_set_source_rgba(cr, 0, 0, 0, 0.2);
+    cairo_set_line_width(cr, 1);
+    for (int i = 1; i < LOUPE_PIXELS; i++) {
+        cairo_move_to(cr, area->x + i * LOUPE_ZOOM + 0.5, area->y);
+        cairo_line_to(cr, area->x + i * LOUPE_ZOOM + 0.5, area->y + view);
+        cairo_move_to(cr, area->x, area->y + i * LOUPE_ZOOM + 0.5);
+        cairo_line_to(cr, area->x + view, area->y + i * LOUPE_ZOOM + 0.5);
+    }
+    cairo_stroke(cr);
+    
+    // The pointer's pixel, outlined light and dark to show on any color
+    double half = LOUPE_ZOOM / 2.0;
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    cairo_rectangle(cr, center_x - half - 0.5, center_y - half - 0.5, LOUPE_ZOOM + 1, LOUPE_ZOOM + 1);
+    cairo_stroke(cr);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_rectangle(cr, center_x - half + 0.5, center_y - half + 0.5, LOUPE_ZOOM - 1, LOUPE_ZOOM - 1);
+    cairo_stroke(cr);
+    cairo_restore(cr);
+    
+    // Readout: position and the unpremultiplied color from current_pixbuf
+    cairo_set_source_rgb(cr, 0.15, 0.15, 0.15);
+    cairo_rectangle(cr, area->x, area->y + view, view, LOUPE_READOUT);
+    cairo_fill(cr);
+    
+    char readout[64];
+    int width = gdk_pixbuf_get_width(current_pixbuf);
+    int height = gdk_pixbuf_get_height(current_pixbuf);
+    if (loupe.image_x >= 0 && loupe.image_y >= 0 && loupe.image_x < width && loupe.image_y < height) {
+        int n_channels = gdk_pixbuf_get_n_channels(current_pixbuf);
+        const guint8 *p = gdk_pixbuf_read_pixels(current_pixbuf) +
+                          (gsize)loupe.image_y * gdk_pixbuf_get_rowstride(current_pixbuf) +
+                          (gsize)loupe.image_x * n_channels;
+        
+        if (n_channels == 4) {
+            g_snprintf(readout, sizeof(readout), "%d, %d  #%02X%02X%02X %d%%", loupe.image_x, loupe.image_y,
+                       p[0], p[1], p[2], (p[3] * 100 + 127) / 255);
+        } else {
+            g_snprintf(readout, sizeof(readout), "%d, %d  #%02X%02X%02X", loupe.image_x, loupe.image_y,
+                       p[0], p[1], p[2]);
+        }
+        
+        cairo_set_source_rgb(cr, p[0] / 255.0, p[1] / 255.0, p[2] / 255.0);
+        cairo_rectangle(cr, area->x + 4, area->y + view + 4, LOUPE_READOUT - 8, LOUPE_READOUT - 8);
+        cairo_fill_preserve(cr);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_set_line_width(cr, 1);
+        cairo_stroke(cr);
+    } else {
+        g_snprintf(readout, sizeof(readout), "%d, %d", loupe.image_x, loupe.image_y);
+    }
+    
+    set_cairo_font(cr, "Monospace 9");
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_move_to(cr, area->x + LOUPE_READOUT, area->y + view + LOUPE_READOUT - 6);
+    cairo_show_text(cr, readout);
+    
+    // Border
+    cairo_set_source_rgb(cr, 0.3, 0.3, 0.3);
+    cairo_set_line_width(cr, 1);
+    cairo_rectangle(cr, area->x - 0.5, area->y - 0.5, area->width + 1, area->height + 1);
+    cairo_stroke(cr);
+}
+
+static void on_loupe_toggled(GtkToggleButton *button, gpointer data) {
+    loupe.enabled = gtk_toggle_button_get_active(button);
+    if (!loupe.enabled) {
+        loupe_hide();
+    }
+}
+
+static gboolean on_leave_notify(GtkWidget *widget, GdkEventCrossing *event, gpointer data) {
+    loupe_hide();
+    return FALSE;
+}
+
+// Image adjustments
+//
+// Levels, gamma, brightness/contrast and grayscale all map each channel
+// value independently, so they are folded into one 256-entry table built
+// once per change; applying it is a table lookup per byte over parallel row
+// bands.  Grayscale weights are folded in too, as three tables of weighted
+// outputs that sum to the gray value.  While the dialog is open the tables
+// are applied to a proxy of at most ADJUST_PROXY_PIXELS, drawn scaled over
+// the image, and the full image is adjusted once on accept.
+#define ADJUST_PROXY_PIXELS (2 * 1024 * 1024)
+
+typedef struct {
+    guint8 level[256];
+    guint16 gray_r[256];  // 77, 150 and 29 times level[], summing to gray * 256
+    guint16 gray_g[256];
+    guint16 gray_b[256];
+    gboolean grayscale;
+} AdjustLut;
+
+typedef struct {
+    GdkPixbuf *src;
+    GdkPixbuf *dest;  // May be src
+    const AdjustLut *lut;
+} AdjustPass;
+
+static gboolean adjustments_identity(const Adjustments *adjust) {
+    return adjust->black == 0 && adjust->white == 255 && adjust->gamma == 1.0 &&
+           adjust->brightness == 0 && adjust->contrast == 0 && !adjust->grayscale;
+}
+
+static void adjust_build_lut(const Adjustments *adjust, AdjustLut *lut) {
+    double range = MAX(adjust->white - adjust->black, 1);
+    double contrast = (100.0 + adjust->contrast) / 100.0;
+    double brightness = adjust->brightness / 200.0;
+    
+    for (int i = 0; i < 256; i++) {
+        double v = CLAMP((i - adjust->black) / range, 0.0, 1.0);
+        v = pow(v, 1.0 / adjust->gamma);
+        v = (v - 0.5) * contrast * contrast + 0.5 + brightness;
+        lut->level[i] = CLAMP((int)round(v * 255), 0, 255);
+        lut->gray_r[i] = 77 * lut->level[i];
+        lut->gray_g[i] = 150 * lut->level[i];
+        lut->gray_b[i] = 29 * lut->level[i];
+    }
+    lut->grayscale = adjust->grayscale;
+}
+
+static void adjust_rows(gint start, gint end, gpointer data) {
+    const AdjustPass *pass = data;
+    const AdjustLut *lut = pass->lut;
+    gint width = gdk_pixbuf_get_width(pass->src);
+    gint n_channels = gdk_pixbuf_get_n_channels(pass->src);
+    
+    for (gint y = start; y < end; y++) {
+        const guint8 *in = gdk_pixbuf_read_pixels(pass->src) + (gsize)y * gdk_pixbuf_get_rowstride(pass->src);
+        guint8 *out = gdk_pixbuf_get_pixels(pass->dest) + (gsize)y * gdk_pixbuf_get_rowstride(pass->dest);
+        
+        if (lut->grayscale) {
+            for (gint x = 0; x < width; x++, in += n_channels, out += n_channels) {
+                guint8 gray = (lut->gray_r[in[0]] + lut->gray_g[in[1]] + lut->gray_b[in[2]] + 128) >> 8;
+                out[0] = out[1] = out[2] = gray;
+                if (n_channels == 4) out[3] = in[3];
+            }
+        } else if (n_channels == 3) {
+            // Every byte is a color channel
+            for (gint i = 0; i < width * 3; i++) {
+                out[i] = lut->level[in[i]];
+            }
+        } else {
+            for (gint x = 0; x < width; x++, in += 4, out += 4) {
+                out[0] = lut->level[in[0]];
+                out[1] = lut->level[in[1]];
+                out[2] = lut->level[in[2]];
+                out[3] = in[3];
+            }
+        }
+    }
+}
+
+// Adjust src into dest, which has the same size and may be src
+static void adjust_pixbuf(GdkPixbuf *src, GdkPixbuf *dest, const Adjustments *adjust) {
+    AdjustLut lut;
+    adjust_build_lut(adjust, &lut);
+    
+    AdjustPass pass = {src, dest, &lut};
+    parallel_for(gdk_pixbuf_get_height(src), 64, adjust_rows, &pass);
+}
+
+// Apply adjustments to the whole image as one undoable edit
+static void apply_adjustments(const Adjustments *adjust) {
+    if (!current_pixbuf || adjustments_identity(adjust)) return;
+    
+    gint64 start_time = g_get_monotonic_time();
+    adjust_pixbuf(current_pixbuf, current_pixbuf, adjust);
+    g_debug("Adjusted %dx%d image in %.1f ms", gdk_pixbuf_get_width(current_pixbuf),
+            gdk_pixbuf_get_height(current_pixbuf), (g_get_monotonic_time() - start_time) / 1000.0);
+    
+    UndoOp op = {.kind = UNDO_ADJUST, .adjust = *adjust};
+    push_undo_op(&op);
+    journal_adjust(adjust);
+    
+    update_drawing_area_region(0, 0, gdk_pixbuf_get_width(current_pixbuf), gdk_pixbuf_get_height(current_pixbuf));
+}
+
+static gboolean adjust_preview_update(gpointer data) {
+    gint64 start_time = g_get_monotonic_time();
+    int width = gdk_pixbuf_get_width(adjust_preview.proxy);
+    int height = gdk_pixbuf_get_height(adjust_preview.proxy);
+    PixelRowToCairo convert = pixel_row_to_cairo(pixbuf_pixel_format(adjust_preview.proxy));
+    
+    adjust_preview.idle_id = 0;
+    adjust_pixbuf(adjust_preview.proxy, adjust_preview.adjusted, &adjust_preview.params);
+    
+    cairo_surface_flush(adjust_preview.surface);
+    guint8 *data_out = cairo_image_surface_get_data(adjust_preview.surface);
+    int stride = cairo_image_surface_get_stride(adjust_preview.surface);
+    for (int y = 0; y < height; y++) {
+        convert(gdk_pixbuf_read_pixels(adjust_preview.adjusted) +
+                (gsize)y * gdk_pixbuf_get_rowstride(adjust_preview.adjusted),
+                (guint32 *)(data_out + (gsize)y * stride), width);
+    }
+    cairo_surface_mark_dirty(adjust_preview.surface);
+    
+    g_debug("Adjustment preview %dx%d in %.1f ms", width, height,
+            (g_get_monotonic_time() - start_time) / 1000.0);
+    gtk_widget_queue_draw(drawing_area);
+    return G_SOURCE_REMOVE;
+}
+
+// Coalesce slider changes into one preview update per main loop iteration
+static void adjust_preview_queue(void) {
+    if (adjust_preview.surface && !adjust_preview.idle_id) {
+        adjust_preview.idle_id = g_idle_add(adjust_preview_update, NULL);
+    }
+}
+
+// Without memory for the proxy the dialog still works, just without a
+// preview; the adjustments are applied to the full image either way
+static void adjust_preview_begin(void) {
+    int width = gdk_pixbuf_get_width(current_pixbuf);
+    int height = gdk_pixbuf_get_height(current_pixbuf);
+    double factor = MIN(1.0, sqrt((double)ADJUST_PROXY_PIXELS / ((double)width * height)));
+    
+    if (factor < 1.0) {
+        adjust_preview.proxy = scale_pixbuf(current_pixbuf, MAX((int)(width * factor), 1),
+                                            MAX((int)(height * factor), 1));
+    } else {
+        adjust_preview.proxy = g_object_ref(current_pixbuf);
+    }
+    if (adjust_preview.proxy) {
+        adjust_preview.adjusted = pool_pixbuf_copy(adjust_preview.proxy);
+        adjust_preview.surface = pool_surface_new(pixel_format_cairo(pixbuf_pixel_format(current_pixbuf)),
+                                                  gdk_pixbuf_get_width(adjust_preview.proxy),
+                                                  gdk_pixbuf_get_height(adjust_preview.proxy));
+    }
+    if (!adjust_preview.adjusted || !adjust_preview.surface) {
+        g_clear_object(&adjust_preview.proxy);
+        g_clear_object(&adjust_preview.adjusted);
+        g_clear_pointer(&adjust_preview.surface, cairo_surface_destroy);
+        g_printerr("Not enough memory to preview the adjustments\n");
+        return;
+    }
+    adjust_preview.params = (Adjustments)ADJUSTMENTS_IDENTITY;
+    adjust_preview_update(NULL);
+}
+
+static void adjust_preview_end(void) {
+    if (adjust_preview.idle_id) {
+        g_source_remove(adjust_preview.idle_id);
+        adjust_preview.idle_id = 0;
+    }
+    g_clear_object(&adjust_preview.proxy);
+    g_clear_object(&adjust_preview.adjusted);
+    g_clear_pointer(&adjust_preview.surface, cairo_surface_destroy);
+    gtk_widget_queue_draw(drawing_area);
+}
+
+// Draw the preview over the image, in image pixels
+static void adjust_preview_draw(cairo_t *cr) {
+    int width = gdk_pixbuf_get_width(current_pixbuf);
+    int height = gdk_pixbuf_get_height(current_pixbuf);
+    
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, 0, width, height);
+    cairo_clip(cr);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+    cairo_scale(cr, (double)width / cairo_image_surface_get_width(adjust_preview.surface),
+                (double)height / cairo_image_surface_get_height(adjust_preview.surface));
+    cairo_set_source_surface(cr, adjust_preview.surface, 0, 0);
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    cairo_paint(cr);
+    cairo_restore(cr);
+}
+
+static void on_adjust_level_changed(GtkRange *range, gpointer data) {
+    int *value = data;
+    *value = (int)gtk_range_get_value(range);
+    adjust_preview_queue();
+}
+
+// The black point stays below the white point: moving either past the
+// other pushes the other along, which runs its own handler
+static void on_adjust_black_changed(GtkRange *range, gpointer white) {
+    adjust_preview.params.black = (int)gtk_range_get_value(range);
+    if (adjust_preview.params.white <= adjust_preview.params.black) {
+        gtk_range_set_value(GTK_RANGE(white), adjust_preview.params.black + 1);
+    }
+    adjust_preview_queue();
+}
+
+static void on_adjust_white_changed(GtkRange *range, gpointer black) {
+    adjust_preview.params.white = (int)gtk_range_get_value(range);
+    if (adjust_preview.params.black >= adjust_preview.params.white) {
+        gtk_range_set_value(GTK_RANGE(black), adjust_preview.params.white - 1);
+    }
+    adjust_preview_queue();
+}
+
+static void on_adjust_gamma_changed(GtkRange *range, gpointer data) {
+    adjust_preview.params.gamma = gtk_range_get_value(range);
+    adjust_preview_queue();
+}
+
+static void on_adjust_grayscale_toggled(GtkToggleButton *button, gpointer data) {
+    adjust_preview.params.grayscale = gtk_toggle_button_get_active(button);
+    adjust_preview_queue();
+}
+
+// A labeled slider on one row of the adjustments grid
+static GtkWidget *adjust_dialog_slider(GtkWidget *grid, int row, const char *label,
+                                       double min, double max, double step, double value) {
+    GtkWidget *label_widget = gtk_label_new(label);
+    gtk_widget_set_halign(label_widget, GTK_ALIGN_START);
+    gtk_grid_attach(GTK_GRID(grid), label_widget, 0, row, 1, 1);
+    
+    GtkWidget *scale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, min, max, step);
+    gtk_range_set_value(GTK_RANGE(scale), value);
+    gtk_scale_set_value_pos(GTK_SCALE(scale), GTK_POS_RIGHT);
+    gtk_widget_set_size_request(scale, 260, -1);
+    gtk_grid_attach(GTK_GRID(grid), scale, 1, row, 1, 1);
+    return scale;
+}
+
+static void on_adjust_clicked(GtkButton *button, gpointer data) {
+    if (!current_pixbuf) return;
+    
+    adjust_preview_begin();
+    
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("Adjust Image",
+                                                    GTK_WINDOW(gtk_widget_get_toplevel(drawing_area)),
+                                                    GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL,
+                                                    "_Apply", GTK_RESPONSE_ACCEPT,
+                                                    NULL);
+    GtkWidget *content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 6);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 12);
+    gtk_container_set_border_width(GTK_CONTAINER(grid), 10);
+    
+    Adjustments *params = &adjust_preview.params;
+    GtkWidget *black = adjust_dialog_slider(grid, 0, "Black point:", 0, 254, 1, params->black);
+    GtkWidget *white = adjust_dialog_slider(grid, 1, "White point:", 1, 255, 1, params->white);
+    g_signal_connect(black, "value-changed", G_CALLBACK(on_adjust_black_changed), white);
+    g_signal_connect(white, "value-changed", G_CALLBACK(on_adjust_white_changed), black);
+    GtkWidget *gamma = adjust_dialog_slider(grid, 2, "Gamma:", 0.1, 4.0, 0.01, params->gamma);
+    gtk_scale_set_digits(GTK_SCALE(gamma), 2);
+    g_signal_connect(gamma, "value-changed", G_CALLBACK(on_adjust_gamma_changed), NULL);
+    GtkWidget *brightness = adjust_dialog_slider(grid, 3, "Brightness:", -100, 100, 1, params->brightness);
+    g_signal_connect(brightness, "value-changed", G_CALLBACK(on_adjust_level_changed), &params->brightness);
+    GtkWidget *contrast = adjust_dialog_slider(grid, 4, "Contrast:", -100, 100, 1, params->contrast);
+    g_signal_connect(contrast, "value-changed", G_CALLBACK(on_adjust_level_changed), &params->contrast);
+    
+    GtkWidget *grayscale = gtk_check_button_new_with_label("Grayscale");
+    g_signal_connect(grayscale, "toggled", G_CALLBACK(on_adjust_grayscale_toggled), NULL);
+    gtk_grid_attach(GTK_GRID(grid), grayscale, 1, 5, 1, 1);
+    
+    gtk_container_add(GTK_CONTAINER(content_area), grid);
+    gtk_widget_show_all(dialog);
+    
+    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+    Adjustments chosen = *params;
+    gtk_widget_destroy(dialog);
+    adjust_preview_end();
+    
+    if (response == GTK_RESPONSE_ACCEPT) {
+        apply_adjustments(&chosen);
+    }
+}
+
+// Crop edge snapping
+//
+// Crop edges snap to the strongest straight edge within EDGE_SNAP_RADIUS
+// logical pixels of the pointer.  A boundary between two columns scores the
+// number of rows where neighboring pixels differ by more than EDGE_THRESHOLD,
+// counted in its strongest channel, so a window or panel border scores its length while texture
+// scores little; rows are scored the same way.  The projections are counted
+// on a background thread, in tiles of EDGE_TILE_ROWS rows whose per-byte
+// counts fit 8-bit vector lanes, and reduced to a table of the snap target
+// for every boundary, so snapping while dragging is a lookup.  The tables
+// belong to one image_generation and are recomputed when entering crop mode
+// or starting a selection after the image changed.
+#define EDGE_THRESHOLD 24
+#define EDGE_TILE_ROWS 255
+#define EDGE_MIN_LENGTH 24   // Weaker boundaries never attract the pointer
+#define EDGE_SNAP_RADIUS 8
+
+typedef struct {
+    GdkPixbuf *pixbuf;   // A private copy of current_pixbuf
+    guint generation;
+    gint radius;         // In image pixels
+    gint *snap_x;        // Results, width + 1 and height + 1 entries
+    gint *snap_y;
+} EdgeJob;
+
+static GThreadPool *edge_pool = NULL;
+
+static inline v16u8 edge_mask(const guint8 *a, const guint8 *b) {
+    v16u8 va, vb;
+    memcpy(&va, a, sizeof(va));
+    memcpy(&vb, b, sizeof(vb));
+    return (v16u8)(v16u8_absdiff(va, vb) > (guint8)EDGE_THRESHOLD);
+}
+
+// Per-channel edge counts: column_counts[i] for the byte pair (i, i + n_channels)
+// of every row, and row_counts[y] for the channel with the most edges between
+// rows y - 1 and y
+static void edge_count_projections(GdkPixbuf *pixbuf, guint32 *column_counts, guint32 *row_counts) {
+    gint height = gdk_pixbuf_get_height(pixbuf);
+    gint n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+    gint stride = gdk_pixbuf_get_rowstride(pixbuf);
+    gint row_bytes = gdk_pixbuf_get_width(pixbuf) * n_channels;
+    gint pair_bytes = row_bytes - n_channels;     // Bytes with a right neighbor
+    gint n_vectors = pair_bytes / 16;
+    const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+    v16u8 *tile_counts = g_new(v16u8, MAX(n_vectors, 1));
+    
+    for (gint tile = 0; tile < height; tile += EDGE_TILE_ROWS) {
+        gint tile_end = MIN(tile + EDGE_TILE_ROWS, height);
+        memset(tile_counts, 0, MAX(n_vectors, 1) * sizeof(v16u8));
+        
+        for (gint y = tile; y < tile_end; y++) {
+            const guint8 *row = pixels + (gsize)y * stride;
+            
+            // Horizontal neighbors: a set mask lane is -1, so subtracting counts it
+            for (gint v = 0; v < n_vectors; v++) {
+                tile_counts[v] -= edge_mask(row + v * 16, row + v * 16 + n_channels);
+            }
+            for (gint i = n_vectors * 16; i < pair_bytes; i++) {
+                column_counts[i] += ABS(row[i] - row[i + n_channels]) > EDGE_THRESHOLD;
+            }
+            
+            // Vertical neighbors, flushed from 8-bit lanes before they can wrap.
+            // With three channels a vector's first byte cycles through the
+            // channels, so each of the three phases keeps its own lanes.
+            if (y == 0) continue;
+            const guint8 *above = row - stride;
+            gint phases = n_channels == 4 ? 1 : n_channels;
+            guint32 counts[4] = {0};
+            gint i = 0;
+            gint k = 0;
+            while (i + 16 <= row_bytes) {
+                v16u8 lanes[3] = {{0}};
+                for (gint n = 0; n < 255 && i + 16 <= row_bytes; n++, i += 16, k++) {
+                    lanes[k % phases] -= edge_mask(above + i, row + i);
+                }
+                for (gint phase = 0; phase < phases; phase++) {
+                    for (gint lane = 0; lane < 16; lane++) {
+                        counts[(phase * 16 + lane) % n_channels] += lanes[phase][lane];
+                    }
+                }
+            }
+            for (; i < row_bytes; i++) {
+                counts[i % n_channels] += ABS(row[i] - above[i]) > EDGE_THRESHOLD;
+            }
+            for (gint c = 0; c < n_channels; c++) {
+                row_counts[y] = MAX(row_counts[y], counts[c]);
+            }
+        }
+        
+        for (gint v = 0; v < n_vectors; v++) {
+            for (gint lane = 0; lane < 16; lane++) {
+                column_counts[v * 16 + lane] += tile_counts[v][lane];
+            }
+        }
+    }
+    
+    g_free(tile_counts);
+}
+
+// For every boundary 0..n, the strongest boundary within radius, nearest on
+// ties, or itself.  strength has n + 1 entries.
+static gint *edge_snap_table(const guint32 *strength, gint n, gint radius) {
+    gint *table = g_new(gint, n + 1);
+    
+    for (gint b = 0; b <= n; b++) {
+        gint best = b;
+        guint32 best_strength = 0;
+        
+        for (gint c = MAX(b - radius, 0); c <= MIN(b + radius, n); c++) {
+            if (strength[c] < EDGE_MIN_LENGTH) continue;
+            if (strength[c] > best_strength ||
+                (strength[c] == best_strength && ABS(c - b) < ABS(best - b))) {
+                best = c;
+                best_strength = strength[c];
+            }
+        }
+        table[b] = best;
+    }
+    return table;
+}
+
+static gboolean deliver_edge_snap(gpointer data) {
+    EdgeJob *job = data;
+    
+    edge_snap.pending = FALSE;
+    if (job->generation == image_generation) {
+        g_free(edge_snap.snap_x);
+        g_free(edge_snap.snap_y);
+        edge_snap.snap_x = job->snap_x;
+        edge_snap.snap_y = job->snap_y;
+        edge_snap.width = gdk_pixbuf_get_width(job->pixbuf);
+        edge_snap.height = gdk_pixbuf_get_height(job->pixbuf);
+        edge_snap.generation = job->generation;
+    } else {
+        // The image changed while counting
+        g_free(job->snap_x);
+        g_free(job->snap_y);
+        if (is_crop_mode) {
+            edge_snap_request();
+        }
+    }
+    
+    g_object_unref(job->pixbuf);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static void edge_worker(gpointer data, gpointer user_data) {
+    EdgeJob *job = data;
+    gint64 start_time = g_get_monotonic_time();
+    gint width = gdk_pixbuf_get_width(job->pixbuf);
+    gint height = gdk_pixbuf_get_height(job->pixbuf);
+    gint n_channels = gdk_pixbuf_get_n_channels(job->pixbuf);
+    guint32 *column_counts = g_new0(guint32, MAX(width - 1, 1) * n_channels);
+    guint32 *row_counts = g_new0(guint32, height);
+    guint32 *strength_x = g_new0(guint32, width + 1);
+    guint32 *strength_y = g_new0(guint32, height + 1);
+    
+    edge_count_projections(job->pixbuf, column_counts, row_counts);
+    
+    // Boundary x lies between columns x - 1 and x, scored by its strongest
+    // channel so an edge in one channel alone is not diluted; the image's
+    // own edges always count as full-length edges
+    for (gint x = 1; x < width; x++) {
+        for (gint c = 0; c < n_channels; c++) {
+            strength_x[x] = MAX(strength_x[x], column_counts[(x - 1) * n_channels + c]);
+        }
+    }
+    for (gint y = 1; y < height; y++) {
+        strength_y[y] = row_counts[y];
     }
+    strength_x[0] = strength_x[width] = height;
+    strength_y[0] = strength_y[height] = width;
+    
+    job->snap_x = edge_snap_table(strength_x, width, job->radius);
+    job->snap_y = edge_snap_table(strength_y, height, job->radius);
+    
+    g_debug("Edge projections for %dx%d in %.1f ms", width, height,
+            (g_get_monotonic_time() - start_time) / 1000.0);
+    
+    g_free(column_counts);
+    g_free(row_counts);
+    g_free(strength_x);
+    g_free(strength_y);
+    g_idle_add(deliver_edge_snap, job);
 }
 
-static void perform_crop(void) {
-    if (!current_pixbuf) return;
-    
-    // Ensure valid crop coordinates
-    int x = MIN(crop_start_x, crop_end_x);
-    int y = MIN(crop_start_y, crop_end_y);
-    int width = abs(crop_end_x - crop_start_x);
-    int height = abs(crop_end_y - crop_start_y);
+// Start computing the snap tables for the current image, unless they are
+// current or on their way.  Edits change current_pixbuf in place, so the
+// worker counts a copy; an edit meanwhile bumps image_generation and the
+// result is dropped.
+static void edge_snap_request(void) {
+    if (!current_pixbuf || edge_snap.pending || edge_snap.generation == image_generation) return;
     
-    // Ensure crop region is within image bounds
-    x = CLAMP(x, 0, gdk_pixbuf_get_width(current_pixbuf));
-    y = CLAMP(y, 0, gdk_pixbuf_get_height(current_pixbuf));
-    width = CLAMP(width, 1, gdk_pixbuf_get_width(current_pixbuf) - x);
-    height = CLAMP(height, 1, gdk_pixbuf_get_height(current_pixbuf) - y);
+    GdkPixbuf *snapshot = pool_pixbuf_copy(current_pixbuf);
+    if (!snapshot) return;
+    if (!edge_pool) {
+        edge_pool = g_thread_pool_new(edge_worker, NULL, 1, FALSE, NULL);
+    }
     
-    // Create new cropped pixbuf
-    GdkPixbuf *cropped = gdk_pixbuf_new_subpixbuf(current_pixbuf, x, y, width, height);
-    if (cropped) {
-        // First store the old pixbuf
-        GdkPixbuf *old_pixbuf = current_pixbuf;
-        
-        // Set the new cropped pixbuf
-        current_pixbuf = cropped;
-        
-        // Now push the state (after we've made the change)
-        push_undo_state();
-        
-        // Free the old pixbuf
-        g_object_unref(old_pixbuf);
-        
-        // Reset crop coordinates
-        crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
-        is_selecting = FALSE;
-        
-        // Update the display
-        gtk_widget_queue_draw(drawing_area);
-        
-        // Disable crop button until new selection is made
-        gtk_widget_set_sensitive(crop_button, FALSE);
+    EdgeJob *job = g_new0(EdgeJob, 1);
+    job->pixbuf = snapshot;
+    job->generation = image_generation;
+    job->radius = EDGE_SNAP_RADIUS * display_scale();
+    edge_snap.pending = TRUE;
+    g_thread_pool_push(edge_pool, job, NULL);
+}
+
+// The crop boundary to use for a pointer position in image pixels
+static int edge_snap_x(gdouble image_x, guint modifiers) {
+    int x = (int)round(image_x);
+    if ((modifiers & GDK_SHIFT_MASK) || edge_snap.generation != image_generation ||
+        x < 0 || x > edge_snap.width) {
+        return x;
+    }
+    return edge_snap.snap_x[x];
+}
+
+static int edge_snap_y(gdouble image_y, guint modifiers) {
+    int y = (int)round(image_y);
+    if ((modifiers & GDK_SHIFT_MASK) || edge_snap.generation != image_generation ||
+        y < 0 || y > edge_snap.height) {
+        return y;
     }
+    return edge_snap.snap_y[y];
 }
 
 static void on_mode_changed(GtkComboBox *combo, gpointer data) {
@@ -935,6 +7772,8 @@ static void on_mode_changed(GtkComboBox *combo, gpointer data) {
         case MODE_DRAW:
             is_text_mode = FALSE;
             is_crop_mode = FALSE;
+            is_redact_mode = FALSE;
+            is_fill_mode = FALSE;
             if (gtk_widget_get_realized(drawing_area)) {
                 GdkWindow *window = gtk_widget_get_window(drawing_area);
                 GdkCursor *cursor = gdk_cursor_new_from_name(gdk_display_get_default(), "crosshair");
@@ -946,6 +7785,8 @@ static void on_mode_changed(GtkComboBox *combo, gpointer data) {
         case MODE_TEXT:
             is_text_mode = TRUE;
             is_crop_mode = FALSE;
+            is_redact_mode = FALSE;
+            is_fill_mode = FALSE;
             if (gtk_widget_get_realized(drawing_area)) {
                 GdkWindow *window = gtk_widget_get_window(drawing_area);
                 GdkCursor *cursor = gdk_cursor_new_from_name(gdk_display_get_default(), "text");
@@ -957,6 +7798,40 @@ static void on_mode_changed(GtkComboBox *combo, gpointer data) {
         case MODE_CROP:
             is_text_mode = FALSE;
             is_crop_mode = TRUE;
+            is_redact_mode = FALSE;
+            is_fill_mode = FALSE;
+            if (crop_start_x == crop_end_x || crop_start_y == crop_end_y) {
+                propose_trim_selection();
+            }
+            edge_snap_request();
+            if (gtk_widget_get_realized(drawing_area)) {
+                GdkWindow *window = gtk_widget_get_window(drawing_area);
+                GdkCursor *cursor = gdk_cursor_new_from_name(gdk_display_get_default(), "crosshair");
+                gdk_window_set_cursor(window, cursor);
+                g_object_unref(cursor);
+            }
+            break;
+            
+        case MODE_BLUR:
+        case MODE_PIXELATE:
+            is_text_mode = FALSE;
+            is_crop_mode = FALSE;
+            is_redact_mode = TRUE;
+            is_fill_mode = FALSE;
+            redact_style = active == MODE_BLUR ? REDACT_BLUR : REDACT_PIXELATE;
+            if (gtk_widget_get_realized(drawing_area)) {
+                GdkWindow *window = gtk_widget_get_window(drawing_area);
+                GdkCursor *cursor = gdk_cursor_new_from_name(gdk_display_get_default(), "crosshair");
+                gdk_window_set_cursor(window, cursor);
+                g_object_unref(cursor);
+            }
+            break;
+            
+        case MODE_FILL:
+            is_text_mode = FALSE;
+            is_crop_mode = FALSE;
+            is_redact_mode = FALSE;
+            is_fill_mode = TRUE;
             if (gtk_widget_get_realized(drawing_area)) {
                 GdkWindow *window = gtk_widget_get_window(drawing_area);
                 GdkCursor *cursor = gdk_cursor_new_from_name(gdk_display_get_default(), "crosshair");
@@ -1045,14 +7920,39 @@ static void on_menu_item_activate(GtkMenuItem *item, gpointer data) {
         case MODE_DRAW:
             is_text_mode = FALSE;
             is_crop_mode = FALSE;
+            is_redact_mode = FALSE;
+            is_fill_mode = FALSE;
             break;
         case MODE_TEXT:
             is_text_mode = TRUE;
             is_crop_mode = FALSE;
+            is_redact_mode = FALSE;
+            is_fill_mode = FALSE;
             break;
         case MODE_CROP:
             is_text_mode = FALSE;
             is_crop_mode = TRUE;
+            is_redact_mode = FALSE;
+            is_fill_mode = FALSE;
+            // Start from the detected content area if there is no selection yet
+            if (crop_start_x == crop_end_x || crop_start_y == crop_end_y) {
+                propose_trim_selection();
+            }
+            edge_snap_request();
+            break;
+        case MODE_BLUR:
+        case MODE_PIXELATE:
+            is_text_mode = FALSE;
+            is_crop_mode = FALSE;
+            is_redact_mode = TRUE;
+            is_fill_mode = FALSE;
+            redact_style = mode == MODE_BLUR ? REDACT_BLUR : REDACT_PIXELATE;
+            break;
+        case MODE_FILL:
+            is_text_mode = FALSE;
+            is_crop_mode = FALSE;
+            is_redact_mode = FALSE;
+            is_fill_mode = TRUE;
             break;
     }
     
@@ -1079,6 +7979,36 @@ static gboolean on_combo_button_press(GtkWidget *widget, GdkEventButton *event,
     return FALSE;
 }
 
+// Handler for rotate/flip menu items
+static void on_transform_activate(GtkMenuItem *item, gpointer data) {
+    if (!current_pixbuf) return;
+    
+    UndoOp op = {.kind = UNDO_TRANSFORM, .transform = GPOINTER_TO_INT(data)};
+    if (!transform_current_image(op.transform)) {
+        g_printerr("Not enough memory to rotate or flip the image\n");
+        return;
+    }
+    push_undo_op(&op);
+    journal_transform(op.transform);
+    
+    // A pending crop selection no longer matches the image
+    crop_start_x = crop_start_y = crop_end_x = crop_end_y = 0;
+    is_selecting = FALSE;
+    gtk_widget_set_sensitive(crop_button, FALSE);
+}
+
+static gboolean on_transform_button_press(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+    if (event->button == 1) {  // Left click
+        gtk_menu_popup_at_widget(GTK_MENU(transform_menu),
+                               widget,
+                               GDK_GRAVITY_SOUTH_WEST,
+                               GDK_GRAVITY_NORTH_WEST,
+                               (GdkEvent*)event);
+        return TRUE;
+    }
+    return FALSE;
+}
+
 // Add the resize function
 static void on_resize_clicked(GtkButton *button, gpointer data) {
     if (!current_pixbuf) return;
@@ -1139,35 +8069,50 @@ static void on_resize_clicked(GtkButton *button, gpointer data) {
         // Calculate new height maintaining aspect ratio
         int new_height = (current_height * new_width) / current_width;
         
-        g_print("Resizing from %dx%d to %dx%d\n", current_width, current_height, new_width, new_height);
-        
-        // Create resized pixbuf
-        GdkPixbuf *resized = gdk_pixbuf_scale_simple(current_pixbuf,
-                                                    new_width,
-                                                    new_height,
-                                                    GDK_INTERP_BILINEAR);
-        
-        if (resized) {
-            // Store current state before modifying
-            push_undo_state();
-            
-            // Update current pixbuf
-            g_object_unref(current_pixbuf);
-            current_pixbuf = resized;
-            
-            // Update drawing area size
-            gtk_widget_set_size_request(drawing_area, new_width, new_height);
-            
-            // Push the resized state
-            push_undo_state();
-            
-            gtk_widget_queue_draw(drawing_area);
-        }
+        resize_current_image(new_width, new_height);
     }
 
     gtk_widget_destroy(dialog);
 }
 
+// Bilinear rescale into a pooled pixbuf; NULL if it cannot be allocated
+static GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int width, int height) {
+    GdkPixbuf *scaled = pool_pixbuf_new(gdk_pixbuf_get_has_alpha(src), width, height);
+    if (!scaled) return NULL;
+    
+    gdk_pixbuf_scale(src, scaled, 0, 0, width, height, 0, 0,
+                     (double)width / gdk_pixbuf_get_width(src),
+                     (double)height / gdk_pixbuf_get_height(src),
+                     GDK_INTERP_BILINEAR);
+    return scaled;
+}
+
+static void resize_current_image(int new_width, int new_height) {
+    int current_width = gdk_pixbuf_get_width(current_pixbuf);
+    int current_height = gdk_pixbuf_get_height(current_pixbuf);
+    
+    g_print("Resizing from %dx%d to %dx%d\n", current_width, current_height, new_width, new_height);
+    
+    // Create resized pixbuf
+    GdkPixbuf *resized = scale_pixbuf(current_pixbuf, new_width, new_height);
+    
+    if (resized) {
+        // Store current state before modifying
+        push_undo_state();
+        
+        // Update current pixbuf
+        g_object_unref(current_pixbuf);
+        current_pixbuf = resized;
+        
+        // Push the resized state
+        push_undo_state();
+        journal_resize(new_width, new_height);
+        
+        // Update drawing area size
+        update_drawing_area();
+    }
+}
+
 // Add the spin button update callbacks
 static void update_pixel_entry(GtkSpinButton *spin_button, gpointer pixel_spin) {
     if (!current_pixbuf) return;
@@ -1195,4 +8140,592 @@ static void update_percent_entry(GtkSpinButton *spin_button, gpointer percent_sp
     g_signal_handlers_block_by_func(percent_spin, update_pixel_entry, spin_button);
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(percent_spin), percent);
     g_signal_handlers_unblock_by_func(percent_spin, update_pixel_entry, spin_button);
-} 
\ No newline at end of file
+} 
+
+// Render server
+//
+// `--serve SOCKET` runs without a window and executes render jobs sent over
+// a Unix domain socket, so automation pays for process start, font loading
+// and codec setup once instead of per image.  Connections are served on the
+// socket service's thread pool, and each one can send any number of jobs.
+// A job is a series of commands, one per line, applied as they arrive:
+//
+//   input PATH               Image to edit, loaded from a file
+//   input-fd                 Image read from a descriptor (e.g. a memfd); the
+//                            server answers "send-fd" and the client then
+//                            passes the descriptor with SCM_RIGHTS
+//   color SPEC               Pen and text color, as accepted by gdk_rgba_parse
+//   width N                  Pen width in pixels
+//   font DESCRIPTION         Pango font description for text
+//   stroke X Y X Y ...       Pen stroke through the points
+//   text X Y TEXT            Text with its baseline starting at (X, Y)
+//   crop X Y W H
+//   resize W H
+//   redact blur|pixelate X Y W H
+//   rotate 90|180|270
+//   flip horizontal|vertical
+//   fill X Y                 Flood fill from a pixel with the pen color
+//   indexed                  Write an 8-bit palette PNG where possible
+//   output PATH              Write the result as PNG to a file...
+//   output-fd                ...or to a memfd passed back after the reply
+//   end                      Finish the job and reply
+//
+// Coordinates are in image pixels.  The reply to "end" is
+// "ok WIDTH HEIGHT BYTES LOAD_MS RENDER_MS ENCODE_MS TOTAL_MS" or
+// "error MESSAGE"; after a failed command the rest of the job is skipped.
+// "stats" replies "stats JOBS FAILED MEAN_MS MAX_MS" for the whole server.
+//
+// Numbers must be finite and within SERVE_MAX_COORDINATE, and no image may
+// grow past SERVE_MAX_DIMENSION on a side or SERVE_MAX_PIXELS in all, so a
+// bad client gets an error reply instead of an oversized allocation.  Inputs
+// are checked against the size in their header before they are decoded.
+#define SERVE_DEFAULT_FONT "Sans 12"
+#define SERVE_MAX_COORDINATE 1048576.0
+#define SERVE_MAX_DIMENSION 32768
+#define SERVE_MAX_PIXELS ((gint64)1 << 28)
+
+typedef struct {
+    GdkPixbuf *pixbuf;
+    GdkRGBA color;
+    int line_width;
+    char *font;
+    gboolean indexed;
+    char *output_path;
+    gboolean output_fd;
+    char *error;         // First failure, NULL while the job is good
+    gint64 start_time;   // First command of the job
+    gint64 load_us;
+    gint64 render_us;
+} RenderJob;
+
+static struct {
+    GMutex mutex;
+    guint64 jobs;
+    guint64 failed;
+    gint64 total_us;
+    gint64 max_us;
+} serve_stats;
+
+static void render_job_reset(RenderJob *job) {
+    g_clear_object(&job->pixbuf);
+    g_free(job->font);
+    g_free(job->output_path);
+    g_free(job->error);
+    
+    memset(job, 0, sizeof(*job));
+    job->color = (GdkRGBA){1.0, 0.0, 0.0, 1.0};
+    job->line_width = 5;
+    job->font = g_strdup(SERVE_DEFAULT_FONT);
+}
+
+static void render_job_fail(RenderJob *job, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+static void render_job_fail(RenderJob *job, const char *format, ...) {
+    va_list args;
+    
+    if (job->error) return;
+    va_start(args, format);
+    job->error = g_strdup_vprintf(format, args);
+    va_end(args);
+}
+
+// Parse count numbers from *text, advancing past them
+static gboolean serve_parse_numbers(const char **text, double *values, int count) {
+    for (int i = 0; i < count; i++) {
+        char *end;
+        values[i] = g_ascii_strtod(*text, &end);
+        if (end == *text || !isfinite(values[i]) ||
+            fabs(values[i]) > SERVE_MAX_COORDINATE) {
+            return FALSE;
+        }
+        *text = end;
+    }
+    return TRUE;
+}
+
+static gboolean serve_size_allowed(gint64 width, gint64 height) {
+    return width <= SERVE_MAX_DIMENSION && height <= SERVE_MAX_DIMENSION &&
+           width * height <= SERVE_MAX_PIXELS;
+}
+
+static void serve_size_error(GError **error) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                "input is larger than %d pixels a side or %" G_GINT64_FORMAT " pixels",
+                SERVE_MAX_DIMENSION, SERVE_MAX_PIXELS);
+}
+
+// Called once the loader has read the image header.  An oversized image is
+// given a zero size, which makes the loaders stop before allocating it.
+static void serve_size_prepared(GdkPixbufLoader *loader, int width, int height,
+                                gpointer data) {
+    gboolean *too_large = data;
+    
+    if (!serve_size_allowed(width, height)) {
+        *too_large = TRUE;
+        gdk_pixbuf_loader_set_size(loader, 0, 0);
+    }
+}
+
+// Decode an image from a stream, refusing it as soon as its size is known
+// to be past the limits
+static GdkPixbuf *serve_load_stream(GInputStream *stream, GError **error) {
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+    gboolean too_large = FALSE;
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(serve_size_prepared), &too_large);
+    
+    guchar *buffer = g_malloc(65536);
+    gboolean ok = TRUE;
+    while (ok && !too_large) {
+        gssize n = g_input_stream_read(stream, buffer, 65536, NULL, error);
+        if (n == 0) break;
+        ok = n > 0 && gdk_pixbuf_loader_write(loader, buffer, n, error);
+    }
+    g_free(buffer);
+    
+    // Closing a refused or failed loader only repeats the error
+    ok = gdk_pixbuf_loader_close(loader, ok && !too_large ? error : NULL) && ok;
+    
+    GdkPixbuf *pixbuf = NULL;
+    if (too_large) {
+        g_clear_error(error);
+        serve_size_error(error);
+    } else if (ok) {
+        pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+        if (pixbuf) {
+            g_object_ref(pixbuf);
+        } else {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "input is not an image");
+        }
+    }
+    g_object_unref(loader);
+    return pixbuf;
+}
+
+// Swap in the result of an edit; a NULL result means it could not be
+// allocated and fails the job, keeping the previous image
+static void render_job_replace(RenderJob *job, GdkPixbuf *pixbuf) {
+    if (!pixbuf) {
+        render_job_fail(job, "out of memory");
+        return;
+    }
+    g_object_unref(job->pixbuf);
+    job->pixbuf = pixbuf;
+}
+
+static void render_job_load(RenderJob *job, GdkPixbuf *pixbuf, GError *error) {
+    // Loaders that report no size before decoding are still held to the limits
+    if (pixbuf && !serve_size_allowed(gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf))) {
+        g_clear_object(&pixbuf);
+        serve_size_error(&error);
+    }
+    if (!pixbuf) {
+        render_job_fail(job, "%s", error->message);
+        g_error_free(error);
+        return;
+    }
+    
+    g_clear_object(&job->pixbuf);
+    job->pixbuf = pool_pixbuf_import(pixbuf);
+    if (!job->pixbuf) render_job_fail(job, "out of memory");
+    g_object_unref(pixbuf);
+}
+
+// Apply one editing command to the job's image
+static void render_job_edit(RenderJob *job, const char *command, const char *args) {
+    int width = gdk_pixbuf_get_width(job->pixbuf);
+    int height = gdk_pixbuf_get_height(job->pixbuf);
+    double v[4];
+    
+    if (g_str_equal(command, "stroke")) {
+        GArray *points = g_array_new(FALSE, FALSE, sizeof(JournalPoint));
+        while (serve_parse_numbers(&args, v, 2)) {
+            JournalPoint point = {v[0], v[1]};
+            g_array_append_val(points, point);
+        }
+        render_stroke(job->pixbuf, (const JournalPoint *)points->data, points->len,
+                      &job->color, job->line_width);
+        g_array_free(points, TRUE);
+    } else if (g_str_equal(command, "text")) {
+        if (!serve_parse_numbers(&args, v, 2) || *args != ' ') {
+            render_job_fail(job, "usage: text X Y TEXT");
+            return;
+        }
+        draw_text_on_pixbuf(job->pixbuf, v[0], v[1], args + 1, job->font, &job->color, NULL);
+    } else if (g_str_equal(command, "crop")) {
+        if (!serve_parse_numbers(&args, v, 4)) {
+            render_job_fail(job, "usage: crop X Y W H");
+            return;
+        }
+        int x0 = CLAMP((int)v[0], 0, width);
+        int y0 = CLAMP((int)v[1], 0, height);
+        int x1 = CLAMP((int)(v[0] + v[2]), 0, width);
+        int y1 = CLAMP((int)(v[1] + v[3]), 0, height);
+        if (x1 <= x0 || y1 <= y0) {
+            render_job_fail(job, "crop rectangle is outside the image");
+            return;
+        }
+        GdkPixbuf *area = gdk_pixbuf_new_subpixbuf(job->pixbuf, x0, y0, x1 - x0, y1 - y0);
+        render_job_replace(job, pool_pixbuf_copy(area));
+        g_object_unref(area);
+    } else if (g_str_equal(command, "resize")) {
+        if (!serve_parse_numbers(&args, v, 2) || v[0] < 1 || v[1] < 1) {
+            render_job_fail(job, "usage: resize W H");
+            return;
+        }
+        if (!serve_size_allowed((gint64)v[0], (gint64)v[1])) {
+            render_job_fail(job, "resize is larger than %d pixels a side or %" G_GINT64_FORMAT " pixels",
+                            SERVE_MAX_DIMENSION, SERVE_MAX_PIXELS);
+            return;
+        }
+        render_job_replace(job, scale_pixbuf(job->pixbuf, v[0], v[1]));
+    } else if (g_str_equal(command, "redact")) {
+        RedactStyle style;
+        if (g_str_has_prefix(args, "blur ")) {
+            style = REDACT_BLUR;
+        } else if (g_str_has_prefix(args, "pixelate ")) {
+            style = REDACT_PIXELATE;
+        } else {
+            render_job_fail(job, "usage: redact blur|pixelate X Y W H");
+            return;
+        }
+        args = strchr(args, ' ');
+        if (!serve_parse_numbers(&args, v, 4)) {
+            render_job_fail(job, "usage: redact blur|pixelate X Y W H");
+            return;
+        }
+        GdkRectangle area = {v[0], v[1], v[2], v[3]};
+        redact_pixbuf_area(job->pixbuf, style, &area);
+    } else if (g_str_equal(command, "rotate") || g_str_equal(command, "flip")) {
+        ImageTransform transform;
+        if (g_str_equal(args, "90")) {
+            transform = TRANSFORM_ROTATE_90;
+        } else if (g_str_equal(args, "180")) {
+            transform = TRANSFORM_ROTATE_180;
+        } else if (g_str_equal(args, "270")) {
+            transform = TRANSFORM_ROTATE_270;
+        } else if (g_str_equal(args, "horizontal")) {
+            transform = TRANSFORM_FLIP_HORIZONTAL;
+        } else if (g_str_equal(args, "vertical")) {
+            transform = TRANSFORM_FLIP_VERTICAL;
+        } else {
+            render_job_fail(job, "usage: rotate 90|180|270 or flip horizontal|vertical");
+            return;
+        }
+        GdkPixbuf *transformed = transform_pixbuf(job->pixbuf, transform);
+        if (!transformed) {
+            render_job_fail(job, "could not transform the image");
+            return;
+        }
+        render_job_replace(job, transformed);
+    } else if (g_str_equal(command, "fill")) {
+        if (!serve_parse_numbers(&args, v, 2) ||
+            v[0] < 0 || v[1] < 0 || v[0] >= width || v[1] >= height) {
+            render_job_fail(job, "usage: fill X Y, inside the image");
+            return;
+        }
+        GdkRectangle bounds;
+        GArray *spans = flood_fill_spans(job->pixbuf, v[0], v[1], &bounds);
+        fill_apply_spans(job->pixbuf, spans, &job->color);
+        g_array_free(spans, TRUE);
+    } else {
+        render_job_fail(job, "unknown command: %s", command);
+    }
+}
+
+// Encode the result and build the reply to "end".  A memfd holding the
+// output is returned in *out_fd (-1 otherwise).
+static char *render_job_finish(RenderJob *job, int *out_fd) {
+    gint64 encode_start = g_get_monotonic_time();
+    gint64 size = 0;
+    
+    *out_fd = -1;
+    if (!job->pixbuf) {
+        render_job_fail(job, "no input");
+    } else if (!job->output_path && !job->output_fd) {
+        render_job_fail(job, "no output");
+    }
+    
+    if (!job->error) {
+        GError *error = NULL;
+        PngRowSource source;
+        gboolean lossy;
+        gboolean indexed = job->indexed && init_palette_png_source(&source, job->pixbuf, &lossy);
+        gboolean written;
+        
+        if (!indexed) {
+            init_pixbuf_png_source(&source, job->pixbuf);
+        }
+        
+        if (job->output_path) {
+            GStatBuf info;
+            written = write_png(job->output_path, &source, &error);
+            if (written && g_stat(job->output_path, &info) == 0) {
+                size = info.st_size;
+            }
+        } else {
+            int fd = memfd_create("image-annotator-output", MFD_CLOEXEC);
+            FILE *file = fd >= 0 ? fdopen(dup(fd), "wb") : NULL;
+            
+            written = file && write_png_stream(file, "memfd", &source, &error);
+            if (file) {
+                fclose(file);
+            } else if (!error) {
+                g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                            "Could not create memfd: %s", g_strerror(errno));
+            }
+            if (written) {
+                size = lseek(fd, 0, SEEK_END);
+                lseek(fd, 0, SEEK_SET);
+                *out_fd = fd;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        
+        if (indexed) {
+            free_palette_png_source(&source);
+        }
+        if (!written) {
+            render_job_fail(job, "%s", error->message);
+            g_error_free(error);
+        }
+    }
+    
+    gint64 now = g_get_monotonic_time();
+    gint64 total_us = job->start_time ? now - job->start_time : 0;
+    char *reply;
+    
+    g_mutex_lock(&serve_stats.mutex);
+    guint64 number = ++serve_stats.jobs;
+    if (job->error) {
+        serve_stats.failed++;
+    }
+    serve_stats.total_us += total_us;
+    serve_stats.max_us = MAX(serve_stats.max_us, total_us);
+    g_mutex_unlock(&serve_stats.mutex);
+    
+    if (job->error) {
+        g_print("Job %" G_GUINT64_FORMAT " failed: %s\n", number, job->error);
+        reply = g_strdup_printf("error %s\n", job->error);
+    } else {
+        g_print("Job %" G_GUINT64_FORMAT ": %dx%d, load %.1f ms, render %.1f ms, encode %.1f ms, total %.1f ms\n",
+                number, gdk_pixbuf_get_width(job->pixbuf), gdk_pixbuf_get_height(job->pixbuf),
+                job->load_us / 1000.0, job->render_us / 1000.0,
+                (now - encode_start) / 1000.0, total_us / 1000.0);
+        reply = g_strdup_printf("ok %d %d %" G_GINT64_FORMAT " %.3f %.3f %.3f %.3f\n",
+                                gdk_pixbuf_get_width(job->pixbuf), gdk_pixbuf_get_height(job->pixbuf),
+                                size, job->load_us / 1000.0, job->render_us / 1000.0,
+                                (now - encode_start) / 1000.0, total_us / 1000.0);
+    }
+    
+    render_job_reset(job);
+    return reply;
+}
+
+static char *serve_stats_reply(void) {
+    g_mutex_lock(&serve_stats.mutex);
+    char *reply = g_strdup_printf("stats %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %.3f %.3f\n",
+                                  serve_stats.jobs, serve_stats.failed,
+                                  serve_stats.jobs ? serve_stats.total_us / 1000.0 / serve_stats.jobs : 0.0,
+                                  serve_stats.max_us / 1000.0);
+    g_mutex_unlock(&serve_stats.mutex);
+    return reply;
+}
+
+// Run one command line.  Returns the reply to send, if any.
+static char *render_job_command(RenderJob *job, GSocketConnection *connection,
+                                const char *line, int *out_fd) {
+    const char *space = strchr(line, ' ');
+    char *command = space ? g_strndup(line, space - line) : g_strdup(line);
+    const char *args = space ? space + 1 : "";
+    char *reply = NULL;
+    
+    if (!job->start_time && !g_str_equal(command, "stats")) {
+        job->start_time = g_get_monotonic_time();
+    }
+    
+    if (g_str_equal(command, "end")) {
+        reply = render_job_finish(job, out_fd);
+    } else if (g_str_equal(command, "stats")) {
+        reply = serve_stats_reply();
+    } else if (job->error) {
+        // Skip the rest of a failed job
+    } else if (g_str_equal(command, "input")) {
+        gint64 start_time = g_get_monotonic_time();
+        GError *error = NULL;
+        GdkPixbuf *pixbuf = NULL;
+        int width, height;
+        
+        if (gdk_pixbuf_get_file_info(args, &width, &height) &&
+            !serve_size_allowed(width, height)) {
+            serve_size_error(&error);
+        } else {
+            pixbuf = gdk_pixbuf_new_from_file(args, &error);
+        }
+        render_job_load(job, pixbuf, error);
+        job->load_us += g_get_monotonic_time() - start_time;
+    } else if (g_str_equal(command, "input-fd")) {
+        GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+        GError *error = NULL;
+        int fd = -1;
+        
+        if (g_output_stream_write_all(out, "send-fd\n", 8, NULL, NULL, &error)) {
+            fd = g_unix_connection_receive_fd(G_UNIX_CONNECTION(connection), NULL, &error);
+        }
+        if (fd < 0) {
+            render_job_fail(job, "%s", error->message);
+            g_error_free(error);
+        } else {
+            gint64 start_time = g_get_monotonic_time();
+            lseek(fd, 0, SEEK_SET);
+            
+            GInputStream *stream = g_unix_input_stream_new(fd, TRUE);
+            GdkPixbuf *pixbuf = serve_load_stream(stream, &error);
+            render_job_load(job, pixbuf, error);
+            g_object_unref(stream);
+            job->load_us += g_get_monotonic_time() - start_time;
+        }
+    } else if (g_str_equal(command, "color")) {
+        if (!gdk_rgba_parse(&job->color, args)) {
+            render_job_fail(job, "bad color: %s", args);
+        }
+    } else if (g_str_equal(command, "width")) {
+        job->line_width = atoi(args);
+        if (job->line_width < 1) {
+            render_job_fail(job, "bad width: %s", args);
+        }
+    } else if (g_str_equal(command, "font")) {
+        g_free(job->font);
+        job->font = g_strdup(args);
+    } else if (g_str_equal(command, "indexed")) {
+        job->indexed = TRUE;
+    } else if (g_str_equal(command, "output")) {
+        g_free(job->output_path);
+        job->output_path = g_strdup(args);
+        job->output_fd = FALSE;
+    } else if (g_str_equal(command, "output-fd")) {
+        g_clear_pointer(&job->output_path, g_free);
+        job->output_fd = TRUE;
+    } else if (!job->pixbuf) {
+        render_job_fail(job, "%s before input", command);
+    } else {
+        gint64 start_time = g_get_monotonic_time();
+        render_job_edit(job, command, args);
+        job->render_us += g_get_monotonic_time() - start_time;
+    }
+    
+    g_free(command);
+    return reply;
+}
+
+// Serve one client until it disconnects; runs on a service pool thread
+static gboolean on_serve_connection(GThreadedSocketService *service, GSocketConnection *connection,
+                                    GObject *source, gpointer data) {
+    GDataInputStream *in = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+    GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    RenderJob job = {0};
+    char *line;
+    
+    render_job_reset(&job);
+    g_data_input_stream_set_newline_type(in, G_DATA_STREAM_NEWLINE_TYPE_LF);
+    while ((line = g_data_input_stream_read_line(in, NULL, NULL, NULL))) {
+        int out_fd = -1;
+        char *reply = render_job_command(&job, connection, line, &out_fd);
+        gboolean sent = TRUE;
+        
+        if (reply) {
+            sent = g_output_stream_write_all(out, reply, strlen(reply), NULL, NULL, NULL);
+        }
+        if (out_fd >= 0) {
+            sent = sent && g_unix_connection_send_fd(G_UNIX_CONNECTION(connection), out_fd, NULL, NULL);
+            close(out_fd);
+        }
+        g_free(reply);
+        g_free(line);
+        if (!sent) break;
+    }
+    
+    render_job_reset(&job);
+    g_clear_pointer(&job.font, g_free);
+    g_object_unref(in);
+    return TRUE;
+}
+
+// Load fonts and image codecs before the first job arrives
+static void serve_warm_up(void) {
+    gint64 start_time = g_get_monotonic_time();
+    GdkPixbuf *pixbuf = pool_pixbuf_new(TRUE, 64, 32);
+    GdkRGBA color = {0, 0, 0, 1};
+    
+    gdk_pixbuf_fill(pixbuf, 0xffffffff);
+    draw_text_on_pixbuf(pixbuf, 2, 20, "Warm", SERVE_DEFAULT_FONT, &color, NULL);
+    g_slist_free(gdk_pixbuf_get_formats());
+    g_object_unref(pixbuf);
+    
+    g_print("Render server warmed up in %.1f ms\n", (g_get_monotonic_time() - start_time) / 1000.0);
+}
+
+static gboolean on_serve_signal(gpointer loop) {
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean serve_socket_is_live(GSocketAddress *address) {
+    GSocket *probe = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_STREAM,
+                                  G_SOCKET_PROTOCOL_DEFAULT, NULL);
+    gboolean live = probe && g_socket_connect(probe, address, NULL, NULL);
+    
+    g_clear_object(&probe);
+    return live;
+}
+
+// Serve render jobs until interrupted; returns the process exit status
+static int run_render_server(const char *socket_path) {
+    GSocketService *service = g_threaded_socket_service_new(g_get_num_processors());
+    GSocketAddress *address = g_unix_socket_address_new(socket_path);
+    GError *error = NULL;
+    
+    // A socket left behind by a previous server would make bind fail, but
+    // one that still accepts connections belongs to a live server
+    GStatBuf info;
+    if (g_lstat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        if (serve_socket_is_live(address)) {
+            g_printerr("Another render server is already listening on %s\n", socket_path);
+            g_object_unref(address);
+            g_object_unref(service);
+            return 1;
+        }
+        g_unlink(socket_path);
+    }
+    if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address, G_SOCKET_TYPE_STREAM,
+                                       G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &error)) {
+        g_printerr("Could not listen on %s: %s\n", socket_path, error->message);
+        g_error_free(error);
+        g_object_unref(address);
+        g_object_unref(service);
+        return 1;
+    }
+    g_object_unref(address);
+    
+    g_mutex_init(&serve_stats.mutex);
+    serve_warm_up();
+    
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    g_unix_signal_add(SIGINT, on_serve_signal, loop);
+    g_unix_signal_add(SIGTERM, on_serve_signal, loop);
+    g_signal_connect(service, "run", G_CALLBACK(on_serve_connection), NULL);
+    g_socket_service_start(service);
+    g_print("Serving render jobs on %s\n", socket_path);
+    
+    g_main_loop_run(loop);
+    
+    g_socket_service_stop(service);
+    g_socket_listener_close(G_SOCKET_LISTENER(service));
+    g_object_unref(service);
+    g_main_loop_unref(loop);
+    g_unlink(socket_path);
+    
+    g_print("Served %" G_GUINT64_FORMAT " jobs (%" G_GUINT64_FORMAT " failed)\n",
+            serve_stats.jobs, serve_stats.failed);
+    return 0;
+}